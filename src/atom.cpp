@@ -0,0 +1,60 @@
+#include "atom.h"
+#include <cstring>
+#include <new>
+#include <unordered_map>
+
+struct atom::table
+{
+    // key points into the entry
+    std::unordered_map<std::string_view, entry*> entries;
+    size_t bytes = 0;
+};
+
+atom::table& atom::get_table()
+{
+    static table t;
+    return t;
+}
+
+atom::atom(std::string_view str)
+{
+    auto& t = get_table();
+    if (auto it = t.entries.find(str); it != t.entries.end())
+    {
+        m_pEntry = it->second;
+        m_pEntry->refs++;
+        return;
+    }
+
+    auto p = static_cast<char*>(::operator new(sizeof(entry) + str.size()));
+    m_pEntry = new (p) entry{1, uint32_t(str.size())};
+    std::memcpy(p + sizeof(entry), str.data(), str.size());
+
+    t.bytes += str.size();
+    t.entries.emplace(std::string_view(m_pEntry->data(), str.size()), m_pEntry);
+}
+
+atom atom::find(std::string_view str)
+{
+    auto& t = get_table();
+    auto it = t.entries.find(str);
+    if (it == t.entries.end())
+        return atom();
+
+    it->second->refs++;
+    return atom(it->second);
+}
+
+void atom::release(entry* e)
+{
+    auto& t = get_table();
+    t.bytes -= e->len;
+    t.entries.erase(std::string_view(e->data(), e->len));
+    ::operator delete(e);
+}
+
+atom::stats atom::get_stats()
+{
+    auto& t = get_table();
+    return {t.entries.size(), t.bytes};
+}
@@ -1,20 +1,103 @@
 #include "core.h"
 #include "NetCommon/net_message.h"
+#include "NetCommon/net_connection.h"
+
+// calls func for every level of topic name or filter, "a//b" has 3 levels, "/" - 2
+template <typename Func>
+static void for_each_level(std::string_view name, Func func)
+{
+    size_t pos = 0;
+    while (1)
+    {
+        size_t end = name.find('/', pos);
+        func(name.substr(pos, end == std::string_view::npos ? end : end - pos));
+        if (end == std::string_view::npos)
+            return;
+        pos = end + 1;
+    }
+}
+
+uint32_t segment_table_t::find(const segment& seg) const
+{
+    auto it = ids.find(seg);
+    return it != ids.end() ? it->second : NONE;
+}
+
+uint32_t segment_table_t::acquire(const segment& seg)
+{
+    if (auto it = ids.find(seg); it != ids.end())
+    {
+        entries[it->second].refs++;
+        return it->second;
+    }
+
+    uint32_t id;
+    if (freeIDs.size())
+    {
+        id = freeIDs.back();
+        freeIDs.pop_back();
+    }
+    else
+    {
+        id = uint32_t(entries.size());
+        entries.emplace_back();
+    }
+
+    entries[id].str = seg.str;
+    entries[id].refs = 1;
+    ids.emplace(segment{entries[id].str, seg.hash}, id);
+    return id;
+}
+
+topic_level_t* topic_level_t::find_child(uint32_t id)
+{
+    auto it = std::lower_bound(childIDs.begin(), childIDs.end(), id);
+    return (it != childIDs.end() && *it == id) ? &children[size_t(it - childIDs.begin())] : nullptr;
+}
+
+topic_level_t* topic_level_t::add_child(uint32_t id)
+{
+    auto pos = size_t(std::lower_bound(childIDs.begin(), childIDs.end(), id) - childIDs.begin());
+    childIDs.insert(childIDs.begin() + pos, id);
+    auto child = children.emplace(children.begin() + pos);
+    child->segment = id;
+    return &*child;
+}
+
+void topic_level_t::remove_child(uint32_t id)
+{
+    auto pos = size_t(std::lower_bound(childIDs.begin(), childIDs.end(), id) - childIDs.begin());
+    childIDs.erase(childIDs.begin() + pos);
+    children.erase(children.begin() + pos);
+}
+
+void segment_table_t::release(uint32_t id)
+{
+    auto& e = entries[id];
+    if (--e.refs)
+        return;
+
+    ids.erase(segment{e.str, hash(e.str)});
+    e.str.clear();
+    e.str.shrink_to_fit();
+    freeIDs.push_back(id);
+}
 
 std::optional<std::reference_wrapper<pClient>> core_t::find_client(
-        const std::variant<pConnection, std::reference_wrapper<std::string>>& key)
+        const std::variant<std::reference_wrapper<const pConnection>, std::reference_wrapper<std::string>>& key)
 {
-    if (auto netClient = std::get_if<pConnection>(&key))
+    if (auto netClient = std::get_if<std::reference_wrapper<const pConnection>>(&key))
     {
-        auto it = clients.find(*netClient);
-        if (it != clients.end())
-            return it->second;
+        // handle is reset when the connection is taken away from the client
+        client_handle handle = netClient->get()->get_handle();
+        if (get_client(handle))
+            return clientSlots[handle & SLOT_INDEX_MASK].client;
     }
     else if (auto clientID = std::get_if<std::reference_wrapper<std::string>>(&key))
     {
         auto it = clientsIDs.find(clientID->get());
         if (it != clientsIDs.end())
-            return it->second;
+            return clientSlots[it->second & SLOT_INDEX_MASK].client;
     }
 
     return std::nullopt;
@@ -44,26 +127,36 @@ pClient& core_t::add_new_client(std::string&& clientID, pConnection& netClient)
     {
         do {clientID = generate_random_client_id();}
         while (clientsIDs.find(clientID) != clientsIDs.end());
-        std::cout << "GENERATED CLIENT ID:" << clientID << "\n\n";
+        LOG_DEBUG("GENERATED CLIENT ID:" << clientID);
     }
 
-    auto newClient = std::make_shared<client_t>(clientID, netClient);
+    uint32_t index;
+    if (freeSlots.size())
+    {
+        index = freeSlots.back();
+        freeSlots.pop_back();
+    }
+    else
+    {
+        index = uint32_t(clientSlots.size());
+        clientSlots.emplace_back();
+    }
 
-    clientsIDs.emplace(std::move(clientID), newClient);
-    auto res = clients.emplace(netClient, std::move(newClient));
-    // store reference to the key inside value
-    res.first->second->netClient = res.first->first;
+    auto& slot = clientSlots[index];
+    slot.client = std::make_shared<client_t>(clientID, netClient);
+    slot.client->handle = slot.generation << SLOT_INDEX_BITS | index;
+    netClient->set_handle(slot.client->handle);
+    clientsIDs.emplace(std::move(clientID), slot.client->handle);
 
-    return res.first->second;
+    return slot.client;
 }
 
 pClient& core_t::restore_client(pClient& existingClient, pConnection& netClient)
 {
-    auto res = clients.emplace(netClient, existingClient);
-    // store reference to the key inside value
-    existingClient->netClient = res.first->first;
+    existingClient->netClient = netClient;
+    netClient->set_handle(existingClient->handle);
 
-    return res.first->second;
+    return existingClient;
 }
 
 void core_t::delete_client(pClient& client, uint8_t manualControl)
@@ -78,12 +171,9 @@ void core_t::delete_client(pClient& client, uint8_t manualControl)
     else
     {
         // delete all client's subscriptions
-        for (auto it = client->session.subscriptions.begin(); it != client->session.subscriptions.end();)
-        {
-            topic_t& topic = it->second;
-            ++it;
-            unsubscribe(*client, topic);
-        }
+        auto filters = std::move(client->session.subscriptions);
+        for (auto& [topicFilter, qos]: filters)
+            unsubscribe(*client, topicFilter.str());
 
         clientsIDs.erase(client->clientID);
     }
@@ -92,154 +182,358 @@ void core_t::delete_client(pClient& client, uint8_t manualControl)
     client->username.reset();
     client->password.reset();
 
-    clients.erase(client->netClient.get());
+    // connection is no longer associated with the client, stored session doesn't keep it alive
+    if (client->netClient)
+        client->netClient->set_handle(INVALID_CLIENT_HANDLE);
+    client->netClient.reset();
+
+    if (!sessionPresent)
+    {
+        // 'client' can refer to the slot itself, so it's freed last
+        uint32_t index = client->handle & SLOT_INDEX_MASK;
+        auto& slot = clientSlots[index];
+        slot.generation = (slot.generation + 1) & (UINT32_MAX >> SLOT_INDEX_BITS);
+        freeSlots.push_back(index);
+        slot.client.reset();
+    }
 }
 
-std::optional<std::reference_wrapper<topic_t>> core_t::find_topic(const std::string& topicname, bool bCreateIfNotExist)
+std::optional<std::reference_wrapper<topic_t>> core_t::find_topic(std::string_view topicname, bool bCreateIfNotExist)
 {
-    auto topicNode = topics.find(topicname);
-    if (topicNode && topicNode->data)
-        return *topicNode->data;
+    if (auto data = topics.find_data(topicname))
+        return **data;
     else if (bCreateIfNotExist)
     {
         //  create new topic
         auto newTopic = std::make_shared<topic_t>(topicname);
-        topics.insert(topicname, newTopic);
+        topics.insert(newTopic->name.str(), newTopic);
+
+        topic_level_t* node = &topicLevels;
+        for_each_level(topicname, [this, &node](std::string_view level)
+        {
+            segment_table_t::segment seg{level, segment_table_t::hash(level)};
+            uint32_t id = segments.find(seg);
+            if (id != segment_table_t::NONE)
+                if (auto child = node->find_child(id))
+                {
+                    node = child;
+                    return;
+                }
+
+            node = node->add_child(segments.acquire(seg));
+        });
+        node->topic = newTopic.get();
+
         return *newTopic;
     }
     return std::nullopt;
 }
 
-void core_t::subscribe(client_t& client, topic_t& topic, uint8_t qos)
+void core_t::delete_topic(std::string_view topicname)
 {
-    // if client is already subscribed - update it's qos [MQTT-3.8.4-3]
-    if (auto it = topic.subscribers.find(client.clientID);
-             it != topic.subscribers.end())
-        it->second.second = qos;
-    else
-        // add new client to the list of subs
-        topic.subscribers.emplace(client.clientID, topic_t::subscriber(client, qos));
+    std::vector<topic_level_t*> path{&topicLevels};
+    for_each_level(topicname, [this, &path](std::string_view level)
+    {
+        if (!path.back())
+            return;
+        path.push_back(path.back()->find_child(segments.find({level, segment_table_t::hash(level)})));
+    });
 
-    client.session.subscriptions.emplace(topic.name, topic);
+    if (path.back())
+    {
+        path.back()->topic = nullptr;
+        // delete levels that are no longer used by any topic
+        while (path.size() > 1 && !path.back()->topic && path.back()->children.empty())
+        {
+            uint32_t id = path.back()->segment;
+            path.pop_back();
+            path.back()->remove_child(id);
+            segments.release(id);
+        }
+    }
 
+    // name can point into the topic itself, so it goes last
+    topics.erase(topicname);
 }
 
-void core_t::unsubscribe(client_t& client, topic_t& topic)
+std::vector<topic_t*> core_t::get_matching_topics(std::string_view topicFilter)
 {
-    client.session.subscriptions.erase(topic.name);
-    topic.subscribers.erase(client.clientID);
-
-    // delete topic if there is no more subscribers
-    if (!topic.subscribers.size())
-        topics.erase(topic.name);
-}
+    std::vector<topic_t*> matches;
+
+    // levels of the filter as segment IDs, '+' and '#' get IDs that can't be stored
+    const uint32_t SINGLE = segment_table_t::NONE - 1;
+    const uint32_t MULTI  = segment_table_t::NONE - 2;
+    std::vector<uint32_t> filter;
+    bool bNoMatch = false;
+    for_each_level(topicFilter, [this, &filter, &bNoMatch, SINGLE, MULTI](std::string_view level)
+    {
+        if (level == "+")
+            filter.push_back(SINGLE);
+        else if (level == "#")
+            filter.push_back(MULTI);
+        else
+        {
+            // level that no topic has
+            uint32_t id = segments.find({level, segment_table_t::hash(level)});
+            bNoMatch |= (id == segment_table_t::NONE);
+            filter.push_back(id);
+        }
+    });
+    if (bNoMatch)
+        return matches;
 
-std::vector<std::shared_ptr<topic_t>> core_t::get_matching_topics(const std::string& topicFilter)
-{
-    std::vector<std::shared_ptr<topic_t>> matches;
-    std::vector<trie_node<topic_t>*> matchesSoFar;
-    matchesSoFar.push_back(nullptr); // first search is from root
-    std::string prefix = "";
-    bool singleIsLast = false; // true when last symbol is '+'
+    // topics starting with '$' are not matched by filters starting with a wildcard [MQTT-4.7.2-1]
+    auto is_system = [this](const topic_level_t* parent, const topic_level_t& node)
+    {
+        return parent == &topicLevels && segments.str(node.segment).compare(0, 1, "$") == 0;
+    };
 
-    bool multilvl = false;
-    // if there is a '#'(multi-lvl) wildcard, can mean one of two things:
-    // 1) topicFilter == "#" or
-    // 2) '#' is the last symbol of topicFilter
-    if (topicFilter.find("#") != std::string::npos)
+    // first - node, second - index of the filter level to match against it's children
+    std::vector<std::pair<topic_level_t*, size_t>> stack{{&topicLevels, 0}};
+    std::vector<const topic_level_t*> subtree;
+    while (stack.size())
     {
-        // if topicFilter == "#"
-        if (topicFilter.length() == 1)
+        auto [node, i] = stack.back();
+        stack.pop_back();
+
+        if (i == filter.size())
         {
-            // every topic is a match
-            topics.apply_func(prefix, nullptr, [&prefix, &matches](trie_node<topic_t>* t)
-            {
-                if (t->data->name == prefix)
-                    return;
+            if (node->topic)
+                matches.push_back(node->topic);
+            continue;
+        }
 
-                matches.push_back(t->data);
-            });
-            return matches;
+        if (filter[i] == MULTI)
+        {
+            // "a/#" matches "a" as well [MQTT-4.7.1-2]
+            if (node->topic)
+                matches.push_back(node->topic);
+
+            // whole subtree, leaves are taken right from the parent's array
+            subtree.push_back(node);
+            while (subtree.size())
+            {
+                auto n = subtree.back();
+                subtree.pop_back();
+                for (auto& child: n->children)
+                {
+                    if (is_system(n, child))
+                        continue;
+                    if (child.topic)
+                        matches.push_back(child.topic);
+                    if (child.children.size())
+                        subtree.push_back(&child);
+                }
+            }
         }
-        else // we need to evaluate the expr before '#' first
+        else if (filter[i] == SINGLE)
         {
-            multilvl = true;
-            prefix = topicFilter;
+            for (auto& child: node->children)
+                if (!is_system(node, child))
+                    stack.emplace_back(&child, i+1);
         }
+        else if (auto child = node->find_child(filter[i]))
+            stack.emplace_back(child, i+1);
     }
 
-    // if there is a one or more '+'(single lvl) wildcards
-    if (topicFilter.find("+") != std::string::npos)
-    {
-        std::vector<boost::iterator_range<std::string::const_iterator>> singlelvl;
-        boost::find_all(singlelvl, topicFilter, "/+");
-        if (topicFilter[0] == '+')
-            singlelvl.emplace(singlelvl.cbegin(),
-                              boost::iterator_range<std::string::const_iterator>(topicFilter.cbegin(), topicFilter.cbegin()+1));
+    return matches;
+}
 
-        auto start = topicFilter.cbegin();
-        auto end = singlelvl[0].begin()+1;
-        if (topicFilter[0] == '+')
-            start++;
-        if (topicFilter[topicFilter.size()-1] == '+')
-            singleIsLast = true;
+void core_t::subscribe(client_t& client, std::string_view topicFilter, uint8_t qos)
+{
+    subscription_node_t* node = &subscriptions;
+    for_each_level(topicFilter, [&node](std::string_view level)
+    {
+        std::unique_ptr<subscription_node_t>* child;
+        if (level == "+")
+            child = &node->single;
+        else if (level == "#")
+            child = &node->multi;
+        else if (auto it = node->children.find(level); it != node->children.end())
+            child = &it->second;
+        else
+        {
+            auto newNode = std::make_unique<subscription_node_t>();
+            newNode->level = level;
+            std::string_view key = newNode->level;
+            child = &node->children.emplace(key, std::move(newNode)).first->second;
+        }
 
-        uint i = 0;
-        std::vector<trie_node<topic_t>*> temp;
-        do
+        if (!*child)
         {
-            // prefix = everything that comes before "/+", including '/'
-            prefix = std::string(start, end);
+            *child = std::make_unique<subscription_node_t>();
+            (*child)->level = level;
+        }
+        node = child->get();
+    });
 
-            if (singleIsLast && i == singlelvl.size()-1)
-                break;
+    auto it = std::find_if(node->subscribers.begin(), node->subscribers.end(),
+                           [&client](const subscriber& s) { return s.first == client.handle; });
+    if (it != node->subscribers.end())
+        it->second = qos;
+    else
+        node->subscribers.emplace_back(client.handle, qos);
+    client.session.subscriptions[atom(topicFilter)] = qos;
+    invalidate_matches(topicFilter);
+}
 
-            for (uint j = 0; j < matchesSoFar.size(); j++)
-                // +/a   - from matchesSoFar[j](if nullptr - from root) go to "" (prefix) then find all topicnames until '/'
-                // /+/a/ - from matchesSoFar[j](if nullptr - from root) go to / (prefix) then find all topicnames until '/'
-                // /a/+/ - from matchesSoFar[j](if nullptr - from root) go to /a/ (prefix) then find all topicnames until '/'
-                topics.apply_func_key(prefix, matchesSoFar[j], '/',
-                                      [&temp](trie_node<topic_t>* n) { temp.push_back(n); });
+void core_t::unsubscribe(client_t& client, std::string_view topicFilter)
+{
+    // filter that isn't an atom can't be a key of the session
+    if (auto filter = atom::find(topicFilter); !filter.empty())
+        client.session.subscriptions.erase(filter);
 
-            matchesSoFar = std::move(temp);
+    std::vector<subscription_node_t*> path{&subscriptions};
+    bool bFound = true;
+    for_each_level(topicFilter, [&path, &bFound](std::string_view level)
+    {
+        if (!bFound)
+            return;
+
+        subscription_node_t* node = path.back();
+        subscription_node_t* child = nullptr;
+        if (level == "+")
+            child = node->single.get();
+        else if (level == "#")
+            child = node->multi.get();
+        else if (auto it = node->children.find(level); it != node->children.end())
+            child = it->second.get();
+
+        if (child)
+            path.push_back(child);
+        else
+            bFound = false;
+    });
+    if (!bFound)
+        return;
+
+    auto& subscribers = path.back()->subscribers;
+    auto it = std::find_if(subscribers.begin(), subscribers.end(),
+                           [&client](const subscriber& s) { return s.first == client.handle; });
+    if (it != subscribers.end())
+    {
+        *it = subscribers.back();
+        subscribers.pop_back();
+        invalidate_matches(topicFilter);
+    }
 
-            start = singlelvl[i].end()+1;
-            end = singlelvl[i+1].begin()+1;
-            i++;
-        }while (i < singlelvl.size());
+    // delete levels that are no longer used by any filter
+    while (path.size() > 1 && path.back()->empty())
+    {
+        subscription_node_t* node = path.back();
+        path.pop_back();
+        subscription_node_t* parent = path.back();
+        if (parent->single.get() == node)
+            parent->single.reset();
+        else if (parent->multi.get() == node)
+            parent->multi.reset();
+        else
+            parent->children.erase(node->level);
+    }
+}
 
-        start = singlelvl[singlelvl.size()-1].end()+1;
-        end = topicFilter.cend();
-        if (!singleIsLast)
-            prefix = std::string(start, end);
+const std::vector<core_t::subscriber>& core_t::get_subscribers(std::string_view topicname)
+{
+    auto it = matchCache.find(topicname);
+    if (it != matchCache.end())
+    {
+        auto& entry = *it->second;
+        if (entry.generation == subscriptionsGeneration)
+        {
+            matchCacheStats.hits++;
+            return entry.subscribers;
+        }
+
+        matchCacheStats.invalidations++;
+        entry.generation = subscriptionsGeneration;
+        match_subscribers(topicname, entry.subscribers);
+        return entry.subscribers;
     }
 
-    if (multilvl)
+    matchCacheStats.misses++;
+    if (matchCache.size() == MAX_MATCH_CACHE_SIZE)
+        matchCache.clear();
+
+    auto entry = std::make_unique<match_cache_entry>();
+    entry->topicname = atom(topicname);
+    entry->generation = subscriptionsGeneration;
+    match_subscribers(topicname, entry->subscribers);
+    std::string_view key = entry->topicname.str();
+    return matchCache.emplace(key, std::move(entry)).first->second->subscribers;
+}
+
+void core_t::invalidate_matches(std::string_view topicFilter)
+{
+    // filter without wildcards matches only the topic of the same name
+    if (topicFilter.find_first_of("+#") == std::string_view::npos)
     {
-        prefix.pop_back();
-        for (uint i = 0; i < matchesSoFar.size(); i++)
-            topics.apply_func(prefix, matchesSoFar[i],
-                              [&matches](trie_node<topic_t>* n) { matches.push_back(n->data); });
+        if (matchCache.erase(topicFilter))
+            matchCacheStats.invalidations++;
     }
     else
+        subscriptionsGeneration++;
+
+    LOG_DEBUG("[MATCH CACHE]hits: " << matchCacheStats.hits << " misses: " << matchCacheStats.misses
+              << " invalidations: " << matchCacheStats.invalidations << " entries: " << matchCache.size());
+}
+
+void core_t::match_subscribers(std::string_view topicname, std::vector<subscriber>& res)
+{
+    res.clear();
+    size_t nMatchedFilters = 0;
+    auto add = [&res, &nMatchedFilters](const subscription_node_t& node)
     {
-        if (singleIsLast)
-        {
-            for (uint i = 0; i < matchesSoFar.size(); i++)
-                topics.find_all_data_until(prefix, matchesSoFar[i], '/',
-                                           [&matches](trie_node<topic_t>* n) { matches.push_back(n->data); });
-        }
-        else
+        if (node.subscribers.empty())
+            return;
+        nMatchedFilters++;
+        res.insert(res.end(), node.subscribers.begin(), node.subscribers.end());
+    };
+
+    // topics starting with '$' are not matched by filters starting with a wildcard [MQTT-4.7.2-1]
+    bool bSystemTopic = topicname.size() && topicname[0] == '$';
+
+    matchStack.clear();
+    matchStack.emplace_back(&subscriptions, 0);
+    while (matchStack.size())
+    {
+        auto [node, pos] = matchStack.back();
+        matchStack.pop_back();
+
+        bool bWildcardsAllowed = !(pos == 0 && bSystemTopic);
+
+        // all levels of topic name are matched
+        if (pos > topicname.size())
         {
-            for (uint i = 0; i < matchesSoFar.size(); i++)
-            {
-                auto n = topics.find(prefix, matchesSoFar[i]);
-                if (n && n->data)
-                    matches.push_back(n->data);
-            }
+            add(*node);
+            // "a/#" matches "a" as well [MQTT-4.7.1-2]
+            if (node->multi)
+                add(*node->multi);
+            continue;
         }
+
+        if (node->multi && bWildcardsAllowed)
+            add(*node->multi);
+
+        size_t end = topicname.find('/', pos);
+        if (end == std::string_view::npos)
+            end = topicname.size();
+
+        if (auto it = node->children.find(topicname.substr(pos, end - pos)); it != node->children.end())
+            matchStack.emplace_back(it->second.get(), end + 1);
+        if (node->single && bWildcardsAllowed)
+            matchStack.emplace_back(node->single.get(), end + 1);
     }
 
-    return matches;
+    // client subscribed with overlapping filters gets the msg once with the highest qos
+    if (nMatchedFilters > 1)
+    {
+        std::sort(res.begin(), res.end(), [](const subscriber& a, const subscriber& b)
+        {
+            return a.first < b.first || (a.first == b.first && a.second > b.second);
+        });
+        res.erase(std::unique(res.begin(), res.end(), [](const subscriber& a, const subscriber& b)
+        {
+            return a.first == b.first;
+        }), res.end());
+    }
 }
-
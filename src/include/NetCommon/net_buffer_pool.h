@@ -0,0 +1,259 @@
+#ifndef NET_BUFFER_POOL_H
+#define NET_BUFFER_POOL_H
+
+#include "net_common.h"
+#include <array>
+#include <atomic>
+#include <mutex>
+
+namespace tps
+{
+    namespace net
+    {
+        // size-classed free lists for message bodies
+        // every thread keeps it's own free lists, so allocation and release don't take any locks.
+        // since buffers are usually allocated on one thread (io thread receiving packet) and released
+        // on another (dispatcher), threads exchange buffers in batches through a shared depot:
+        // overfull thread list gives a batch to the depot, empty one takes a batch from it.
+        // Free buffers are bounded in bytes, so a burst doesn't keep the memory forever: a thread keeps
+        // fewer buffers of the big classes and the depot gives buffers above it's limit back to the system
+        class buffer_pool
+        {
+        public:
+            // power of two classes from 64 bytes to 64 KB, bigger buffers aren't pooled
+            static constexpr size_t MIN_CLASS_SHIFT = 6;
+            static constexpr size_t MAX_CLASS_SHIFT = 16;
+            static constexpr size_t CLASSES = MAX_CLASS_SHIFT - MIN_CLASS_SHIFT + 1;
+            // max number of buffers of one class kept by a thread and max bytes they take,
+            // half of them is moved on overflow
+            static constexpr size_t THREAD_CACHE_SIZE = 256;
+            static constexpr size_t THREAD_CACHE_BYTES = 1 << 20;
+            // free buffers of all classes kept by the depot
+            static constexpr size_t MAX_DEPOT_BYTES = 32 << 20;
+
+            struct stats
+            {
+                uint64_t allocations;   // total number of allocate() calls
+                uint64_t mallocs;       // allocations that had to go to the system allocator
+                uint64_t frees;         // released buffers given back to the system allocator
+                size_t depotBytes;      // free buffers kept by the depot
+            };
+
+            static void* allocate(size_t size)
+            {
+                s_nAllocations.fetch_add(1, std::memory_order_relaxed);
+
+                size_t cls = size_class(size);
+                if (cls == CLASSES)
+                    return system_allocate(size);
+
+                auto& list = cache().lists[cls];
+                if (list.empty())
+                    depot().take(cls, list);
+                if (list.empty())
+                    return system_allocate(class_size(cls));
+
+                void* p = list.back();
+                list.pop_back();
+                return p;
+            }
+
+            static void deallocate(void* p, size_t size)
+            {
+                size_t cls = size_class(size);
+                if (cls == CLASSES)
+                {
+                    ::operator delete(p);
+                    return;
+                }
+
+                auto& list = cache().lists[cls];
+                if (list.size() == cache_size(cls))
+                    depot().give(cls, list);
+                list.push_back(p);
+            }
+
+            static stats get_stats()
+            {
+                return {s_nAllocations.load(std::memory_order_relaxed), s_nMallocs.load(std::memory_order_relaxed),
+                        s_nFrees.load(std::memory_order_relaxed), depot().bytes.load(std::memory_order_relaxed)};
+            }
+
+        private:
+            static size_t size_class(size_t size)
+            {
+                if (size <= class_size(0))
+                    return 0;
+                size_t cls = size_t(64 - __builtin_clzll(uint64_t(size - 1))) - MIN_CLASS_SHIFT;
+                return std::min(cls, CLASSES);
+            }
+
+            static constexpr size_t class_size(size_t cls)
+            {
+                return size_t(1) << (cls + MIN_CLASS_SHIFT);
+            }
+
+            // buffers of a class kept by a thread, 256 of the small ones down to 16 of 64 KB
+            static constexpr size_t cache_size(size_t cls)
+            {
+                return std::min(THREAD_CACHE_SIZE, std::max<size_t>(THREAD_CACHE_BYTES / class_size(cls), 2));
+            }
+
+            static constexpr size_t batch_size(size_t cls)
+            {
+                return cache_size(cls) / 2;
+            }
+
+            static void* system_allocate(size_t size)
+            {
+                s_nMallocs.fetch_add(1, std::memory_order_relaxed);
+                return ::operator new(size);
+            }
+
+            using free_list = std::vector<void*>;
+
+            struct shared_depot
+            {
+                ~shared_depot()
+                {
+                    for (auto& list: lists)
+                        for (void* p: list)
+                            ::operator delete(p);
+                }
+
+                // move a batch of buffers from the thread's list to the depot, or free them if it's full
+                void give(size_t cls, free_list& list)
+                {
+                    size_t n = batch_size(cls);
+                    size_t batchBytes = n * class_size(cls);
+                    {
+                        const std::lock_guard<std::mutex> lock(mux);
+                        if (bytes.load(std::memory_order_relaxed) + batchBytes <= MAX_DEPOT_BYTES)
+                        {
+                            lists[cls].insert(lists[cls].end(), list.end() - ptrdiff_t(n), list.end());
+                            list.resize(list.size() - n);
+                            bytes.fetch_add(batchBytes, std::memory_order_relaxed);
+                            return;
+                        }
+                    }
+
+                    for (size_t i = 0; i < n; i++)
+                    {
+                        ::operator delete(list.back());
+                        list.pop_back();
+                    }
+                    s_nFrees.fetch_add(n, std::memory_order_relaxed);
+                }
+
+                // move up to a batch of buffers from the depot to the thread's list
+                void take(size_t cls, free_list& list)
+                {
+                    const std::lock_guard<std::mutex> lock(mux);
+                    size_t n = std::min(batch_size(cls), lists[cls].size());
+                    list.insert(list.end(), lists[cls].end() - ptrdiff_t(n), lists[cls].end());
+                    lists[cls].resize(lists[cls].size() - n);
+                    bytes.fetch_sub(n * class_size(cls), std::memory_order_relaxed);
+                }
+
+                std::mutex mux;
+                std::array<free_list, CLASSES> lists;
+                // changed under the lock, atomic for get_stats()
+                std::atomic<size_t> bytes = 0;
+            };
+
+            struct thread_cache
+            {
+                thread_cache()
+                {
+                    for (size_t cls = 0; cls < CLASSES; cls++)
+                        lists[cls].reserve(cache_size(cls));
+                }
+
+                // thread is gone - hand it's buffers over to others
+                ~thread_cache()
+                {
+                    for (size_t cls = 0; cls < CLASSES; cls++)
+                        while (lists[cls].size() >= batch_size(cls))
+                            depot().give(cls, lists[cls]);
+                    for (auto& list: lists)
+                        for (void* p: list)
+                            ::operator delete(p);
+                }
+
+                std::array<free_list, CLASSES> lists;
+            };
+
+            static shared_depot& depot()
+            {
+                static shared_depot d;
+                return d;
+            }
+
+            static thread_cache& cache()
+            {
+                thread_local thread_cache c;
+                return c;
+            }
+
+            static inline std::atomic<uint64_t> s_nAllocations = 0;
+            static inline std::atomic<uint64_t> s_nMallocs = 0;
+            static inline std::atomic<uint64_t> s_nFrees = 0;
+        };
+
+        template <typename T>
+        struct pool_allocator
+        {
+            using value_type = T;
+
+            pool_allocator() = default;
+            template <typename U>
+            pool_allocator(const pool_allocator<U>&) {}
+
+            T* allocate(size_t n)
+            {
+                return static_cast<T*>(buffer_pool::allocate(n * sizeof(T)));
+            }
+
+            void deallocate(T* p, size_t n)
+            {
+                buffer_pool::deallocate(p, n * sizeof(T));
+            }
+
+            template <typename U>
+            bool operator==(const pool_allocator<U>&) const { return true; }
+            template <typename U>
+            bool operator!=(const pool_allocator<U>&) const { return false; }
+        };
+
+        // body of a message, memory comes from the buffer pool
+        using buffer = std::vector<uint8_t, pool_allocator<uint8_t>>;
+
+        // asio handler which operation is allocated from the pool. Asio recycles operations only on
+        // threads that run the io_context, handlers posted by the dispatcher would malloc every time
+        template <typename Handler>
+        struct pool_handler
+        {
+            using allocator_type = pool_allocator<void>;
+            allocator_type get_allocator() const noexcept { return {}; }
+
+            void operator()() { handler(); }
+
+            Handler handler;
+        };
+
+        template <typename Handler>
+        pool_handler<std::decay_t<Handler>> bind_pool(Handler&& handler)
+        {
+            return {std::forward<Handler>(handler)};
+        }
+
+        // buffer shared between receivers, it's control block comes from the pool too
+        template <typename... Args>
+        std::shared_ptr<buffer> make_shared_buffer(Args&&... args)
+        {
+            return std::allocate_shared<buffer>(pool_allocator<buffer>(), std::forward<Args>(args)...);
+        }
+    }
+}
+
+#endif // NET_BUFFER_POOL_H
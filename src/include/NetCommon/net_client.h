@@ -34,7 +34,7 @@ namespace tps
                     asio::ip::tcp::resolver::results_type endpoints = resolver.resolve(host, std::to_string(port));
 
                     m_connection = std::make_shared<connection<T>>(connection<T>::owner::client, nullptr, m_context,
-                                                                   asio::ip::tcp::socket(m_context), m_qMessageIn);
+                                                                   asio::ip::tcp::socket(m_context), &m_qMessageIn);
 
                     m_connection->connect_to_server(endpoints, connectPromise);
 
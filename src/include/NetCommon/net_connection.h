@@ -3,6 +3,8 @@
 
 #include "net_message.h"
 #include "net_tsqueue.h"
+#include "net_timing_wheel.h"
+#include "net_log.h"
 
 namespace tps
 {
@@ -11,6 +13,43 @@ namespace tps
         template <typename T>
         class server_interface;
 
+        // what to do when outbound queue of a connection reaches it's limits
+        enum class slow_consumer_policy
+        {
+            DROP_NEW,       // drop new droppable (QoS 0) msgs
+            DROP_OLDEST,    // drop oldest queued droppable msgs to make room for the new one
+            QUEUE_OFFLINE,  // mark connection as congested, server stores msgs in client's session
+            DISCONNECT      // close the connection
+        };
+
+        // tunables shared by all connections of a server
+        struct connection_options
+        {
+            // size of the per-connection receive buffer, filled by a single read
+            uint32_t rxBufferSize = 16 * 1024;
+            // max number of bytes of queued outgoing messages flushed by a single write
+            uint32_t maxWriteBatchBytes = 64 * 1024;
+
+            // outbound queue watermarks, 0 - no limit
+            uint32_t maxOutMessages = 10000;
+            uint64_t maxOutBytes = 8 * 1024 * 1024;
+            slow_consumer_policy slowConsumerPolicy = slow_consumer_policy::DROP_NEW;
+
+            // inbound credit: connection stops reading when it has maxInPending msgs waiting for the
+            // dispatcher, or when all connections together have maxInPendingTotal msgs waiting
+            uint32_t maxInPending = 1000;
+            uint32_t maxInPendingTotal = 64 * 1024;
+
+            // packets longer than streamThreshold (if the server agrees) are not collected in memory,
+            // they are passed to the dispatcher in parts: first one of streamHeadSize bytes (enough
+            // for the server to route the packet), others of streamChunkSize. Reading is paused while
+            // maxStreamPartsPending parts are waiting for the dispatcher. 0 threshold - no streaming
+            uint32_t streamThreshold = 1024 * 1024;
+            uint32_t streamHeadSize = 64 * 1024 + 4;
+            uint32_t streamChunkSize = 64 * 1024;
+            uint32_t maxStreamPartsPending = 8;
+        };
+
         template <typename T>
         class connection: public std::enable_shared_from_this<connection<T>>
         {
@@ -22,15 +61,18 @@ namespace tps
                 server
             };
 
-            connection(owner parent, server_interface<T>* _server, asio::io_context& asioContext, asio::ip::tcp::socket socket, tsqueue<owned_message<T>>& qIn):
-                       m_socket(std::move(socket)), m_asioContext(asioContext), m_qMessageIn(qIn), m_nOwnerType(parent), m_server(_server), m_writeStrand(asioContext)
+            connection(owner parent, server_interface<T>* _server, asio::io_context& asioContext, asio::ip::tcp::socket socket,
+                       tsqueue<owned_message<T>>* qIn, const connection_options& options = connection_options(),
+                       timing_wheel<connection<T>>* wheel = nullptr):
+                       m_socket(std::move(socket)), m_asioContext(asioContext), m_options(options), m_rxBuffer(options.rxBufferSize),
+                       m_qMessageIn(qIn), m_server(_server), m_nOwnerType(parent), m_wheel(wheel)
             {
 
             }
 
             ~connection()
             {
-                std::cout << "[!]CONNECTION DELETED: "<< m_id << "\n";
+                LOG_DEBUG("[!]CONNECTION DELETED: "<< m_id);
             }
 
             void connect_to_client(uint32_t uid)
@@ -38,8 +80,9 @@ namespace tps
                 if (is_connected())
                 {
                     m_id = uid;
+                    m_bFirstMessage = true;
 
-                    read_first_hdr();
+                    read();
                 }
             }
 
@@ -52,7 +95,7 @@ namespace tps
                     if (!ec)
                     {
                         connectPromise.set_value(true);
-                        read_header();
+                        read();
                     }
                     else
                         connectPromise.set_exception(std::make_exception_ptr(std::runtime_error("[-]Failed to connect to server\n")));
@@ -76,7 +119,8 @@ namespace tps
 
             void notify_server()
             {
-                if (m_nOwnerType == owner::server && bNotifyServer)
+                // notify only once, even if both read and write fail
+                if (m_nOwnerType == owner::server && bNotifyServer.exchange(false))
                     m_server->on_client_disconnect(this->shared_from_this());
             }
 
@@ -90,251 +134,644 @@ namespace tps
                 return m_id;
             }
 
+            // handle of the owner's record of this connection, so the record is found without a lookup
+            // only the owner's thread sets and reads it
+            void set_handle(uint32_t handle)
+            {
+                m_nHandle = handle;
+            }
+
+            uint32_t get_handle() const
+            {
+                return m_nHandle;
+            }
+
+            // close connection if no packet is received within 'mls' milliseconds
+            // packets only update the timestamp of the last activity, deadline itself
+            // is checked by the io thread's timing wheel
             void set_timer(uint32_t mls)
             {
-                m_timer = std::make_pair<asio::deadline_timer, uint32_t>
-                    (asio::deadline_timer(m_asioContext, posix_time::millisec(mls)), uint32_t(mls));
+                if (!m_wheel)
+                    return;
+
+                m_nKeepaliveTicks = m_wheel->to_ticks(mls);
+                m_nLastActivity = m_wheel->now();
+                m_wheel->schedule(this->weak_from_this(), m_nLastActivity + m_nKeepaliveTicks);
+            }
+
+            void on_timing_wheel()
+            {
+                uint64_t deadline = m_nLastActivity + m_nKeepaliveTicks;
+                if (m_wheel->now() < deadline)
+                {
+                    m_wheel->schedule(this->weak_from_this(), deadline);
+                    return;
+                }
+
+                if (is_connected())
+                {
+                    LOG_INFO("[" << m_id << "] Keepalive Timeout");
+                    // read may be paused, so server is notified explicitly
+                    m_socket.close();
+                    notify_server();
+                }
             }
 
             // ASYNC
             template <typename Type>
             void send(Type&& msg)
             {
-                asio::post(m_asioContext, [me = this->shared_from_this(), msg = std::forward<Type>(msg)]() mutable
+                asio::post(m_asioContext, bind_pool([me = this->shared_from_this(), msg = std::forward<Type>(msg)]() mutable
                 {
-                    bool bWritingMessage = !me->m_qMessageOut.empty();
-                    me->m_qMessageOut.push_back(std::forward<Type>(msg));
-                    if (!bWritingMessage)
-                        me->write_header();
-                });
+                    me->enqueue(std::move(msg));
+                }));
             }
 
-            class decode_len_t
+            // outbound queue depth, may be read from any thread
+            size_t out_queue_messages() const { return m_nOutMessages; }
+            size_t out_queue_bytes()    const { return m_nOutBytes; }
+            uint64_t out_dropped()      const { return m_nOutDropped; }
+
+            // true when outbound queue went over the limits with QUEUE_OFFLINE policy,
+            // server should store msgs for this client in it's session instead of sending them
+            bool is_congested() const { return m_bCongested; }
+
+            // append message to the outbound queue applying slow consumer policy if the queue is over the limits
+            void enqueue(message<T>&& msg)
             {
-            public:
-                decode_len_t(message<T>& _m_msgTempIn): m_msgTempIn(_m_msgTempIn){}
+                if (!is_connected())
+                    return;
 
-                std::size_t operator()(const std::error_code& ec, std::size_t)
+                if (msg.part == stream_part::ABORT)
                 {
-                    static uint32_t len = 0;
-                    static uint8_t lenIndex = 0;
+                    abort_stream(msg.streamID);
+                    return;
+                }
 
-                    if (ec)
-                        return 0;
+                // the rest of a stream which first part was dropped
+                auto dropped = std::find(m_droppedStreams.begin(), m_droppedStreams.end(), msg.streamID);
+                if (msg.part != stream_part::NONE && dropped != m_droppedStreams.end())
+                {
+                    if (msg.part == stream_part::LAST)
+                        m_droppedStreams.erase(dropped);
+                    return;
+                }
 
-                    if (!m_msgTempIn.hdr.byte.byte)
-                        return 2;
+                size_t msgBytes = msg.writeHdrSize + msg.wire_body_size();
+                if (is_over_limit(msgBytes))
+                {
+                    // part of a frame that has already been started can't be dropped
+                    if (msg.part == stream_part::MIDDLE || msg.part == stream_part::LAST)
+                    {
+                        LOG_WARN("[" << m_id << "] Slow Consumer: outbound queue limit reached in the middle of a stream");
+                        m_socket.close();
+                        notify_server();
+                        return;
+                    }
 
-                    const uint8_t* const psize = reinterpret_cast<uint8_t*>(&m_msgTempIn.hdr.size);
+                    switch (m_options.slowConsumerPolicy)
+                    {
+                        case slow_consumer_policy::DROP_NEW:
+                            break;
+                        case slow_consumer_policy::DROP_OLDEST:
+                            drop_oldest(msgBytes);
+                            break;
+                        case slow_consumer_policy::QUEUE_OFFLINE:
+                            m_bCongested = true;
+                            break;
+                        case slow_consumer_policy::DISCONNECT:
+                            LOG_WARN("[" << m_id << "] Slow Consumer: outbound queue limit reached");
+                            m_socket.close();
+                            notify_server();
+                            return;
+                    }
 
-                    len |= (psize[lenIndex] & 0x7fu) << 7*(lenIndex);
-                    if ((psize[lenIndex] & 0x80) != 0)
+                    // msgs that can't be dropped (acks, QoS 1/2 PUBLISH) are queued anyway
+                    if (msg.bDroppable && is_over_limit(msgBytes))
                     {
-                        if (++lenIndex < sizeof(m_msgTempIn.hdr.size))
-                            return 1;
-                        else
-                        {
-                            // return imposible size to signal an error
-                            m_msgTempIn.hdr.size = std::numeric_limits<decltype(m_msgTempIn.hdr.size)>::max();
-                            return 0;
-                        }
+                        m_nOutDropped++;
+                        if (msg.part == stream_part::FIRST)
+                            m_droppedStreams.push_back(msg.streamID);
+                        return;
                     }
+                }
 
-                    m_msgTempIn.hdr.size = len;
-                    lenIndex = 0;
-                    len = 0;
+                m_nOutMessages++;
+                m_nOutBytes += msgBytes;
 
-                    return 0;
+                // parts of a stream must be written back to back, other msgs wait until it's complete
+                if (m_nOpenStream ? msg.streamID != m_nOpenStream : !m_qDeferred.empty())
+                {
+                    m_qDeferred.push_back(std::move(msg));
+                    return;
                 }
 
-            private:
-                message<T>& m_msgTempIn;
-            };
+                push_out(std::move(msg));
+                if (!m_nOpenStream && !m_qDeferred.empty())
+                    flush_deferred();
+            }
 
-            inline decode_len_t decode_len(message<T>& m_msgTempIn)
+            void push_out(message<T>&& msg)
             {
-                return decode_len_t(m_msgTempIn);
+                if (msg.part == stream_part::FIRST)
+                    m_nOpenStream = msg.streamID;
+                else if (msg.part == stream_part::LAST)
+                    m_nOpenStream = 0;
+
+                bool bWritingMessage = !m_qMessageOut.empty();
+                m_qMessageOut.push_back(std::move(msg));
+                if (!bWritingMessage)
+                    write();
             }
 
-            // ASYNC
-            void read_header()
+            // move deferred msgs to the outbound queue until a stream that is not complete yet is opened,
+            // every time a stream is closed msgs that were skipped while it was open can go too
+            void flush_deferred()
             {
-                if (m_timer)
-                    m_timer->first.async_wait([this](const std::error_code& ec)
+                auto it = m_qDeferred.begin();
+                while (it != m_qDeferred.end())
+                {
+                    if (m_nOpenStream && it->streamID != m_nOpenStream)
                     {
-                        if (!ec)
-                            m_socket.cancel();
-                    });
+                        it++;
+                        continue;
+                    }
 
-                asio::async_read(m_socket, asio::buffer(&m_msgTempIn.hdr, sizeof(m_msgTempIn.hdr)+1), decode_len(m_msgTempIn),
-                    [me = this->shared_from_this()](const std::error_code& ec, std::size_t)
-                    {
-                        bool bValidRemainingField = (me->m_msgTempIn.hdr.size !=
-                            std::numeric_limits<decltype(me->m_msgTempIn.hdr.size)>::max());
-                        if (!ec && bValidRemainingField)
-                        {
-                            if (me->m_timer)
-                                me->m_timer->first.expires_from_now(boost::posix_time::millisec(me->m_timer->second));
+                    push_out(std::move(*it));
+                    it = m_qDeferred.erase(it);
+                    if (!m_nOpenStream)
+                        it = m_qDeferred.begin();
+                }
+            }
 
-                            if (me->m_msgTempIn.hdr.size > 0)
-                            {
-                                me->m_msgTempIn.body.resize(me->m_msgTempIn.hdr.size);
-                                me->read_body();
-                            }
-                            else
-                                me->add_to_incoming_message_queue();
-                        }
-                        else
-                        {
-                            std::cout << "[" << me->m_id << "] Read Header Fail: " <<
-                                    (bValidRemainingField ? ec.message() : "Invalid remaining length") << "\n";
-                            me->notify_server();
-                        }
-                    });
+            // publisher of the stream is gone
+            void abort_stream(uint64_t streamID)
+            {
+                // receiver has already got a part of the frame, the only way to tell it is to close the connection
+                if (streamID == m_nOpenStream)
+                {
+                    LOG_DEBUG("[" << m_id << "] Stream aborted in the middle of a frame");
+                    m_socket.close();
+                    notify_server();
+                    return;
+                }
+
+                m_droppedStreams.erase(std::remove(m_droppedStreams.begin(), m_droppedStreams.end(), streamID),
+                                       m_droppedStreams.end());
+
+                auto it = std::remove_if(m_qDeferred.begin(), m_qDeferred.end(), [this, streamID](auto& msg)
+                {
+                    if (msg.part == stream_part::NONE || msg.streamID != streamID)
+                        return false;
+                    m_nOutMessages--;
+                    m_nOutBytes -= msg.writeHdrSize + msg.wire_body_size();
+                    return true;
+                });
+                m_qDeferred.erase(it, m_qDeferred.end());
             }
 
-            // ASYNC
-            void read_body()
+            bool is_over_limit(size_t extraBytes) const
             {
-                asio::async_read(m_socket, asio::buffer(m_msgTempIn.body.data(), m_msgTempIn.body.size()),
-                    [me = this->shared_from_this()](const std::error_code& ec, std::size_t)
-                    {
-                        if (!ec)
-                            me->add_to_incoming_message_queue();
-                        else
-                        {
-                            std::cout << "[" << me->m_id << "] Read Body Fail\n";
-                            me->notify_server();
-                        }
-                    });
+                return (m_options.maxOutMessages && m_nOutMessages + 1 > m_options.maxOutMessages) ||
+                       (m_options.maxOutBytes && m_nOutBytes + extraBytes > m_options.maxOutBytes);
+            }
+
+            // drop oldest droppable msgs that are not being written right now until 'extraBytes' fit
+            // msgs are only marked as dropped, since the deque can't be modified in the middle while
+            // the write of it's first elements is in progress
+            void drop_oldest(size_t extraBytes)
+            {
+                for (size_t i = m_nWriteBatch; i < m_qMessageOut.size() && is_over_limit(extraBytes); i++)
+                {
+                    // parts of a stream aren't dropped, the rest of it would be written without it's start
+                    auto& msg = m_qMessageOut[i];
+                    if (!msg.bDroppable || msg.bDropped || msg.part != stream_part::NONE)
+                        continue;
+
+                    m_nOutMessages--;
+                    m_nOutBytes -= msg.writeHdrSize + msg.wire_body_size();
+                    m_nOutDropped++;
+
+                    msg.bDropped = true;
+                    msg.body = buffer();
+                    msg.shared.reset();
+                }
             }
 
             // ASYNC
-            void write_header()
+            // fills receive buffer with as much data as available and hands it to the frame parser,
+            // so a single read can produce any number of packets
+            void read()
             {
-                asio::async_write(m_socket, asio::buffer(&m_qMessageOut.front().hdr,
-                                                          m_qMessageOut.front().writeHdrSize),
-                    m_writeStrand.wrap([me = this->shared_from_this()](const std::error_code& ec, std::size_t)
-                    {
-                        if (!ec)
+                uint32_t bodyLeft = uint32_t(m_msgTempIn.body.size()) - m_parser.bodyRead;
+                if (m_parser.current == frame_parser::stage::BODY && bodyLeft >= m_rxBuffer.size())
+                {
+                    // the rest of the body doesn't fit into receive buffer - read it directly into the message
+                    m_socket.async_read_some(asio::buffer(m_msgTempIn.body.data() + m_parser.bodyRead, bodyLeft),
+                        [me = this->shared_from_this()](const std::error_code& ec, std::size_t length)
                         {
-                            if (me->m_qMessageOut.front().body.size() > 0)
-                                me->write_body();
-                            else
+                            if (!ec)
                             {
-                                me->m_qMessageOut.pop_front();
-                                if (!me->m_qMessageOut.empty())
-                                    me->write_header();
+                                me->m_parser.bodyRead += uint32_t(length);
+                                if (me->m_parser.bodyRead < me->m_msgTempIn.body.size())
+                                    me->read();
+                                else if (me->complete_body())
+                                    me->read_next();
                             }
-                        }
-                        else
-                        {
-                            std::cout << "[" << me->m_id << "] Write Header Fail: " << ec.message() << "\n";
-                            me->notify_server();
-                        }
-                    }));
-            }
+                            else
+                                me->read_fail(ec.message());
+                        });
+                    return;
+                }
 
-            // ASYNC
-            void write_body()
-            {
-                asio::async_write(m_socket, asio::buffer(m_qMessageOut.front().body.data(),
-                                                         m_qMessageOut.front().body.size()),
-                    m_writeStrand.wrap([me = this->shared_from_this()](const std::error_code& ec, std::size_t)
+                m_socket.async_read_some(asio::buffer(m_rxBuffer.data(), m_rxBuffer.size()),
+                    [me = this->shared_from_this()](const std::error_code& ec, std::size_t length)
                     {
                         if (!ec)
                         {
-                                me->m_qMessageOut.pop_front();
-                                if (!me->m_qMessageOut.empty())
-                                    me->write_header();
+                            me->m_nRxStart = 0;
+                            me->m_nRxEnd = length;
+                            if (me->parse())
+                                me->read_next();
                         }
                         else
-                        {
-                            std::cout << "[" << me->m_id << "] Write Body Fail\n";
-                            me->notify_server();
-                        }
-                    }));
+                            me->read_fail(ec.message());
+                    });
             }
 
-            void add_to_incoming_message_queue()
+            // issue next read only if the dispatcher keeps up, otherwise stop reading and
+            // let TCP flow control push the backlog back to the sender. Packets left in the
+            // receive buffer when the credit ran out are parsed before anything else is read
+            void read_next()
             {
-                if (m_nOwnerType == owner::server)
-                    // server has an array of connections, so it needs to know which connection owns incoming message
-                    m_qMessageIn.push_back(owned_message<T>({this->shared_from_this(), std::move(m_msgTempIn)}));
-                else
-                    // client has only 1 connection, this connection will own all of incoming msgs
-                    m_qMessageIn.push_back(owned_message<T>({nullptr, std::move(m_msgTempIn)}));
+                while (has_inbound_credit())
+                {
+                    if (m_nRxStart == m_nRxEnd)
+                    {
+                        read();
+                        return;
+                    }
+                    if (!parse())
+                        return;
+                }
+
+                m_bReadPaused = true;
+                if (m_server && !m_server->has_inbound_credit())
+                    m_server->pause_reading(this->shared_from_this());
+
+                // credit could have been returned while we were pausing
+                if (has_inbound_credit() && m_bReadPaused.exchange(false))
+                    read_next();
+            }
+
+            void resume_read()
+            {
+                if (m_bReadPaused.exchange(false))
+                    read_next();
+            }
+
+            bool has_inbound_credit() const
+            {
+                return m_nInPending < in_pending_limit() &&
+                       (!m_server || m_server->has_inbound_credit());
+            }
+
+            // called by the server when msg of this connection was put in the incoming queue
+            void acquire_inbound_credit()
+            {
+                m_nInPending++;
+            }
+
+            // called by the dispatcher when it has handled a msg of this connection
+            void release_inbound_credit()
+            {
+                if (--m_nInPending <= in_pending_limit()/2 && m_bReadPaused)
+                    post_resume_read();
+            }
 
-                read_header();
+            // each part of a stream holds a chunk of the packet, so much fewer of them may wait
+            uint32_t in_pending_limit() const
+            {
+                return m_bStreaming ? std::min(m_options.maxInPending, m_options.maxStreamPartsPending)
+                                    : m_options.maxInPending;
             }
 
             // ASYNC
-            void read_first_hdr()
+            void post_resume_read()
+            {
+                asio::post(m_asioContext, bind_pool([me = this->shared_from_this()]{ me->resume_read(); }));
+            }
+
+            // feeds received bytes to the frame parser, every complete packet is moved to the incoming queue.
+            // Parsing stops before the next packet when the credit runs out, so that a single read can't
+            // overshoot the limits by thousands of small packets, the rest stays in the receive buffer
+            // returns false if the stream is malformed or the first packet was rejected
+            bool parse()
             {
-                asio::async_read(m_socket, asio::buffer(&m_msgTempIn.hdr, sizeof(m_msgTempIn.hdr)+1), decode_len(m_msgTempIn),
-                    [me = this->shared_from_this()] (const std::error_code& ec, std::size_t)
+                const uint8_t* data = m_rxBuffer.data();
+                size_t length = m_nRxEnd;
+                size_t& i = m_nRxStart;
+                while (i < length)
+                {
+                    switch (m_parser.current)
                     {
-                        bool bValidRemainingField = (me->m_msgTempIn.hdr.size !=
-                                std::numeric_limits<decltype(me->m_msgTempIn.hdr.size)>::max());
-                        if (!ec && bValidRemainingField)
+                        case frame_parser::stage::FIXED_HEADER:
+                            if (!has_inbound_credit())
+                                return true;
+                            m_msgTempIn.hdr.byte.byte = data[i++];
+                            m_msgTempIn.part = stream_part::NONE;
+                            m_parser.len = 0;
+                            m_parser.lenIndex = 0;
+                            m_parser.current = frame_parser::stage::REMAINING_LENGTH;
+                            break;
+                        case frame_parser::stage::REMAINING_LENGTH:
                         {
-                            if (me->m_msgTempIn.hdr.size > 0)
+                            uint8_t byte = data[i++];
+                            m_parser.len |= uint32_t(byte & 0x7fu) << 7*m_parser.lenIndex;
+                            if (byte & 0x80)
                             {
-                                me->m_msgTempIn.body.resize(me->m_msgTempIn.hdr.size);
-                                me->read_first_body();
+                                if (++m_parser.lenIndex == frame_parser::MAX_REMAINING_LENGTH_SIZE)
+                                {
+                                    read_fail("Invalid remaining length");
+                                    return false;
+                                }
+                                break;
                             }
-                            else
+
+                            m_msgTempIn.hdr.size = m_parser.len;
+                            if (m_parser.len > 0)
                             {
-                                if (me->m_server->on_first_message(me->shared_from_this(), me->m_msgTempIn))
-                                    me->add_to_incoming_message_queue();
-                                else
-                                    std::cout << "[" << me->m_id << "] Invalid First Msg Received\n";
+                                m_msgTempIn.body.resize(first_part_size());
+                                m_parser.streamLeft = m_parser.len - uint32_t(m_msgTempIn.body.size());
+                                m_parser.bodyRead = 0;
+                                m_parser.current = frame_parser::stage::BODY;
                             }
+                            else if (!deliver())
+                                return false;
+                            break;
                         }
-                        else
+                        case frame_parser::stage::BODY:
                         {
-                            std::cout << "[" << me->m_id << "] Read First Header Fail: " <<
-                                    (bValidRemainingField ? ec.message() : "Invalid remaining length") << "\n";
+                            uint32_t n = uint32_t(std::min<size_t>(length - i, m_msgTempIn.body.size() - m_parser.bodyRead));
+                            std::memcpy(m_msgTempIn.body.data() + m_parser.bodyRead, data + i, n);
+                            m_parser.bodyRead += n;
+                            i += n;
+
+                            if (m_parser.bodyRead == m_msgTempIn.body.size() && !complete_body())
+                                return false;
+                            break;
                         }
-                    });
+                    }
+                }
+
+                return true;
+            }
+
+            // size of the body buffer for a new packet, whole packet unless it's going to be streamed
+            uint32_t first_part_size()
+            {
+                uint32_t len = m_parser.len;
+                uint32_t head = std::max(m_options.streamHeadSize, m_options.streamChunkSize);
+                if (m_nOwnerType != owner::server || m_bFirstMessage || !m_options.streamThreshold ||
+                    len <= m_options.streamThreshold || len <= head || !m_server->can_stream(m_msgTempIn.hdr))
+                    return len;
+
+                m_msgTempIn.part = stream_part::FIRST;
+                m_msgTempIn.streamID = ++m_nInStreams;
+                m_bStreaming = true;
+                return head;
+            }
+
+            // called when m_msgTempIn body buffer is full
+            bool complete_body()
+            {
+                if (m_msgTempIn.part == stream_part::NONE)
+                    return deliver();
+
+                // moving the msg clears it's header, next part needs it
+                auto hdr = m_msgTempIn.hdr;
+                bool bLast = m_msgTempIn.part == stream_part::LAST;
+                if (!deliver())
+                    return false;
+
+                if (bLast)
+                {
+                    m_bStreaming = false;
+                    return true;
+                }
+
+                uint32_t n = std::min(m_parser.streamLeft, m_options.streamChunkSize);
+                m_parser.streamLeft -= n;
+                m_parser.bodyRead = 0;
+                m_parser.current = frame_parser::stage::BODY;
+
+                m_msgTempIn.hdr = hdr;
+                m_msgTempIn.body.resize(n);
+                m_msgTempIn.part = m_parser.streamLeft ? stream_part::MIDDLE : stream_part::LAST;
+                return true;
+            }
+
+            // called when m_msgTempIn holds a complete packet or a part of it
+            bool deliver()
+            {
+                m_parser.current = frame_parser::stage::FIXED_HEADER;
+
+                if (m_nKeepaliveTicks)
+                    m_nLastActivity = m_wheel->now();
+
+                if (m_bFirstMessage)
+                {
+                    m_bFirstMessage = false;
+                    if (!m_server->on_first_message(this->shared_from_this(), m_msgTempIn))
+                    {
+                        LOG_INFO("[" << m_id << "] Invalid First Msg Received");
+                        return false;
+                    }
+                }
+
+                add_to_incoming_message_queue();
+                return true;
+            }
+
+            void read_fail(const std::string& reason)
+            {
+                LOG_DEBUG("[" << m_id << "] Read Fail: " << reason);
+                // server doesn't know about the client until it's first message is received
+                if (!m_bFirstMessage)
+                    notify_server();
             }
 
             // ASYNC
-            void read_first_body()
+            // flushes everything queued so far (up to maxWriteBatchBytes) with a single gather write
+            void write()
             {
-                asio::async_read(m_socket, asio::buffer(m_msgTempIn.body.data(), m_msgTempIn.body.size()),
+                m_writeBuffers.clear();
+                m_nWriteBatch = 0;
+
+                size_t nBytes = 0;
+                for (auto& msg: m_qMessageOut)
+                {
+                    if (msg.bDropped)
+                    {
+                        // already accounted for in drop_oldest()
+                        m_nWriteBatch++;
+                        continue;
+                    }
+
+                    size_t msgBytes = msg.writeHdrSize + msg.wire_body_size();
+                    uint32_t msgBuffers = msg.shared ? 4 : 2;
+                    if (m_nWriteBatch && (nBytes + msgBytes > m_options.maxWriteBatchBytes ||
+                                          m_writeBuffers.size() + msgBuffers > MAX_WRITE_BUFFERS))
+                        break;
+
+                    // frames packed in one piece have their header in the body
+                    if (msg.writeHdrSize)
+                        m_writeBuffers.emplace_back(&msg.hdr, msg.writeHdrSize);
+                    if (msg.shared && msg.sharedHead)
+                        m_writeBuffers.emplace_back(msg.shared->data(), msg.sharedHead);
+                    if (msg.body.size())
+                        m_writeBuffers.emplace_back(msg.body.data(), msg.body.size());
+                    if (msg.shared && msg.sharedTail < msg.shared->size())
+                        m_writeBuffers.emplace_back(msg.shared->data() + msg.sharedTail,
+                                                    msg.shared->size() - msg.sharedTail);
+
+                    nBytes += msgBytes;
+                    m_nWriteBatch++;
+                }
+                m_nWriteBatchBytes = nBytes;
+
+                asio::async_write(m_socket, buffer_span{m_writeBuffers.data(), m_writeBuffers.data() + m_writeBuffers.size()},
                     [me = this->shared_from_this()](const std::error_code& ec, std::size_t)
                     {
                         if (!ec)
                         {
-                            if (me->m_server->on_first_message(me, me->m_msgTempIn))
-                                me->add_to_incoming_message_queue();
-                            else
-                                std::cout << "[" << me->m_id << "] Invalid First Msg Received\n";
+                            size_t nWritten = 0;
+                            for (size_t i = 0; i < me->m_nWriteBatch; i++)
+                                nWritten += !me->m_qMessageOut[i].bDropped;
+                            me->m_qMessageOut.erase(me->m_qMessageOut.begin(),
+                                                    me->m_qMessageOut.begin() + me->m_nWriteBatch);
+                            me->m_nWriteBatch = 0;
+                            me->m_nOutMessages -= nWritten;
+                            me->m_nOutBytes -= me->m_nWriteBatchBytes;
+
+                            // resume normal delivery once the queue is half empty, msgs saved meanwhile
+                            // are sent right away instead of waiting for the client's next packet
+                            if (me->m_bCongested && !me->is_over_limit(0) &&
+                                (!me->m_options.maxOutBytes || me->m_nOutBytes <= me->m_options.maxOutBytes/2) &&
+                                (!me->m_options.maxOutMessages || me->m_nOutMessages <= me->m_options.maxOutMessages/2))
+                            {
+                                me->m_bCongested = false;
+                                if (me->m_nOwnerType == owner::server)
+                                    me->m_server->on_client_drained(me);
+                            }
+
+                            if (!me->m_qMessageOut.empty())
+                                me->write();
                         }
                         else
-                            std::cout << "[" << me->m_id << "] Read First Body Fail\n";
+                        {
+                            LOG_DEBUG("[" << me->m_id << "] Write Fail: " << ec.message());
+                            me->notify_server();
+                        }
                     });
             }
 
+            void add_to_incoming_message_queue()
+            {
+                if (m_nOwnerType == owner::server)
+                    // server has an array of connections, so it needs to know which connection owns incoming message
+                    m_server->push_incoming(owned_message<T>({this->shared_from_this(), std::move(m_msgTempIn)}));
+                else
+                    // client has only 1 connection, this connection will own all of incoming msgs
+                    m_qMessageIn->push_back(owned_message<T>({nullptr, std::move(m_msgTempIn)}));
+
+            }
+
         private:
             asio::ip::tcp::socket m_socket;
 
+            // connection is bound to one io_context which is run by a single thread,
+            // so all of the connection's handlers are executed sequentially
             asio::io_context& m_asioContext;
-            asio::io_service::strand m_writeStrand;
 
-            tsqueue<message<T>> m_qMessageOut;
+            // accessed only from the connection's io thread
+            std::deque<message<T>, pool_allocator<message<T>>> m_qMessageOut;
+
+            // writev() of one batch, asio doesn't pass more than 64 buffers to a single syscall
+            static constexpr uint32_t MAX_WRITE_BUFFERS = 64;
+            std::vector<asio::const_buffer> m_writeBuffers;
+            // write operation keeps a copy of the buffer sequence, a view of m_writeBuffers is copied
+            // instead of the vector, which would be allocated for every write
+            struct buffer_span
+            {
+                const asio::const_buffer* first;
+                const asio::const_buffer* last;
+                const asio::const_buffer* begin() const { return first; }
+                const asio::const_buffer* end() const { return last; }
+            };
+            size_t m_nWriteBatch = 0;
+            size_t m_nWriteBatchBytes = 0;
+
+            std::atomic<size_t> m_nOutMessages = 0;
+            std::atomic<size_t> m_nOutBytes = 0;
+            std::atomic<uint64_t> m_nOutDropped = 0;
+            std::atomic<bool> m_bCongested = false;
+
+            // outbound stream which parts are being queued, 0 - none
+            uint64_t m_nOpenStream = 0;
+            // msgs that came while a stream was open
+            std::deque<message<T>, pool_allocator<message<T>>> m_qDeferred;
+            std::vector<uint64_t> m_droppedStreams;
 
             message<T> m_msgTempIn;
-            tsqueue<owned_message<T>>& m_qMessageIn;
+
+            // incremental parser of the incoming byte stream, its state survives between reads
+            struct frame_parser
+            {
+                static constexpr uint8_t MAX_REMAINING_LENGTH_SIZE = 4;
+
+                enum class stage
+                {
+                    FIXED_HEADER,
+                    REMAINING_LENGTH,
+                    BODY
+                };
+                stage current = stage::FIXED_HEADER;
+
+                uint32_t len = 0;
+                uint8_t lenIndex = 0;
+                uint32_t bodyRead = 0;
+                // bytes of the streamed packet that come after the current part
+                uint32_t streamLeft = 0;
+            };
+            frame_parser m_parser;
+
+            connection_options m_options;
+            std::vector<uint8_t> m_rxBuffer;
+            // received bytes that haven't been parsed yet
+            size_t m_nRxStart = 0;
+            size_t m_nRxEnd = 0;
+            bool m_bFirstMessage = false;
+
+            // number of this connection's msgs waiting for the dispatcher
+            std::atomic<uint32_t> m_nInPending = 0;
+            std::atomic<bool> m_bReadPaused = false;
+            // a packet is being received in parts
+            std::atomic<bool> m_bStreaming = false;
+            uint64_t m_nInStreams = 0;
+            // incoming queue of the client, server-owned connections pass their msgs to the server
+            tsqueue<owned_message<T>>* m_qMessageIn;
 
             std::atomic<bool> bNotifyServer = true;
             server_interface<T>* m_server;
             owner m_nOwnerType = owner::server;
 
             uint32_t m_id = 0;
+            uint32_t m_nHandle = UINT32_MAX;
 
-            std::optional<std::pair<asio::deadline_timer, uint32_t>> m_timer;
+            timing_wheel<connection<T>>* m_wheel;
+            uint64_t m_nKeepaliveTicks = 0;
+            uint64_t m_nLastActivity = 0;
         };
     }
 }
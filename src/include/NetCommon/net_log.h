@@ -0,0 +1,274 @@
+#ifndef NET_LOG_H
+#define NET_LOG_H
+
+#include "net_common.h"
+#include <atomic>
+#include <mutex>
+#include <shared_mutex>
+#include <sstream>
+#include <string_view>
+#include <unordered_set>
+
+// messages below this level are removed at compile time
+#ifndef TPS_LOG_COMPILE_LEVEL
+#define TPS_LOG_COMPILE_LEVEL 0
+#endif
+
+namespace tps
+{
+    namespace net
+    {
+        enum class log_level: uint8_t
+        {
+            TRACE = 0,
+            DEBUG = 1,
+            INFO  = 2,
+            WARN  = 3,
+            ERROR = 4,
+            OFF   = 5
+        };
+
+        // asynchronous logger
+        // message is formatted on the calling thread only if it's level is enabled, then it's
+        // copied into the thread's own lock-free ring buffer. Background thread collects
+        // messages from all rings and writes them to stdout. If the ring is full the message
+        // is dropped instead of blocking the caller
+        class logger
+        {
+        public:
+            static logger& instance()
+            {
+                static logger l;
+                return l;
+            }
+
+            bool enabled(log_level level) const
+            {
+                return level >= m_level.load(std::memory_order_relaxed);
+            }
+
+            void set_level(log_level level)
+            {
+                m_level = level;
+            }
+
+            // trace messages of specific clients regardless of the global level
+            void trace_client(const std::string& clientID, bool bEnable = true)
+            {
+                const std::unique_lock<std::shared_mutex> lock(m_muxTraced);
+                if (bEnable)
+                    m_traced.insert(clientID);
+                else
+                    m_traced.erase(clientID);
+                m_nTraced = m_traced.size();
+            }
+
+            bool is_traced(std::string_view clientID) const
+            {
+                if (!m_nTraced.load(std::memory_order_relaxed))
+                    return false;
+
+                const std::shared_lock<std::shared_mutex> lock(m_muxTraced);
+                return m_traced.count(std::string(clientID));
+            }
+
+            uint64_t dropped() const
+            {
+                return m_nDropped;
+            }
+
+            // stream to format the message in, reused by all messages of the thread
+            static std::ostringstream& stream()
+            {
+                thread_local std::ostringstream os;
+                return os;
+            }
+
+            // pass formatted message from stream() to the writer thread
+            void commit()
+            {
+                auto& os = stream();
+                os << '\n';
+                auto text = os.str();
+                os.str("");
+
+                if (!local_ring().push(text))
+                    m_nDropped++;
+            }
+
+        private:
+            logger(): m_writer([this](){ writer(); }) {}
+
+            ~logger()
+            {
+                m_bStop = true;
+                m_writer.join();
+            }
+
+            // single producer (owning thread) / single consumer (writer thread) byte ring
+            // each record is it's length followed by the text
+            struct ring
+            {
+                static constexpr size_t SIZE = 1 << 16;
+
+                bool push(const std::string& text)
+                {
+                    uint32_t len = uint32_t(text.size());
+                    size_t tail = m_nTail.load(std::memory_order_relaxed);
+                    if (SIZE - (tail - m_nHead.load(std::memory_order_acquire)) < sizeof(len) + len)
+                        return false;
+
+                    copy_in(tail, reinterpret_cast<const char*>(&len), sizeof(len));
+                    copy_in(tail + sizeof(len), text.data(), len);
+                    m_nTail.store(tail + sizeof(len) + len, std::memory_order_release);
+                    return true;
+                }
+
+                // append all records to 'out', returns false if the ring was empty
+                bool drain(std::string& out)
+                {
+                    size_t head = m_nHead.load(std::memory_order_relaxed);
+                    size_t tail = m_nTail.load(std::memory_order_acquire);
+                    if (head == tail)
+                        return false;
+
+                    while (head != tail)
+                    {
+                        uint32_t len;
+                        copy_out(head, reinterpret_cast<char*>(&len), sizeof(len));
+                        size_t start = out.size();
+                        out.resize(start + len);
+                        copy_out(head + sizeof(len), &out[start], len);
+                        head += sizeof(len) + len;
+                    }
+                    m_nHead.store(head, std::memory_order_release);
+                    return true;
+                }
+
+            private:
+                void copy_in(size_t pos, const char* src, size_t len)
+                {
+                    size_t offset = pos & (SIZE-1);
+                    size_t first = std::min(len, SIZE - offset);
+                    std::memcpy(&m_data[offset], src, first);
+                    std::memcpy(&m_data[0], src + first, len - first);
+                }
+
+                void copy_out(size_t pos, char* dst, size_t len)
+                {
+                    size_t offset = pos & (SIZE-1);
+                    size_t first = std::min(len, SIZE - offset);
+                    std::memcpy(dst, &m_data[offset], first);
+                    std::memcpy(dst + first, &m_data[0], len - first);
+                }
+
+                std::unique_ptr<char[]> m_data = std::make_unique<char[]>(SIZE);
+                alignas(64) std::atomic<size_t> m_nHead = 0;
+                alignas(64) std::atomic<size_t> m_nTail = 0;
+            };
+
+            ring& local_ring()
+            {
+                thread_local std::shared_ptr<ring> r = [this]()
+                {
+                    auto newRing = std::make_shared<ring>();
+                    const std::lock_guard<std::mutex> lock(m_muxRings);
+                    m_rings.push_back(newRing);
+                    return newRing;
+                }();
+                return *r;
+            }
+
+            void writer()
+            {
+                std::string out;
+                while (1)
+                {
+                    bool bStop = m_bStop;
+
+                    std::vector<std::shared_ptr<ring>> rings;
+                    {
+                        const std::lock_guard<std::mutex> lock(m_muxRings);
+                        rings = m_rings;
+                    }
+
+                    bool bWritten = false;
+                    for (auto& r: rings)
+                        bWritten |= r->drain(out);
+
+                    if (bWritten)
+                    {
+                        fwrite(out.data(), 1, out.size(), stdout);
+                        fflush(stdout);
+                        out.clear();
+                    }
+                    else if (bStop)
+                        break;
+                    else
+                        std::this_thread::sleep_for(std::chrono::milliseconds(5));
+
+                    // forget rings of threads that are gone
+                    const std::lock_guard<std::mutex> lock(m_muxRings);
+                    rings.clear();
+                    m_rings.erase(std::remove_if(m_rings.begin(), m_rings.end(), [](auto& r)
+                    {
+                        std::string rest;
+                        return r.use_count() == 1 && !r->drain(rest);
+                    }), m_rings.end());
+                }
+            }
+
+            std::atomic<log_level> m_level = log_level::INFO;
+
+            mutable std::shared_mutex m_muxTraced;
+            std::unordered_set<std::string> m_traced;
+            std::atomic<size_t> m_nTraced = 0;
+
+            std::atomic<uint64_t> m_nDropped = 0;
+
+            std::mutex m_muxRings;
+            std::vector<std::shared_ptr<ring>> m_rings;
+
+            std::atomic<bool> m_bStop = false;
+            std::thread m_writer;
+        };
+    }
+}
+
+// with level 0 nothing is removed and int(level) >= 0 isn't compared, it's always true and warns with -Wtype-limits
+#if TPS_LOG_COMPILE_LEVEL == 0
+#define TPS_LOG_ENABLED(level) (::tps::net::logger::instance().enabled(level))
+#else
+#define TPS_LOG_ENABLED(level) \
+    (int(level) >= TPS_LOG_COMPILE_LEVEL && ::tps::net::logger::instance().enabled(level))
+#endif
+
+// arguments are only evaluated if the message is going to be written
+#define TPS_LOG(level, args)                                        \
+    do {                                                            \
+        if (TPS_LOG_ENABLED(level))                                 \
+        {                                                           \
+            ::tps::net::logger::stream() << args;                   \
+            ::tps::net::logger::instance().commit();                \
+        }                                                           \
+    } while (0)
+
+#define LOG_TRACE(args) TPS_LOG(::tps::net::log_level::TRACE, args)
+#define LOG_DEBUG(args) TPS_LOG(::tps::net::log_level::DEBUG, args)
+#define LOG_INFO(args)  TPS_LOG(::tps::net::log_level::INFO,  args)
+#define LOG_WARN(args)  TPS_LOG(::tps::net::log_level::WARN,  args)
+#define LOG_ERROR(args) TPS_LOG(::tps::net::log_level::ERROR, args)
+
+// trace message that is also written when tracing of 'clientID' is enabled
+#define LOG_CLIENT_TRACE(clientID, args)                                    \
+    do {                                                                    \
+        if (TPS_LOG_COMPILE_LEVEL == 0 &&                                   \
+            (::tps::net::logger::instance().enabled(::tps::net::log_level::TRACE) || \
+             ::tps::net::logger::instance().is_traced(clientID)))           \
+        {                                                                   \
+            ::tps::net::logger::stream() << args;                           \
+            ::tps::net::logger::instance().commit();                        \
+        }                                                                   \
+    } while (0)
+
+#endif // NET_LOG_H
@@ -2,6 +2,7 @@
 #define NET_MESSAGE_H
 
 #include "net_common.h"
+#include "net_buffer_pool.h"
 
 namespace tps
 {
@@ -13,8 +14,8 @@ namespace tps
         {
             message_header() = default;
 
-            message_header(message_header& _hdr): byte(_hdr.byte), size(_hdr.size) {std::cout << "COPYC\n";}
-            message_header(const message_header& _hdr): byte(_hdr.byte), size(_hdr.size) {std::cout << "[" << std::this_thread::get_id() << "]=COPYCC\n";}
+            message_header(message_header& _hdr): byte(_hdr.byte), size(_hdr.size) {}
+            message_header(const message_header& _hdr): byte(_hdr.byte), size(_hdr.size) {}
             message_header& operator=(const message_header& _hdr) {byte = _hdr.byte; size = _hdr.size; return *this;}
 
             message_header(message_header&& _hdr): byte(_hdr.byte), size(_hdr.size) {_hdr.byte = 0; _hdr.size = 0;}
@@ -24,19 +25,63 @@ namespace tps
         };
         #pragma pack(pop)
 
+        // packets above connection_options::streamThreshold are passed on in parts as they arrive
+        enum class stream_part: uint8_t
+        {
+            NONE,       // whole packet
+            FIRST,
+            MIDDLE,
+            LAST,
+            ABORT       // outbound only: the stream won't be completed
+        };
+
+        // connection events are passed to the dispatcher in the same queue as packets, a msg
+        // with an event carries no packet, so a client can't send one
+        enum class msg_event: uint8_t
+        {
+            NONE,       // received packet
+            CLOSED,     // connection was closed without DISCONNECT
+            DRAINED     // congested connection can take msgs again
+        };
+
         template <typename T>
         struct message
         {
             message_header<T> hdr{};
+            // number of hdr bytes written to the socket before the body,
+            // 0 if the whole frame, header included, is packed into the body
             uint8_t writeHdrSize = sizeof(T);
 
-            std::vector<uint8_t> body;
+            buffer body;
+
+            // immutable bytes shared between several messages (e.g. same PUBLISH sent to many subscribers)
+            // on the wire message body is: shared[0, sharedHead) + body + shared[sharedTail, shared.size())
+            std::shared_ptr<const buffer> shared;
+            uint32_t sharedHead = 0, sharedTail = 0;
+
+            // msg may be discarded by the slow consumer policy (QoS 0 PUBLISH)
+            bool bDroppable = false;
+            // msg was discarded while waiting in the outbound queue
+            bool bDropped = false;
+
+            // inbound part has hdr of the whole packet and a piece of it's body,
+            // outbound parts of one stream are written to the socket back to back
+            stream_part part = stream_part::NONE;
+            uint64_t streamID = 0;
+
+            msg_event event = msg_event::NONE;
 
             size_t size() const
             {
                 return hdr.size;
             }
 
+            // number of body bytes that will be written to the socket
+            size_t wire_body_size() const
+            {
+                return body.size() + (shared ? sharedHead + shared->size() - sharedTail : 0);
+            }
+
             // PUSH
             template <typename DataType>
             message& operator<<(const DataType& data)
@@ -66,6 +111,17 @@ namespace tps
                 return *this;
             }
 
+            message& operator<<(std::string_view data)
+            {
+                if (m_end+data.size() > body.size())
+                    body.resize(m_end+data.size());
+
+                std::memcpy(&body[m_end], data.data(), data.size());
+                m_end += data.size();
+
+                return *this;
+            }
+
             message& operator<<(const std::vector<uint8_t>& data)
             {
                 if (m_end+data.size() > body.size())
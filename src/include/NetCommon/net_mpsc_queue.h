@@ -0,0 +1,159 @@
+#ifndef NET_MPSC_QUEUE_H
+#define NET_MPSC_QUEUE_H
+
+#include "net_common.h"
+#include <atomic>
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+namespace tps
+{
+    namespace net
+    {
+        // bounded lock-free multi-producer/single-consumer ring
+        // every cell carries a sequence number that tells whether it's free for the producer
+        // with the matching ticket or holds an item for the consumer (D. Vyukov's bounded queue)
+        // consumer spins for a while when the queue is empty and then sleeps on a futex,
+        // producers only make a syscall to wake it if it's actually sleeping
+        template <typename T>
+        class mpsc_queue
+        {
+        public:
+            // capacity is rounded up to a power of two
+            explicit mpsc_queue(size_t capacity = 1 << 16)
+            {
+                size_t size = 2;
+                while (size < capacity)
+                    size <<= 1;
+
+                m_nMask = size - 1;
+                m_cells = std::make_unique<cell[]>(size);
+                for (size_t i = 0; i < size; i++)
+                    m_cells[i].seq.store(i, std::memory_order_relaxed);
+            }
+
+            mpsc_queue(const mpsc_queue<T>&) = delete;
+
+            ~mpsc_queue()
+            {
+                drain([](T&){}, std::numeric_limits<size_t>::max());
+            }
+
+            // any thread, returns false if the queue is full
+            template <typename Type>
+            bool try_push(Type&& item)
+            {
+                size_t pos = m_nTail.load(std::memory_order_relaxed);
+                cell* c;
+                while (1)
+                {
+                    c = &m_cells[pos & m_nMask];
+                    size_t seq = c->seq.load(std::memory_order_acquire);
+                    intptr_t diff = intptr_t(seq) - intptr_t(pos);
+                    if (diff == 0)
+                    {
+                        if (m_nTail.compare_exchange_weak(pos, pos+1, std::memory_order_relaxed))
+                            break;
+                    }
+                    else if (diff < 0)
+                        return false;
+                    else
+                        pos = m_nTail.load(std::memory_order_relaxed);
+                }
+
+                new (&c->storage) T(std::forward<Type>(item));
+                c->seq.store(pos+1, std::memory_order_release);
+
+                wake_consumer();
+                return true;
+            }
+
+            // any thread, waits while the queue is full
+            template <typename Type>
+            void push_back(Type&& item)
+            {
+                while (!try_push(std::forward<Type>(item)))
+                    std::this_thread::yield();
+            }
+
+            // consumer only, hands up to 'max' items to 'func', returns number of items handled
+            template <typename Func>
+            size_t drain(Func&& func, size_t max)
+            {
+                size_t n = 0;
+                for (; n < max; n++)
+                {
+                    cell& c = m_cells[m_nHead & m_nMask];
+                    if (c.seq.load(std::memory_order_acquire) != m_nHead+1)
+                        break;
+
+                    T* item = std::launder(reinterpret_cast<T*>(&c.storage));
+                    func(*item);
+                    item->~T();
+
+                    c.seq.store(m_nHead + m_nMask + 1, std::memory_order_release);
+                    m_nHead++;
+                }
+                return n;
+            }
+
+            // consumer only
+            bool empty() const
+            {
+                return m_cells[m_nHead & m_nMask].seq.load(std::memory_order_acquire) != m_nHead+1;
+            }
+
+            // consumer only, waits until there is something in the queue
+            void wait()
+            {
+                const uint32_t SPIN_COUNT = 1024;
+                for (uint32_t i = 0; i < SPIN_COUNT; i++)
+                    if (!empty())
+                        return;
+
+                while (1)
+                {
+                    m_nSleeping.store(1, std::memory_order_relaxed);
+                    std::atomic_thread_fence(std::memory_order_seq_cst);
+                    if (!empty())
+                        break;
+
+                    syscall(SYS_futex, reinterpret_cast<uint32_t*>(&m_nSleeping), FUTEX_WAIT_PRIVATE, 1, nullptr, nullptr, 0);
+                    if (!empty())
+                        break;
+                }
+                m_nSleeping.store(0, std::memory_order_relaxed);
+            }
+
+            // consumer only
+            size_t count() const
+            {
+                return m_nTail.load(std::memory_order_relaxed) - m_nHead;
+            }
+
+        private:
+            void wake_consumer()
+            {
+                std::atomic_thread_fence(std::memory_order_seq_cst);
+                if (m_nSleeping.load(std::memory_order_relaxed) && m_nSleeping.exchange(0))
+                    syscall(SYS_futex, reinterpret_cast<uint32_t*>(&m_nSleeping), FUTEX_WAKE_PRIVATE, 1, nullptr, nullptr, 0);
+            }
+
+            struct cell
+            {
+                std::atomic<size_t> seq;
+                typename std::aligned_storage<sizeof(T), alignof(T)>::type storage;
+            };
+
+            std::unique_ptr<cell[]> m_cells;
+            size_t m_nMask;
+
+            alignas(64) std::atomic<size_t> m_nTail = 0;
+            alignas(64) size_t m_nHead = 0;
+            alignas(64) std::atomic<uint32_t> m_nSleeping = 0;
+        };
+    }
+}
+
+#endif // NET_MPSC_QUEUE_H
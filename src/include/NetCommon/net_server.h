@@ -2,6 +2,9 @@
 #define NET_SERVER_H
 
 #include "net_connection.h"
+#include "net_mpsc_queue.h"
+#include "net_log.h"
+#include <pthread.h>
 
 namespace tps
 {
@@ -10,11 +13,33 @@ namespace tps
         template <typename T>
         class server_interface
         {
+        protected:
+            // io_context, acceptor and thread that belong to one core
+            struct worker
+            {
+                worker(): context(1), acceptor(context), wheel(context) {}
+
+                asio::io_context context;
+                asio::ip::tcp::acceptor acceptor;
+                // keepalive deadlines of the worker's connections
+                timing_wheel<connection<T>> wheel;
+                std::thread thread;
+            };
+
         public:
+            // nThreads - number of io threads, each thread runs its own io_context and
+            // accepts connections on its own SO_REUSEPORT acceptor, so the kernel spreads
+            // incoming connections between the threads. Every connection is bound to the
+            // io_context that accepted it for its whole lifetime
+            // Connections check the credit before every packet, so the incoming queue holds at most
+            // maxInPendingTotal msgs and a packet per io thread, plus notices of disconnected and
+            // drained connections. The other half of it is the headroom, io threads don't wait for
+            // the dispatcher
             server_interface(uint16_t port, uint32_t nThreads = 1) :
-                m_asioAcceptor(m_asioContext, asio::ip::tcp::endpoint(asio::ip::tcp::v4(), port)), m_nThreads(nThreads), m_contextThreadPool(nThreads)
+                m_qMessagesIn(2*m_connOptions.maxInPendingTotal), m_nPort(port), m_nThreads(nThreads ? nThreads : 1)
             {
-
+                for (uint32_t i = 0; i < m_nThreads; i++)
+                    m_workers.emplace_back(std::make_unique<worker>());
             }
 
             virtual ~server_interface()
@@ -26,54 +51,72 @@ namespace tps
             {
                 try
                 {
-                    wait_for_client_connection();
+                    for (auto& w: m_workers)
+                    {
+                        open_acceptor(w->acceptor);
+                        wait_for_client_connection(*w);
+                    }
+
+                    uint32_t nCores = std::max(1u, std::thread::hardware_concurrency());
                     for (uint32_t i = 0; i < m_nThreads; i++)
-                        asio::post(m_contextThreadPool, [this](){ m_asioContext.run();});
+                    {
+                        auto& w = *m_workers[i];
+                        w.thread = std::thread([&w](){ w.context.run(); });
+
+                        // pin io thread to a core
+                        cpu_set_t cpuset;
+                        CPU_ZERO(&cpuset);
+                        CPU_SET(i % nCores, &cpuset);
+                        pthread_setaffinity_np(w.thread.native_handle(), sizeof(cpu_set_t), &cpuset);
+                    }
                 } catch (std::exception& e)
                 {
-                    std::cout << "[SERVER]ERROR:" << e.what() << std::endl;
+                    LOG_ERROR("[SERVER]ERROR:" << e.what());
                     return false;
                 }
 
-                std::cout << "[SERVER]Started\n";
+                LOG_INFO("[SERVER]Started, io threads: " << m_nThreads);
                 return true;
             }
 
             void stop()
             {
-                m_asioContext.stop();
-                m_contextThreadPool.join();
-                std::cout << "[SERVER]Stopped\n";
+                for (auto& w: m_workers)
+                    w->context.stop();
+                for (auto& w: m_workers)
+                    if (w->thread.joinable())
+                        w->thread.join();
+                LOG_INFO("[SERVER]Stopped");
             }
 
             // ASYNC
-            void wait_for_client_connection()
+            void wait_for_client_connection(worker& w)
             {
-                m_asioAcceptor.async_accept([this](std::error_code ec, asio::ip::tcp::socket socket)
+                w.acceptor.async_accept([this, &w](std::error_code ec, asio::ip::tcp::socket socket)
                 {
                     if (!ec)
                     {
-                        std::cout << "[SERVER] New connection: " << socket.remote_endpoint() << std::endl;
+                        LOG_DEBUG("[SERVER] New connection: " << socket.remote_endpoint());
                         std::shared_ptr<connection<T>> newconn = std::make_shared<connection<T>>(
-                                    connection<T>::owner::server, this, m_asioContext, std::move(socket), m_qMessagesIn);
+                                    connection<T>::owner::server, this, w.context, std::move(socket), nullptr, m_connOptions, &w.wheel);
 
                         if (on_client_connect(newconn))
                         {
                             newconn->connect_to_client(m_nIDCounter++);
 
-                            std::cout << "[" << newconn->get_ID() << "] Connection approved\n";
+                            LOG_DEBUG("[" << newconn->get_ID() << "] Connection approved");
                         }
                         else
                         {
-                            std::cout << "[-]Connection Denied\n";
+                            LOG_INFO("[-]Connection Denied");
                         }
                     }
                     else
                     {
-                        std::cout << "[-]Accept error: " << ec.message() << std::endl;
+                        LOG_ERROR("[-]Accept error: " << ec.message());
                     }
 
-                    wait_for_client_connection();
+                    wait_for_client_connection(w);
                 });
             }
 
@@ -85,11 +128,67 @@ namespace tps
 
             void update()
             {
+                const size_t MAX_BATCH = 256;
+                const auto STATS_INTERVAL = std::chrono::minutes(1);
+                auto nextStats = std::chrono::steady_clock::now() + STATS_INTERVAL;
                 while (1)
                 {
                     m_qMessagesIn.wait();
-                    auto msg = m_qMessagesIn.pop_front();
-                    on_message(msg.owner, msg.msg);
+                    m_qMessagesIn.drain([this](owned_message<T>& msg)
+                    {
+                        on_message(msg.owner, msg.msg);
+                        release_inbound_credit(msg.owner);
+                    }, MAX_BATCH);
+
+                    // once warm, msgs should take their buffers from the pool, mallocs stay flat
+                    if (auto now = std::chrono::steady_clock::now(); now >= nextStats)
+                    {
+                        nextStats = now + STATS_INTERVAL;
+                        auto st = buffer_pool::get_stats();
+                        LOG_INFO("[BUFFER POOL]allocations: " << st.allocations << " mallocs: " << st.mallocs
+                                 << " frees: " << st.frees << " depot bytes: " << st.depotBytes);
+                    }
+                }
+            }
+
+            void push_incoming(owned_message<T>&& msg)
+            {
+                m_nInPending++;
+                msg.owner->acquire_inbound_credit();
+                m_qMessagesIn.push_back(std::move(msg));
+            }
+
+            bool has_inbound_credit() const
+            {
+                return m_nInPending < m_connOptions.maxInPendingTotal;
+            }
+
+            // connection stopped reading because the dispatcher is too far behind,
+            // it will be resumed once the backlog is halved
+            void pause_reading(std::shared_ptr<connection<T>> conn)
+            {
+                const std::lock_guard<std::mutex> lock(m_muxPaused);
+                m_pausedConnections.emplace_back(std::move(conn));
+                m_nPaused++;
+            }
+
+        private:
+            void release_inbound_credit(std::shared_ptr<connection<T>>& conn)
+            {
+                conn->release_inbound_credit();
+
+                if (--m_nInPending <= m_connOptions.maxInPendingTotal/2 && m_nPaused)
+                {
+                    std::vector<std::weak_ptr<connection<T>>> paused;
+                    {
+                        const std::lock_guard<std::mutex> lock(m_muxPaused);
+                        paused.swap(m_pausedConnections);
+                        m_nPaused = 0;
+                    }
+
+                    for (auto& weak: paused)
+                        if (auto c = weak.lock())
+                            c->post_resume_read();
                 }
             }
 
@@ -115,17 +214,48 @@ namespace tps
 
             }
 
+            // congested connection has written enough of it's outbound queue to take new msgs,
+            // called by the io thread of the connection
+            virtual void on_client_drained(std::shared_ptr<connection<T>>)
+            {
+
+            }
+
+            // whether a packet too long to be kept in memory can be passed to on_message() in parts
+            virtual bool can_stream(const message_header<T>&)
+            {
+                return false;
+            }
+
         protected:
-            tsqueue<owned_message<T>> m_qMessagesIn;
+            connection_options m_connOptions;
 
-            asio::io_context m_asioContext;
+            // filled by io threads, drained by the thread that runs update()
+            mpsc_queue<owned_message<T>> m_qMessagesIn;
 
-            asio::ip::tcp::acceptor m_asioAcceptor;
+            void open_acceptor(asio::ip::tcp::acceptor& acceptor)
+            {
+                using reuse_port = asio::detail::socket_option::boolean<SOL_SOCKET, SO_REUSEPORT>;
 
+                asio::ip::tcp::endpoint endpoint(asio::ip::tcp::v4(), m_nPort);
+                acceptor.open(endpoint.protocol());
+                acceptor.set_option(asio::ip::tcp::acceptor::reuse_address(true));
+                acceptor.set_option(reuse_port(true));
+                acceptor.bind(endpoint);
+                acceptor.listen();
+            }
+
+            uint16_t m_nPort;
             uint32_t m_nThreads = 1;
-            asio::thread_pool m_contextThreadPool;
+            std::vector<std::unique_ptr<worker>> m_workers;
+
+            std::atomic<uint32_t> m_nIDCounter = 10000;
 
-            uint32_t m_nIDCounter = 10000;
+            // global inbound credit
+            std::atomic<size_t> m_nInPending = 0;
+            std::mutex m_muxPaused;
+            std::atomic<size_t> m_nPaused = 0;
+            std::vector<std::weak_ptr<connection<T>>> m_pausedConnections;
         };
     }
 }
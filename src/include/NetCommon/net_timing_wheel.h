@@ -0,0 +1,139 @@
+#ifndef NET_TIMING_WHEEL_H
+#define NET_TIMING_WHEEL_H
+
+#include "net_common.h"
+#include <array>
+
+namespace tps
+{
+    namespace net
+    {
+        // hierarchical timing wheel, one per io thread, must only be used from that thread
+        // level 0 has 256 slots of 1 tick each, every next level has 64 slots, each slot
+        // of level N covers the whole level N-1. Entries of a higher level slot are cascaded
+        // to lower levels when the lower level wraps around, due entries of level 0 are
+        // handed to T::on_timing_wheel() in one batch per tick
+        // entries are not removed when the item's deadline changes - item is expected to check
+        // it's own deadline in on_timing_wheel() and reschedule itself if it's not due yet
+        template <typename T>
+        class timing_wheel
+        {
+        public:
+            timing_wheel(asio::io_context& asioContext, std::chrono::milliseconds tick = std::chrono::milliseconds(100)):
+                m_timer(asioContext), m_tick(tick), m_epoch(std::chrono::steady_clock::now())
+            {
+                arm();
+            }
+
+            // coarse time in ticks, updated once per tick
+            uint64_t now() const
+            {
+                return m_nCurrentTick;
+            }
+
+            uint64_t to_ticks(uint32_t mls) const
+            {
+                return (std::chrono::milliseconds(mls) + m_tick - std::chrono::milliseconds(1)) / m_tick;
+            }
+
+            void schedule(std::weak_ptr<T> item, uint64_t deadline)
+            {
+                insert({std::move(item), std::max(deadline, m_nCurrentTick+1)});
+                m_nEntries++;
+            }
+
+        private:
+            struct entry
+            {
+                std::weak_ptr<T> item;
+                uint64_t deadline;
+            };
+            using slot = std::vector<entry>;
+
+            static constexpr uint32_t LEVEL0_BITS = 8;
+            static constexpr uint32_t LEVELN_BITS = 6;
+            static constexpr uint32_t LEVELS = 4;
+
+            static constexpr uint32_t level_shift(uint32_t level)
+            {
+                return level ? LEVEL0_BITS + (level-1)*LEVELN_BITS : 0;
+            }
+
+            static constexpr uint32_t level_mask(uint32_t level)
+            {
+                return level ? (1u << LEVELN_BITS) - 1 : (1u << LEVEL0_BITS) - 1;
+            }
+
+            void insert(entry&& e)
+            {
+                uint64_t delta = e.deadline - m_nCurrentTick;
+
+                uint32_t level = 0;
+                while (level < LEVELS-1 && delta >> level_shift(level+1))
+                    level++;
+
+                // deadlines beyond the last level are parked in it's farthest slot and cascaded again
+                uint64_t deadline = e.deadline;
+                if (level == LEVELS-1 && delta >> (level_shift(LEVELS-1) + LEVELN_BITS))
+                    deadline = m_nCurrentTick + (uint64_t(level_mask(level)) << level_shift(level));
+
+                m_levels[level][(deadline >> level_shift(level)) & level_mask(level)].push_back(std::move(e));
+            }
+
+            // ASYNC
+            // wheel ticks all the time, so that now() is always up to date
+            void arm()
+            {
+                m_timer.expires_at(m_epoch + m_tick*(m_nCurrentTick+1));
+                m_timer.async_wait([this](const std::error_code& ec)
+                {
+                    if (ec)
+                        return;
+
+                    uint64_t target = (std::chrono::steady_clock::now() - m_epoch) / m_tick;
+                    while (m_nCurrentTick < target)
+                        advance();
+
+                    arm();
+                });
+            }
+
+            void advance()
+            {
+                m_nCurrentTick++;
+
+                // cascade higher levels when lower level wraps around, starting from
+                // the highest one, so that it's entries can be cascaded further down
+                uint32_t top = 0;
+                while (top < LEVELS-1 && !(m_nCurrentTick & ((uint64_t(1) << level_shift(top+1)) - 1)))
+                    top++;
+
+                for (uint32_t level = top; level > 0; level--)
+                {
+                    slot cascade;
+                    cascade.swap(m_levels[level][(m_nCurrentTick >> level_shift(level)) & level_mask(level)]);
+                    for (auto& e: cascade)
+                        insert(std::move(e));
+                }
+
+                slot due;
+                due.swap(m_levels[0][m_nCurrentTick & level_mask(0)]);
+                m_nEntries -= due.size();
+
+                for (auto& e: due)
+                    if (auto item = e.item.lock())
+                        item->on_timing_wheel();
+            }
+
+            std::array<std::array<slot, 1u << LEVEL0_BITS>, LEVELS> m_levels;
+            size_t m_nEntries = 0;
+            uint64_t m_nCurrentTick = 0;
+
+            asio::steady_timer m_timer;
+            std::chrono::milliseconds m_tick;
+            std::chrono::steady_clock::time_point m_epoch;
+        };
+    }
+}
+
+#endif // NET_TIMING_WHEEL_H
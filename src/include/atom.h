@@ -0,0 +1,90 @@
+#ifndef ATOM_H
+#define ATOM_H
+
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <string_view>
+
+// immutable string stored once in a global table, copies of an atom share it
+// equal strings are the same atom, so atoms are compared and hashed as pointers
+// string is removed from the table when it's last atom is destroyed
+// atoms aren't thread safe, they are only created and destroyed by the dispatcher thread
+class atom
+{
+public:
+    atom() = default;
+    // adds the string to the table if it isn't there yet
+    explicit atom(std::string_view str);
+
+    atom(const atom& other): m_pEntry(other.m_pEntry)
+    {
+        if (m_pEntry)
+            m_pEntry->refs++;
+    }
+
+    atom(atom&& other) noexcept: m_pEntry(other.m_pEntry)
+    {
+        other.m_pEntry = nullptr;
+    }
+
+    atom& operator=(atom other) noexcept
+    {
+        std::swap(m_pEntry, other.m_pEntry);
+        return *this;
+    }
+
+    ~atom()
+    {
+        if (m_pEntry && !--m_pEntry->refs)
+            release(m_pEntry);
+    }
+
+    // atom of the string if it's in the table, empty atom otherwise, nothing is added
+    static atom find(std::string_view str);
+
+    std::string_view str() const { return m_pEntry ? std::string_view(m_pEntry->data(), m_pEntry->len) : std::string_view(); }
+    bool empty() const { return !m_pEntry; }
+
+    bool operator==(const atom& other) const { return m_pEntry == other.m_pEntry; }
+    bool operator!=(const atom& other) const { return m_pEntry != other.m_pEntry; }
+
+    struct stats
+    {
+        size_t strings;     // distinct strings in the table
+        size_t bytes;       // their total length
+    };
+    static stats get_stats();
+
+private:
+    // characters follow the entry in the same allocation
+    struct entry
+    {
+        uint32_t refs;
+        uint32_t len;
+
+        const char* data() const { return reinterpret_cast<const char*>(this + 1); }
+    };
+
+    // defined in atom.cpp, created on first use
+    struct table;
+    static table& get_table();
+
+    explicit atom(entry* e): m_pEntry(e) {}
+    static void release(entry* e);
+
+    entry* m_pEntry = nullptr;
+
+    friend struct std::hash<atom>;
+};
+
+namespace std
+{
+    template<>
+    struct hash<atom>
+    {
+        size_t operator()(const atom& a) const { return hash<const void*>()(a.m_pEntry); }
+    };
+}
+
+#endif // ATOM_H
@@ -3,14 +3,18 @@
 
 #include <set>
 #include <map>
+#include <deque>
 #include <unordered_map>
 #include <memory>
 #include <iostream>
 #include <variant>
 #include <boost/algorithm/string.hpp>
 #include "trie.h"
+#include "atom.h"
 #include "mqtt.h"
-#include "keypool.h"
+#include "packet_id_pool.h"
+#include "offline_queue.h"
+#include "NetCommon/net_log.h"
 
 typedef struct core core_t;
 typedef struct topic topic_t;
@@ -21,27 +25,71 @@ namespace tps::net {template <typename T> class connection;}
 using pClient = std::shared_ptr<client_t>;
 using pConnection = std::shared_ptr<tps::net::connection<mqtt_header>>;
 
+// index of client's slot in core_t's client table and generation of the slot, generation changes
+// when the slot is freed, so handles of deleted clients don't resolve to the next owner of the slot
+using client_handle = uint32_t;
+constexpr client_handle INVALID_CLIENT_HANDLE = UINT32_MAX;
+
 struct session
 {
     // if cleanSession == 0 store all data from this struct until the client with same clientID arrives
     bool cleanSession;
 
-    // key - topic name, value - ref to topic struct
-    std::unordered_map<std::string, topic_t&> subscriptions;
+    // key - topic filter, value - maximum qos
+    // filters are atoms, so sessions subscribed to the same filter share it's string
+    std::unordered_map<atom, uint8_t> subscriptions;
+
+    // pkt IDs of unacknowledged msgs with expected ack types
+    packet_id_pool<> pool;
 
-    // first - expected ack pkt ID, second - expected ack type
-    KeyPool<uint16_t, packet_type> pool;
+    // outbound QoS 1 and 2 msgs waiting for PUBACK or PUBCOMP in the order they were sent,
+    // they share storage with the published msg
+    std::deque<mqtt_publish> inflight;
 
-    // messages that were published while client was inactive
-    std::vector<mqtt_publish> savedMsgs;
+    // messages that were published while client was inactive or had the in-flight window full,
+    // the queue is bounded and can spill to disk
+    offline_queue savedMsgs;
+};
+
+// PUBLISH too long to be kept in memory, it's relayed to subscribers part by part as it's received
+struct publish_stream
+{
+    // ID of the outbound stream, same for all receivers
+    uint64_t id = 0;
+
+    // topic and pkt ID point into the first part
+    mqtt_publish pkt;
+    std::shared_ptr<const tps::net::buffer> head;
+    uint32_t payloadLen = 0;
+
+    // QoS 2 msg that has already been published, parts are ignored
+    bool bDiscard = false;
+
+    std::vector<pConnection> receivers;
+
+    // receivers that got the msg with QoS 1 or 2, it's in their in-flight window only by pkt ID until
+    // it's collected, then it's kept whole so that it can be resent on session resume
+    struct inflight_receiver
+    {
+        client_handle handle;
+        uint16_t pktID;
+        pConnection netClient;
+    };
+    std::vector<inflight_receiver> inflight;
+
+    // whole msg is only collected when it has to be retained, kept in-flight or saved for inactive or
+    // congested subscribers, first - client handle, second - QoS
+    std::vector<std::pair<client_handle, uint8_t>> offline;
+    std::optional<tps::net::buffer> collected;
 };
 
 typedef struct client
 {
     client(const std::string& _clientID, pConnection& _netClient): clientID(_clientID), netClient(_netClient){}
-    ~client() {std::cout << "[!]CLIENT DELETED:" << clientID << "\n";}
+    ~client() {LOG_DEBUG("[!]CLIENT DELETED:" << clientID);}
 
     std::string clientID;
+    client_handle handle = INVALID_CLIENT_HANDLE;
 
     // if client connected with clean session == 0, then, after disconnection,
     // information about client(session) is not getting deleted, instead we set active = false
@@ -57,33 +105,120 @@ typedef struct client
 
     uint16_t keepalive;
 
-    std::reference_wrapper<const pConnection> netClient;
+    // PUBLISH that is being received from the client in parts
+    std::optional<publish_stream> stream;
+
+    // connection of the active client, none while the session is stored
+    pConnection netClient;
 }client_t;
 
 typedef struct topic
 {
-    topic(const std::string& _name): name(_name) {}
-    ~topic() {std::cout << "[!]TOPIC DELETED:" << name << "\n";}
+    topic(std::string_view _name): name(_name) {}
+    ~topic() {LOG_DEBUG("[!]TOPIC DELETED:" << name.str());}
 
-    std::string name;
+    atom name;
 
     std::optional<mqtt_publish> retain;
-
-    // first - client ref, second - maximum qos level at which the server can send msgs to the client
-    using subscriber = std::pair<client_t&, uint8_t>;
-    // key - client ID
-    std::unordered_map<std::string, subscriber> subscribers;
 }topic_t;
 
+// every distinct level of topic names is stored once and referred to by it's ID
+typedef struct segment_table
+{
+    static constexpr uint32_t NONE = UINT32_MAX;
+
+    // level of a topic name or filter with it's hash, computed once when the name is split
+    struct segment
+    {
+        std::string_view str;
+        size_t hash;
+    };
+
+    static size_t hash(std::string_view str) { return std::hash<std::string_view>()(str); }
+
+    uint32_t find(const segment& seg) const;
+    // ID of the level, stored if it's new, every acquire has to be paired with release
+    uint32_t acquire(const segment& seg);
+    void release(uint32_t id);
+
+    const std::string& str(uint32_t id) const { return entries[id].str; }
+
+private:
+    struct seg_hash  { size_t operator()(const segment& s) const { return s.hash; } };
+    struct seg_equal { bool operator()(const segment& a, const segment& b) const { return a.str == b.str; } };
+
+    struct entry
+    {
+        std::string str;
+        uint32_t refs = 0;
+    };
+
+    // key points into 'entries', deque doesn't move them
+    std::unordered_map<segment, uint32_t, seg_hash, seg_equal> ids;
+    std::deque<entry> entries;
+    std::vector<uint32_t> freeIDs;
+}segment_table_t;
+
+// one level of topic names, topic is kept in the node of it's last level
+// children are stored in place and sorted by segment ID, so a wildcard walks them sequentially
+// and the search by ID doesn't touch them
+typedef struct topic_level
+{
+    uint32_t segment = segment_table_t::NONE;
+
+    std::vector<uint32_t> childIDs;
+    std::vector<topic_level> children;
+
+    // owned by core_t::topics
+    topic_t* topic = nullptr;
+
+    topic_level* find_child(uint32_t id);
+    // pointers to other children are invalidated
+    topic_level* add_child(uint32_t id);
+    void remove_child(uint32_t id);
+}topic_level_t;
+
+// one level of topic filters, subscribers of a filter are kept in the node of it's last level
+typedef struct subscription_node
+{
+    std::string level;
+
+    // key - level of the child, points into child's 'level'
+    std::unordered_map<std::string_view, std::unique_ptr<subscription_node>> children;
+    // '+' and '#' levels
+    std::unique_ptr<subscription_node> single;
+    std::unique_ptr<subscription_node> multi;
+
+    // first - client, second - maximum qos level at which the server can send msgs to the client
+    // unordered, filters with many subscribers are walked on every publish and rarely change
+    std::vector<std::pair<client_handle, uint8_t>> subscribers;
+
+    bool empty() const
+    {
+        return subscribers.empty() && children.empty() && !single && !multi;
+    }
+}subscription_node_t;
+
 // manages the lifetime of client_t and topic_t objects
 // provides means for client and topic creation, search and deletion
+// subscriptions are kept in a tree of filter levels, subscribers of a topic are matched against it
+// on every publish, so topics exist only to keep retained msgs
 typedef struct core
 {
 public:
     // ===========CLIENTS===========
     // client struct can be found either by clientID or client's corresponding connection object
+    // connection carries the handle of it's client, so the search by connection is an array access
     std::optional<std::reference_wrapper<pClient>> find_client(
-        const std::variant<pConnection, std::reference_wrapper<std::string>>& key);
+        const std::variant<std::reference_wrapper<const pConnection>, std::reference_wrapper<std::string>>& key);
+    // nullptr if the client was deleted
+    client_t* get_client(client_handle handle)
+    {
+        uint32_t index = handle & SLOT_INDEX_MASK;
+        if (index >= clientSlots.size() || clientSlots[index].generation != handle >> SLOT_INDEX_BITS)
+            return nullptr;
+        return clientSlots[index].client.get();
+    }
     pClient& add_new_client  (std::string &&clientID,  pConnection& netClient);
     pClient& restore_client  (pClient& existingClient, pConnection& netClient);
 
@@ -100,21 +235,82 @@ public:
 
     // ===========TOPICS===========
     // find topic named topicname, if bCreateIfNotExist == true - create new topic if none was found
-    std::optional<std::reference_wrapper<topic_t>> find_topic(const std::string& topicname,
+    std::optional<std::reference_wrapper<topic_t>> find_topic(std::string_view topicname,
                                                               bool bCreateIfNotExist = false);
-    // subscribe client to topic
-    void subscribe  (client_t& client, topic_t& topic, uint8_t qos);
-    // unsubscribe client from topic, delete topic if it has no subscribers left
-    void unsubscribe(client_t& client, topic_t& topic);
+    void delete_topic(std::string_view topicname);
 
     // find all topics that correspond to topicFilter string, that contains wildcards
-    std::vector<std::shared_ptr<topic_t>> get_matching_topics(const std::string& topicFilter);
+    // filter is split into segment IDs once, then the tree of topic levels is walked
+    // topics stay valid until one of them is deleted
+    std::vector<topic_t*> get_matching_topics(std::string_view topicFilter);
+
+    // ========SUBSCRIPTIONS========
+    // subscribe client to topic filter, if client is already subscribed - update it's qos [MQTT-3.8.4-3]
+    void subscribe  (client_t& client, std::string_view topicFilter, uint8_t qos);
+    void unsubscribe(client_t& client, std::string_view topicFilter);
+
+    // first - client, second - maximum qos level at which the server can send msgs to the client
+    using subscriber = std::pair<client_handle, uint8_t>;
+    // clients subscribed to filters that match topicname, every client appears once with the highest
+    // qos of it's matching filters. Lists of published topics are cached until subscriptions change,
+    // returned list is valid until the next call
+    const std::vector<subscriber>& get_subscribers(std::string_view topicname);
+
+    struct match_cache_stats
+    {
+        uint64_t hits;          // list was taken from the cache
+        uint64_t misses;        // topic wasn't in the cache
+        uint64_t invalidations; // cached list was dropped because subscriptions changed
+    };
+    match_cache_stats get_match_cache_stats() const { return matchCacheStats; }
 
 private:
-    std::unordered_map<pConnection, pClient> clients;
-    std::unordered_map<std::string, pClient> clientsIDs;
+    // clients are kept in slots, freed slots are reused, so handles stay dense
+    // deque doesn't move the slots, references to pClient stay valid while clients are added
+    struct client_slot
+    {
+        pClient client;
+        uint32_t generation = 0;
+    };
+    // up to 4M clients, slot can be reused 1024 times before it's handles repeat
+    static constexpr uint32_t SLOT_INDEX_BITS = 22;
+    static constexpr uint32_t SLOT_INDEX_MASK = (1u << SLOT_INDEX_BITS) - 1;
+    std::deque<client_slot> clientSlots;
+    std::vector<uint32_t> freeSlots;
+    std::unordered_map<std::string, client_handle> clientsIDs;
 
+    // exact lookup by name
     trie<topic_t> topics;
+    // same topics by levels, for wildcard matching
+    topic_level_t topicLevels;
+    segment_table_t segments;
+
+    subscription_node_t subscriptions;
+    // nodes to visit while matching, first - node, second - position of the next level in topic name
+    std::vector<std::pair<const subscription_node_t*, size_t>> matchStack;
+
+    // walk of the subscription tree, cost depends on the number of levels in topicname,
+    // not on the number of topics or subscriptions
+    void match_subscribers(std::string_view topicname, std::vector<subscriber>& res);
+    // drop cached lists that topicFilter matches
+    void invalidate_matches(std::string_view topicFilter);
+
+    // clients are stored by handle, which stays the same while they are subscribed (across
+    // reconnections too) and their state is checked on delivery, so only subscribe and
+    // unsubscribe change the lists
+    struct match_cache_entry
+    {
+        atom topicname;
+        uint64_t generation;
+        std::vector<subscriber> subscribers;
+    };
+    static constexpr size_t MAX_MATCH_CACHE_SIZE = 1 << 16;
+    // key points into entry's topicname
+    std::unordered_map<std::string_view, std::unique_ptr<match_cache_entry>> matchCache;
+    // changes when a filter with wildcards is subscribed to or unsubscribed from, all lists
+    // made before that are stale
+    uint64_t subscriptionsGeneration = 0;
+    match_cache_stats matchCacheStats{};
 }core_t;
 
 #endif // CORE_H
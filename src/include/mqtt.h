@@ -4,6 +4,9 @@
 #include <memory>
 #include <vector>
 #include <string>
+#include <string_view>
+#include <variant>
+#include "NetCommon/net_buffer_pool.h"
 
 /*
  * Stub bytes, useful for generic replies, these represent the first byte in
@@ -41,7 +44,32 @@ enum class packet_type: uint8_t
 
 enum qos_level {AT_MOST_ONCE, AT_LEAST_ONCE, EXACTLY_ONCE};
 
+/* Result of unpacking a received packet */
+enum class parse_error: uint8_t
+{
+    NONE,
+    TRUNCATED,          // packet is shorter than it's fields say
+    TRAILING_DATA,      // bytes left after the last field
+    INVALID_FLAGS,      // fixed header flags don't match packet type
+    PROTOCOL_NAME,      // [MQTT-3.1.2-1]
+    RESERVED_BIT,       // [MQTT-3.1.2-3]
+    CLIENT_ID_LEN,      // [MQTT-3.1.3-5]
+    WILL_FLAGS,         // [MQTT-3.1.2-13], [MQTT-3.1.2-15]
+    INVALID_QOS,        // [MQTT-3.3.1-4], [MQTT-3-8.3-4]
+    PASSWORD_FLAG,      // [MQTT-3.1.2-22]
+    NO_TOPICS,          // [MQTT-3.8.3-3], [MQTT-3.10.3-2]
+    EMPTY_TOPIC,        // [MQTT-4.7.3-1]
+    MALFORMED_UTF8,     // [MQTT-1.5.3-1]
+    NULL_CHARACTER,     // [MQTT-1.5.3-2]
+    WILDCARD_IN_TOPIC,  // [MQTT-3.3.2-2]
+    INVALID_WILDCARD,   // [MQTT-4.7.1-2], [MQTT-4.7.1-3]
+    RESERVED_TYPE       // packet types 0 and 15 are reserved (2.2.1)
+};
+
+const char* to_string(parse_error err);
+
 namespace tps::net {template <typename T> struct message;}
+struct mqtt_writer;
 
 union mqtt_header
 {
@@ -66,20 +94,24 @@ struct mqtt_packet
     mqtt_packet() = default;
     mqtt_packet(uint8_t _hdr): header(_hdr){}
 
-    virtual ~mqtt_packet() = default;
-
     union mqtt_header header;
 
-    template<typename T>
-    static std::unique_ptr<T> create(uint8_t hdr)
-    {
-        return std::unique_ptr<T>(new T(hdr));
-    }
+    // packets are a closed set of plain structs (see mqtt_any), nothing is virtual -
+    // every derived packet hides pack/unpack of the base with it's own
 
-    static std::unique_ptr<mqtt_packet> create(tps::net::message<mqtt_header>& msg);
+    // frame is encoded in one go: exact size is computed first, then fixed header,
+    // remaining length, variable header and payload are written into a contiguous buffer
+    size_t packed_size() const;
+    // 'out' must have at least packed_size() bytes, returns the end of the frame
+    uint8_t* pack(uint8_t* out) const;
+    // whole frame goes into msg body, allocated once
+    void pack(tps::net::message<mqtt_header>& msg) const;
 
-    virtual void pack(tps::net::message<mqtt_header>&) const;
-    virtual void unpack(tps::net::message<mqtt_header> &);
+    uint32_t remaining_length() const;
+    void pack_body(mqtt_writer& w) const;
+    // string fields of unpacked packets are views into msg body,
+    // so the packet must not outlive the msg it was unpacked from
+    parse_error unpack(const tps::net::message<mqtt_header>& msg);
 
     friend std::ostream& operator<< (std::ostream& os, const mqtt_packet& pkt);
 };
@@ -114,17 +146,17 @@ struct mqtt_connect: public mqtt_packet
         payload(): protocolLevel(0), keepalive(0) {}
         uint8_t protocolLevel;
         uint16_t keepalive;
-        std::string clientID;
-        std::string username;
-        std::string password;
-        std::string willTopic;
-        std::string willMessage;
+        std::string_view clientID;
+        std::string_view username;
+        std::string_view password;
+        std::string_view willTopic;
+        std::string_view willMessage;
     };
     payload payload;
 
     friend std::ostream& operator<< (std::ostream& os, const mqtt_connect& pkt);
 
-    void unpack(tps::net::message<mqtt_header>& msg) override;
+    parse_error unpack(const tps::net::message<mqtt_header>& msg);
 };
 
 struct mqtt_connack: public mqtt_packet
@@ -147,7 +179,12 @@ struct mqtt_connack: public mqtt_packet
 
     friend std::ostream& operator<< (std::ostream& os, const mqtt_connack& pkt);
 
-    void pack(tps::net::message<mqtt_header>& msg) const override;
+    size_t packed_size() const;
+    uint8_t* pack(uint8_t* out) const;
+    void pack(tps::net::message<mqtt_header>& msg) const;
+
+    uint32_t remaining_length() const;
+    void pack_body(mqtt_writer& w) const;
 };
 
 struct mqtt_subscribe: public mqtt_packet
@@ -156,12 +193,12 @@ struct mqtt_subscribe: public mqtt_packet
     mqtt_subscribe(uint8_t _hdr): mqtt_packet (_hdr) {}
 
     uint16_t pktID;
-    // first - topiclen, second - topicfilter, third - qos
-    std::vector<std::tuple<uint16_t, std::string, uint8_t>> tuples;
+    // first - topicfilter, second - qos
+    std::vector<std::pair<std::string_view, uint8_t>> tuples;
 
     friend std::ostream& operator<< (std::ostream& os, const mqtt_subscribe& pkt);
 
-    void unpack(tps::net::message<mqtt_header> &msg) override;
+    parse_error unpack(const tps::net::message<mqtt_header>& msg);
 };
 
 struct mqtt_unsubscribe: public mqtt_packet
@@ -170,12 +207,11 @@ struct mqtt_unsubscribe: public mqtt_packet
     mqtt_unsubscribe(uint8_t _hdr): mqtt_packet (_hdr) {}
 
     uint16_t pktID;
-    // first - topiclen, second - topicfilter
-    std::vector<std::pair<uint16_t, std::string>> tuples;
+    std::vector<std::string_view> topics;
 
     friend std::ostream& operator<< (std::ostream& os, const mqtt_unsubscribe& pkt);
 
-    void unpack(tps::net::message<mqtt_header> &msg) override;
+    parse_error unpack(const tps::net::message<mqtt_header>& msg);
 };
 
 struct mqtt_suback: public mqtt_packet
@@ -188,8 +224,13 @@ struct mqtt_suback: public mqtt_packet
 
     friend std::ostream& operator<< (std::ostream& os, const mqtt_suback& pkt);
 
-    void pack(tps::net::message<mqtt_header>& msg) const override;
-    void unpack(tps::net::message<mqtt_header> &msg) override;
+    size_t packed_size() const;
+    uint8_t* pack(uint8_t* out) const;
+    void pack(tps::net::message<mqtt_header>& msg) const;
+
+    uint32_t remaining_length() const;
+    void pack_body(mqtt_writer& w) const;
+    parse_error unpack(const tps::net::message<mqtt_header>& msg);
 };
 
 struct mqtt_publish: public mqtt_packet
@@ -197,15 +238,40 @@ struct mqtt_publish: public mqtt_packet
     mqtt_publish(): mqtt_packet(PUBLISH_BYTE) {}
     mqtt_publish(uint8_t _hdr): mqtt_packet (_hdr) {}
 
-    uint16_t pktID;
-    uint16_t topiclen;
-    std::string topic;
-    std::string payload;
+    uint16_t pktID = 0;
+    // point either into the msg the packet was unpacked from or into 'storage'
+    std::string_view topic;
+    std::string_view payload;
+
+    // topic and payload encoded as in pack_shared(), set once the packet owns it's data
+    std::shared_ptr<const tps::net::buffer> storage;
 
     friend std::ostream& operator<< (std::ostream& os, const mqtt_publish& pkt);
 
-    void pack(tps::net::message<mqtt_header>& msg) const override;
-    void unpack(tps::net::message<mqtt_header> &msg) override;
+    size_t packed_size() const;
+    uint8_t* pack(uint8_t* out) const;
+    void pack(tps::net::message<mqtt_header>& msg) const;
+
+    uint32_t remaining_length() const;
+    void pack_body(mqtt_writer& w) const;
+    parse_error unpack(const tps::net::message<mqtt_header>& msg);
+
+    // copy topic and payload into 'storage', so that the packet can outlive the received msg
+    // (retained msgs, will, msgs saved for inactive clients), copies of owned packet share it
+    void make_owned();
+
+    // QoS 0 body (topic len, topic, payload) already has the layout of 'storage',
+    // so the received body itself becomes the storage - nothing is copied
+    void adopt(tps::net::buffer&& body);
+
+    // encodes topic and payload once, so that the result can be shared between all receivers
+    std::shared_ptr<const tps::net::buffer> pack_shared() const;
+    // packs only fixed header and pkt ID, topic and payload are referenced from 'shared'
+    void pack(tps::net::message<mqtt_header>& msg, const std::shared_ptr<const tps::net::buffer>& shared) const;
+    // first part of a streamed PUBLISH: 'part' is the beginning of the received body, payload
+    // starts at 'payloadOffset' and has 'payloadLen' bytes in total, most of them still to come
+    void pack_head(tps::net::message<mqtt_header>& msg, const std::shared_ptr<const tps::net::buffer>& part,
+                   uint32_t payloadOffset, uint32_t payloadLen) const;
 };
 
 struct mqtt_ack: public mqtt_packet
@@ -217,8 +283,13 @@ struct mqtt_ack: public mqtt_packet
 
     friend std::ostream& operator<< (std::ostream& os, const mqtt_ack& pkt);
 
-    void pack(tps::net::message<mqtt_header>& msg) const override;
-    void unpack(tps::net::message<mqtt_header> &msg) override;
+    size_t packed_size() const;
+    uint8_t* pack(uint8_t* out) const;
+    void pack(tps::net::message<mqtt_header>& msg) const;
+
+    uint32_t remaining_length() const;
+    void pack_body(mqtt_writer& w) const;
+    parse_error unpack(const tps::net::message<mqtt_header>& msg);
 };
 
 typedef struct mqtt_ack mqtt_puback;
@@ -230,6 +301,14 @@ typedef struct mqtt_packet mqtt_pingreq;
 typedef struct mqtt_packet mqtt_pingresp;
 typedef struct mqtt_packet mqtt_disconnect;
 
+// any packet, alternative is chosen by the type nibble of the fixed header:
+// mqtt_ack for PUBACK/PUBREC/PUBREL/PUBCOMP/UNSUBACK, mqtt_packet for PINGREQ/PINGRESP/DISCONNECT
+using mqtt_any = std::variant<mqtt_packet, mqtt_connect, mqtt_connack, mqtt_subscribe,
+                              mqtt_unsubscribe, mqtt_suback, mqtt_publish, mqtt_ack>;
+
+// unpack received msg into 'pkt' without heap allocation or virtual calls
+parse_error mqtt_parse(const tps::net::message<mqtt_header>& msg, mqtt_any& pkt);
+
 uint8_t mqtt_encode_length(tps::net::message<mqtt_header>& msg, size_t len);
 uint32_t mqtt_decode_length(tps::net::message<mqtt_header>& msg);
 
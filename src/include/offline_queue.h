@@ -0,0 +1,145 @@
+#ifndef OFFLINE_QUEUE_H
+#define OFFLINE_QUEUE_H
+
+#include <optional>
+#include <string>
+#include <vector>
+#include "mqtt.h"
+
+// msgs waiting in a session while it's client is inactive, congested or has the in-flight window full
+// msgs in memory share storage with the published msg, so a msg saved for many sessions is kept once.
+// Queues are bounded: a session can't hold more than maxSessionBytes of topics and payloads and all
+// queues together can't take more than maxMemoryBytes of memory, when a limit is hit the oldest msgs
+// of the session or the new one are dropped. Memory of other sessions can't be freed, so at the memory
+// limit new msg only takes the place of the session's oldest one, and the limit is exceeded by the
+// storage of the dropped msgs that other sessions still keep.
+// When a session holds more than spillThreshold bytes in memory (or memory limit is hit), further msgs
+// go to spill files, they are read back one by one as the queue drains
+// queues aren't thread safe, they are only used by the dispatcher thread
+class offline_queue
+{
+public:
+    enum class drop_policy
+    {
+        DROP_OLDEST,
+        DROP_NEWEST,
+    };
+
+    // 0 - no limit
+    struct limits
+    {
+        size_t maxSessionBytes = 0;             // topics and payloads of one session, in memory and spilled
+        size_t maxMemoryBytes = size_t(1) << 30;// memory taken by all queues, shared storage is counted once
+        size_t spillThreshold = 0;              // topics and payloads of one session kept in memory, 0 - never spill
+        std::string spillDir;                   // empty - system temp directory
+        drop_policy policy = drop_policy::DROP_OLDEST;
+    };
+    static void set_limits(const limits& lim);
+    static const limits& get_limits();
+
+    struct stats
+    {
+        size_t msgs;            // msgs in all queues, in memory and spilled
+        size_t memoryBytes;     // memory taken by the queues and the storage of msgs in memory
+        size_t spilledMsgs;
+        size_t spilledBytes;    // topics and payloads of spilled msgs
+        size_t diskBytes;       // size of spill files, msg spilled for many sessions is written once
+        uint64_t dropped;       // msgs dropped because of the limits or spill errors
+    };
+    static stats get_stats();
+
+    offline_queue() = default;
+    ~offline_queue() { clear(); }
+
+    offline_queue(const offline_queue&) = delete;
+    offline_queue& operator=(const offline_queue&) = delete;
+
+    // msg is saved with the given qos, false if it was dropped
+    bool push(const mqtt_publish& pkt, uint8_t qos);
+    // oldest msg, spilled msg is read from disk, none if the queue is empty or the rest of it couldn't be read
+    std::optional<mqtt_publish> pop_front();
+    void clear();
+
+    bool empty() const { return m_msgs.empty() && m_spilled.empty(); }
+    size_t size() const { return m_msgs.size() + m_spilled.size(); }
+    // topics and payloads of the queued msgs
+    size_t bytes() const { return m_nMemoryBytes + m_nSpilledBytes; }
+    size_t spilled_bytes() const { return m_nSpilledBytes; }
+
+private:
+    // topic and payload are found in the storage, only it and the header are kept
+    struct saved_msg
+    {
+        std::shared_ptr<const tps::net::buffer> storage;
+        uint8_t header;
+    };
+
+    // msg in a spill file, header is kept in memory since the same record is shared by sessions
+    // that got the msg with different QoS
+    struct spilled_msg
+    {
+        uint32_t segment;
+        uint32_t offset;
+        uint32_t len;
+        uint8_t header;
+    };
+
+    // defined in offline_queue.cpp, created on first use
+    struct state;
+    static state& get_state();
+
+    static size_t msg_bytes(const mqtt_publish& pkt) { return pkt.topic.size() + pkt.payload.size(); }
+    // storage holds topic len, topic and payload, nullopt if it doesn't
+    static std::optional<mqtt_publish> unpack(uint8_t header, std::shared_ptr<const tps::net::buffer> storage);
+
+    bool drop_new();
+    void drop_oldest();
+    bool spill(const mqtt_publish& pkt, uint8_t qos);
+    saved_msg pop_memory();
+    void pop_spilled();
+    // memory taken by the queue itself is counted as the capacity of it's vectors
+    void update_capacity();
+
+    // vector with a moving head, unlike deque it takes no memory while it's empty, as queues of most
+    // sessions are. Popped items are moved out when the vector would have to grow
+    template <typename T>
+    struct fifo
+    {
+        std::vector<T> items;
+        size_t head = 0;
+
+        bool empty() const { return head == items.size(); }
+        size_t size() const { return items.size() - head; }
+        // next push reallocates
+        bool full() const { return size() == items.capacity(); }
+        T& front() { return items[head]; }
+        void push_back(T item)
+        {
+            if (head && items.size() == items.capacity())
+            {
+                items.erase(items.begin(), items.begin() + ptrdiff_t(head));
+                head = 0;
+            }
+            items.push_back(std::move(item));
+        }
+        void pop_front()
+        {
+            items[head++] = T();
+            if (head == items.size())
+            {
+                std::vector<T>().swap(items);
+                head = 0;
+            }
+        }
+    };
+
+    // older than the spilled ones, once a msg is spilled the following ones are spilled too until
+    // the queue drains to keep the order
+    fifo<saved_msg> m_msgs;
+    fifo<spilled_msg> m_spilled;
+    size_t m_nMemoryBytes = 0;
+    size_t m_nSpilledBytes = 0;
+    size_t m_nCapacityBytes = 0;
+};
+
+#endif // OFFLINE_QUEUE_H
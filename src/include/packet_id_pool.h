@@ -0,0 +1,136 @@
+#ifndef PACKET_ID_POOL_H
+#define PACKET_ID_POOL_H
+
+#include <cstdint>
+#include <memory>
+#include <optional>
+#include "mqtt.h"
+
+// packet IDs in flight, each with the type of the ack it waits for (PUBACK, PUBREC, PUBREL or PUBCOMP)
+// IDs are bits of a bitmap, a second level has a bit per word of the first one that is set when
+// the word is full, so the lowest free ID is found with two count-trailing-zeros, and the ack types
+// are packed 2 bits per ID. All operations take constant time
+// 'Capacity' is the highest ID the pool hands out, it fixes the footprint of the pool: tables
+// for all IDs are allocated at once, when the first ID is taken, and kept until the pool is destroyed
+template <uint32_t Capacity = 65535>
+class packet_id_pool
+{
+    static_assert(Capacity >= 1 && Capacity <= 65535, "packet ID is a non-zero 16-bit integer");
+
+public:
+    // lowest free ID, 0 if all of them are taken
+    uint16_t generate_key(packet_type ack)
+    {
+        if (full())
+            return 0;
+        auto& t = tables();
+
+        for (uint32_t s = 0; s < SUMMARY_WORDS; s++)
+        {
+            if (!~t.full[s])
+                continue;
+
+            uint32_t w = s * 64 + uint32_t(__builtin_ctzll(~t.full[s]));
+            uint16_t id = uint16_t(w * 64 + uint32_t(__builtin_ctzll(~t.used[w])));
+            take(t, id, ack);
+            return id;
+        }
+        return 0;
+    }
+
+    // take the ID chosen by the other side, false if it's already taken or out of range
+    bool register_key(uint16_t id, packet_type ack)
+    {
+        if (!id || id > Capacity)
+            return false;
+        auto& t = tables();
+        if (t.used[id / 64] & bit(id))
+            return false;
+
+        take(t, id, ack);
+        return true;
+    }
+
+    bool unregister_key(uint16_t id)
+    {
+        if (!is_taken(id))
+            return false;
+
+        m_pTables->used[id / 64] &= ~bit(id);
+        m_pTables->full[id / 64 / 64] &= ~(uint64_t(1) << (id / 64 % 64));
+        m_nTaken--;
+        return true;
+    }
+
+    // type of the ack the ID waits for
+    std::optional<packet_type> find(uint16_t id) const
+    {
+        if (!is_taken(id))
+            return std::nullopt;
+
+        uint32_t code = uint32_t(m_pTables->acks[id / 32] >> (id % 32 * 2)) & 3;
+        return packet_type(code + uint32_t(packet_type::PUBACK));
+    }
+
+    bool full() const { return m_nTaken == Capacity; }
+    uint32_t size() const { return m_nTaken; }
+
+    // bytes taken by the pool once it's used
+    static constexpr size_t footprint() { return sizeof(pool_tables); }
+
+private:
+    static constexpr uint32_t WORDS = (Capacity + 1 + 63) / 64;
+    static constexpr uint32_t SUMMARY_WORDS = (WORDS + 63) / 64;
+
+    struct pool_tables
+    {
+        uint64_t used[WORDS];
+        uint64_t full[SUMMARY_WORDS];
+        uint64_t acks[(Capacity + 1 + 31) / 32];
+    };
+
+    static uint64_t bit(uint32_t id) { return uint64_t(1) << (id % 64); }
+
+    bool is_taken(uint16_t id) const
+    {
+        return m_pTables && id && id <= Capacity && (m_pTables->used[id / 64] & bit(id));
+    }
+
+    pool_tables& tables()
+    {
+        if (!m_pTables)
+        {
+            m_pTables = std::make_unique<pool_tables>();
+            auto& t = *m_pTables;
+
+            // ID 0 and IDs above the capacity are never free, words and summary bits past the end are full
+            t.used[0] |= 1;
+            for (uint32_t id = Capacity + 1; id < WORDS * 64; id++)
+                t.used[id / 64] |= bit(id);
+            for (uint32_t w = 0; w < WORDS; w++)
+                if (!~t.used[w])
+                    t.full[w / 64] |= uint64_t(1) << (w % 64);
+            for (uint32_t w = WORDS; w < SUMMARY_WORDS * 64; w++)
+                t.full[w / 64] |= uint64_t(1) << (w % 64);
+        }
+        return *m_pTables;
+    }
+
+    void take(pool_tables& t, uint16_t id, packet_type ack)
+    {
+        uint32_t w = id / 64;
+        t.used[w] |= bit(id);
+        if (!~t.used[w])
+            t.full[w / 64] |= uint64_t(1) << (w % 64);
+
+        uint32_t shift = id % 32 * 2;
+        uint64_t code = uint64_t(uint8_t(ack) - uint8_t(packet_type::PUBACK)) & 3;
+        t.acks[id / 32] = (t.acks[id / 32] & ~(uint64_t(3) << shift)) | code << shift;
+        m_nTaken++;
+    }
+
+    std::unique_ptr<pool_tables> m_pTables;
+    uint32_t m_nTaken = 0;
+};
+
+#endif // PACKET_ID_POOL_H
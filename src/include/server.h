@@ -8,25 +8,64 @@
 class server: public tps::net::server_interface<mqtt_header>
 {
 public:
-    server(uint16_t port): tps::net::server_interface<mqtt_header>(port) {}
+    server(uint16_t port, uint32_t nThreads = 1):
+        tps::net::server_interface<mqtt_header>(port, nThreads) {}
     virtual ~server() override {}
 
+    // maximum number of unacknowledged QoS 1 and 2 msgs per client (like MQTT 5 Receive Maximum),
+    // msgs above it wait in the session in order
+    void set_max_inflight(uint16_t nMaxInflight) { m_nMaxInflight = std::max<uint16_t>(nMaxInflight, 1); }
+
 protected:
     virtual bool on_client_connect    (pConnection client) override;
     virtual void on_client_disconnect (pConnection client) override;
+    virtual void on_client_drained    (pConnection client) override;
     virtual bool on_first_message     (pConnection netClient,
                                        tps::net::message<mqtt_header>& msg) override;
 
     virtual void on_message(pConnection netClient,
                             tps::net::message<mqtt_header>& msg) override;
 
+    virtual bool can_stream(const tps::net::message_header<mqtt_header>& hdr) override;
+
 private:
     void handle_connect     (pConnection& netClient, mqtt_connect& pkt);
+    // connection closed or drained, reported by it's io thread
+    void handle_event       (pClient& client, tps::net::msg_event event);
 
     void handle_subscribe   (pClient& client, mqtt_subscribe& pkt);
     void handle_unsubscribe (pClient& client, mqtt_unsubscribe& pkt);
     void handle_publish     (pClient& client, mqtt_publish& pkt);
     void publish_msg        (mqtt_publish& pkt);
+    // returns true if it's a QoS 2 msg that has already been received [MQTT-4.3.3-2]
+    bool register_qos2      (pClient& client, const mqtt_publish& pkt);
+    void send_publish_ack   (pClient& client, const mqtt_publish& pkt);
+    // QoS 1 and 2 msg gets a pkt ID and stays in the in-flight window until it's acknowledged
+    void send_publish       (client_t& client, mqtt_publish& pkt);
+    // keep msg in the session until the client can get it, msg can be dropped if the queue is full
+    void save_msg           (client_t& client, const mqtt_publish& pkt, uint8_t qos);
+
+    // PUBLISH received in parts
+    void handle_publish_part(pClient& client, tps::net::message<mqtt_header>& msg);
+    void start_stream       (pClient& client, tps::net::message<mqtt_header>& msg);
+    void finish_stream      (pClient& client);
+    // shares the part between receivers, holding publisher's inbound credit until they are done with it
+    std::shared_ptr<const tps::net::buffer> hold_part(const pConnection& publisher, tps::net::buffer&& body);
+    // streamed QoS 1 or 2 msg has been collected, it takes the place of it's pkt ID in the receiver's window
+    void complete_inflight  (client_t& client, const publish_stream::inflight_receiver& receiver, const mqtt_publish& pkt);
+    // tell receivers that the rest of the stream won't come, QoS 1 and 2 ones free it's window slot
+    void abort_stream       (client_t& client);
+    // send msgs that were stored in client's session while it was inactive, congested
+    // or had the in-flight window full
+    void send_saved_msgs    (client_t& client);
+    // QoS 1 and 2 msgs can be sent while the client has less than m_nMaxInflight of them unacknowledged
+    bool has_window         (const client_t& client) const;
+    // on session resume, unacknowledged msgs are sent again with DUP set, PUBRELs of msgs
+    // that got PUBREC are sent again [MQTT-4.4.0-1]
+    void resend_inflight    (client_t& client);
+    // PUBACK or PUBCOMP came, msg leaves the window and the next saved one takes it's place
+    void release_inflight   (client_t& client, uint16_t pktID);
+    std::deque<mqtt_publish>::iterator find_inflight(client_t& client, uint16_t pktID);
 
     void handle_puback (pClient& client, mqtt_puback& pkt);
     void handle_pubrec (pClient& client, mqtt_pubrec& pkt);
@@ -47,6 +86,9 @@ private:
                     uint8_t manualControl = core_t::BASED_ON_CS_PARAM);
 
     struct core m_core;
+
+    uint64_t m_nStreamIDCounter = 0;
+    uint16_t m_nMaxInflight = 64;
 };
 
 #endif // SERVER_H
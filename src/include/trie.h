@@ -2,156 +2,577 @@
 #define TRIE_H
 
 #include <memory>
+#include <string>
+#include <string_view>
 #include <vector>
 #include <functional>
-#include <unordered_map>
-
-#define ALPHABET_SIZE 96
+#include <cstring>
+#include <optional>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
+// adaptive radix tree (V. Leis et al., "The Adaptive Radix Tree: ARTful Indexing for Main-Memory Databases")
+// every node keeps the bytes of the key that lead to it from the edge of it's parent ('prefix'),
+// so a run of single-child nodes is collapsed into one node. Children are found by the next byte
+// of the key, node layout depends on the number of children:
+//  N4   - up to 4 keys and children, linear search
+//  N16  - up to 16 keys and children, SSE2 compare of all keys at once
+//  N48  - 256 byte index into up to 48 children
+//  N256 - array of 256 children
+// node grows into the next layout when it's full and shrinks back when most of it's children are gone
 template<typename T>
 struct trie_node
 {
-    trie_node() {children.reserve(ALPHABET_SIZE/6);}
-    ~trie_node() {}
-    std::unordered_map<char, std::unique_ptr<trie_node>> children; // list of children (child is a next symbol in topic name)
-    std::shared_ptr<T> data;  // data associated with node (topic structure, contains subscribers info)
+    enum class kind: uint8_t {N4, N16, N48, N256};
+
+    trie_node(kind _type): type(_type) {}
+
+    kind type;
+    uint16_t nChildren = 0;
+    std::string prefix;
+    std::shared_ptr<T> data;  // data associated with node (topic structure)
+};
+
+template<typename T>
+struct trie_node4: trie_node<T>
+{
+    trie_node4(): trie_node<T>(trie_node<T>::kind::N4) {}
+    static constexpr uint16_t CAPACITY = 4;
+    uint8_t keys[CAPACITY];
+    trie_node<T>* children[CAPACITY];
+};
+
+template<typename T>
+struct trie_node16: trie_node<T>
+{
+    trie_node16(): trie_node<T>(trie_node<T>::kind::N16) {}
+    static constexpr uint16_t CAPACITY = 16;
+    alignas(16) uint8_t keys[CAPACITY];
+    trie_node<T>* children[CAPACITY];
+};
+
+template<typename T>
+struct trie_node48: trie_node<T>
+{
+    trie_node48(): trie_node<T>(trie_node<T>::kind::N48) { std::memset(index, 0, sizeof(index)); }
+    static constexpr uint16_t CAPACITY = 48;
+    // slot of the child + 1, 0 - no child
+    uint8_t index[256];
+    trie_node<T>* children[CAPACITY];
+};
+
+template<typename T>
+struct trie_node256: trie_node<T>
+{
+    trie_node256(): trie_node<T>(trie_node<T>::kind::N256) { std::memset(children, 0, sizeof(children)); }
+    static constexpr uint16_t CAPACITY = 256;
+    trie_node<T>* children[CAPACITY];
+};
+
+// position in the trie: after 'offset' bytes of node's prefix, default one is the root
+// data only exists at the end of the prefix
+template<typename T>
+struct trie_cursor
+{
+    trie_node<T>* node = nullptr;
+    uint32_t offset = 0;
+
+    bool at_node() const
+    {
+        return offset == node->prefix.size();
+    }
+
+    const std::shared_ptr<T>& data() const
+    {
+        static const std::shared_ptr<T> none;
+        return at_node() ? node->data : none;
+    }
 };
 
 template<typename T>
 struct trie
 {
 public:
-    struct trie_node<T> root;
+    using node = trie_node<T>;
+    using cursor = trie_cursor<T>;
 
-    void insert(const std::string& prefix, const std::shared_ptr<T>& data)
-    {
-        trie_node<T>* cursor = &root;
+    trie(): m_root(new trie_node4<T>) {}
+    trie(const trie&) = delete;
+    trie& operator=(const trie&) = delete;
+    ~trie() { destroy(m_root); }
 
-        // Iterate through the key char by char
-        for (auto key: prefix)
+    void insert(std::string_view key, const std::shared_ptr<T>& data)
+    {
+        node** ref = &m_root;
+        size_t i = 0;
+        while (1)
         {
-            auto it = cursor->children.find(key);
+            node* n = *ref;
+            size_t match = common_prefix(n->prefix, key.substr(i));
+            i += match;
 
-            // No match, we add a new node
-            if (it == cursor->children.end())
-                it = cursor->children.emplace(key, std::make_unique<trie_node<T>>()).first;
-            cursor = it->second.get();
-        }
+            // key diverges in the middle of the prefix - split it
+            if (match < n->prefix.size())
+                n = split(ref, match);
 
-        cursor->data = data;
+            if (i == key.size())
+            {
+                n->data = data;
+                return;
+            }
+
+            node** child = find_child(n, uint8_t(key[i]));
+            if (!child)
+            {
+                auto leaf = new trie_node4<T>;
+                leaf->prefix = std::string(key.substr(i+1));
+                leaf->data = data;
+                add_child(ref, uint8_t(key[i]), leaf);
+                return;
+            }
+
+            ref = child;
+            i++;
+        }
     }
 
-    // look for 'prefix' node starting from 'start' node or root
-    trie_node<T>* find(const std::string& prefix, trie_node<T>* start = nullptr)
+    // look for 'prefix' node starting from 'start' position or root
+    std::optional<cursor> find(std::string_view prefix, cursor start = cursor())
     {
-        trie_node<T>* retnode = start ? start : &root;
+        node* n = start.node ? start.node : m_root;
+        size_t offset = start.offset;
 
-        // Move to the end of the prefix first
-        for (auto key: prefix)
+        size_t i = 0;
+        while (i < prefix.size())
         {
-            auto it = retnode->children.find(key);
-            // No key with the full prefix in the trie
-            if (it == retnode->children.end())
-                return nullptr;
+            if (offset < n->prefix.size())
+            {
+                size_t len = std::min(n->prefix.size() - offset, prefix.size() - i);
+                if (std::memcmp(n->prefix.data() + offset, prefix.data() + i, len))
+                    return std::nullopt;
+                offset += len;
+                i += len;
+                continue;
+            }
 
-            retnode = it->second.get();
+            node** child = find_child(n, uint8_t(prefix[i++]));
+            // No key with the full prefix in the trie
+            if (!child)
+                return std::nullopt;
+            n = *child;
+            offset = 0;
         }
 
-        return retnode;
+        return cursor{n, uint32_t(offset)};
+    }
+
+    // data of the node with exactly this key
+    std::shared_ptr<T>* find_data(std::string_view key)
+    {
+        auto res = find(key);
+        if (!res || !res->at_node() || !res->node->data)
+            return nullptr;
+        return &res->node->data;
     }
 
     // apply function 'func' to perfix node and all prefix's children
-    void apply_func(const std::string &prefix, trie_node<T>* start, std::function<void(trie_node<T> *)> func)
+    void apply_func(std::string_view prefix, cursor start, std::function<void(const cursor&)> func)
     {
-        if (!start)
-            start = &root;
-        trie_node<T> *node = find(prefix, start);
-        if (node)
-            recursive_apply_func(node, func);
+        if (auto res = find(prefix, start))
+            recursive_apply_func(res->node, func);
     }
 
-    // look for occurences of 'key', starting from 'start'+'prefix' node, and apply function 'func' to them
-    void apply_func_key(const std::string &prefix, trie_node<T>* start, char key, std::function<void(trie_node<T> *)> func)
+    // look for occurences of 'key', starting from 'start'+'prefix' position, and apply function 'func'
+    // to positions right after them
+    void apply_func_key(std::string_view prefix, cursor start, char key, std::function<void(const cursor&)> func)
     {
-        if (!start)
-            start = &root;
-        trie_node<T> *node = find(prefix, start);
-        if (node)
-            recursive_apply_func_key(node, key, func);
+        if (auto res = find(prefix, start))
+            recursive_apply_func_key(*res, key, func);
     }
 
-    void find_all_data_until(const std::string &prefix, trie_node<T>* start, char until, std::function<void(trie_node<T> *)> func)
+    void find_all_data_until(std::string_view prefix, cursor start, char until, std::function<void(const cursor&)> func)
     {
-        if (!start)
-            start = &root;
-        trie_node<T> *node = find(prefix, start);
-        if (node)
-            recursive_apply_data_until(node, until, func);
+        if (auto res = find(prefix, start))
+            recursive_apply_data_until(*res, until, func);
+    }
+
+    void erase(std::string_view key)
+    {
+        if (!key.size())
+            return;
+
+        // edges from the root to the node of the key
+        std::vector<std::pair<node**, uint8_t>> path;
+        node** ref = &m_root;
+        size_t i = 0;
+        while (1)
+        {
+            node* n = *ref;
+            if (key.size() - i < n->prefix.size() || key.compare(i, n->prefix.size(), n->prefix))
+                return;
+            i += n->prefix.size();
+            if (i == key.size())
+                break;
+
+            node** child = find_child(n, uint8_t(key[i]));
+            if (!child)
+                return;
+            path.emplace_back(ref, uint8_t(key[i]));
+            ref = child;
+            i++;
+        }
+
+        (*ref)->data.reset();
+
+        // remove nodes that are left without data and children, merge the ones left with a single child
+        while (!path.empty())
+        {
+            node* n = *ref;
+            if (n->data || n->nChildren > 1)
+                break;
+
+            auto [parentRef, edge] = path.back();
+            path.pop_back();
+
+            if (n->nChildren == 1)
+            {
+                merge_with_child(ref);
+                break;
+            }
+
+            remove_child(parentRef, edge);
+            destroy(n);
+            ref = parentRef;
+        }
     }
 
-    void erase(const std::string& topicName)
+    struct stats
+    {
+        size_t nodes[4];    // N4, N16, N48, N256
+        size_t bytes;       // nodes and heap allocated prefixes
+    };
+
+    stats get_stats() const
     {
-        if (topicName.size())
-            recursive_erase(root, topicName, 0);
+        stats st{};
+        recursive_stats(m_root, st);
+        return st;
     }
 
 private:
-    bool recursive_erase(trie_node<T>& node, const std::string& key, uint16_t index)
+    static size_t common_prefix(const std::string& prefix, std::string_view key)
+    {
+        size_t len = std::min(prefix.size(), key.size());
+        size_t i = 0;
+        while (i < len && prefix[i] == key[i])
+            i++;
+        return i;
+    }
+
+    // new node takes the first 'len' bytes of the prefix, old node becomes it's child
+    node* split(node** ref, size_t len)
+    {
+        node* old = *ref;
+        auto parent = new trie_node4<T>;
+        parent->prefix = old->prefix.substr(0, len);
+
+        uint8_t edge = uint8_t(old->prefix[len]);
+        old->prefix.erase(0, len+1);
+
+        parent->keys[0] = edge;
+        parent->children[0] = old;
+        parent->nChildren = 1;
+        *ref = parent;
+        return parent;
+    }
+
+    // node without data and with one child is replaced by the child
+    void merge_with_child(node** ref)
     {
-        if (index == key.size())
+        node* n = *ref;
+        uint8_t edge = 0;
+        node* child = nullptr;
+        for_each_child(n, [&edge, &child](uint8_t key, node* c) { edge = key; child = c; });
+
+        child->prefix = n->prefix + char(edge) + child->prefix;
+        *ref = child;
+        free_node(n);
+    }
+
+    static node** find_child(node* n, uint8_t key)
+    {
+        switch (n->type)
         {
-            if (node.data)
+            case node::kind::N4:
+            {
+                auto n4 = static_cast<trie_node4<T>*>(n);
+                for (uint16_t i = 0; i < n4->nChildren; i++)
+                    if (n4->keys[i] == key)
+                        return &n4->children[i];
+                return nullptr;
+            }
+            case node::kind::N16:
+            {
+                auto n16 = static_cast<trie_node16<T>*>(n);
+#ifdef __SSE2__
+                __m128i cmp = _mm_cmpeq_epi8(_mm_set1_epi8(char(key)),
+                                             _mm_load_si128(reinterpret_cast<const __m128i*>(n16->keys)));
+                uint32_t mask = uint32_t(_mm_movemask_epi8(cmp)) & ((1u << n16->nChildren) - 1);
+                return mask ? &n16->children[__builtin_ctz(mask)] : nullptr;
+#else
+                for (uint16_t i = 0; i < n16->nChildren; i++)
+                    if (n16->keys[i] == key)
+                        return &n16->children[i];
+                return nullptr;
+#endif
+            }
+            case node::kind::N48:
             {
-                node.data.reset();
-                // if there is no more children delete node
-                if (!node.children.size())
-                    return true;
+                auto n48 = static_cast<trie_node48<T>*>(n);
+                return n48->index[key] ? &n48->children[n48->index[key] - 1] : nullptr;
+            }
+            case node::kind::N256:
+            {
+                auto n256 = static_cast<trie_node256<T>*>(n);
+                return n256->children[key] ? &n256->children[key] : nullptr;
             }
         }
+        return nullptr;
+    }
+
+    template <typename Func>
+    static void for_each_child(node* n, Func func)
+    {
+        switch (n->type)
+        {
+            case node::kind::N4:
+            {
+                auto n4 = static_cast<trie_node4<T>*>(n);
+                for (uint16_t i = 0; i < n4->nChildren; i++)
+                    func(n4->keys[i], n4->children[i]);
+                break;
+            }
+            case node::kind::N16:
+            {
+                auto n16 = static_cast<trie_node16<T>*>(n);
+                for (uint16_t i = 0; i < n16->nChildren; i++)
+                    func(n16->keys[i], n16->children[i]);
+                break;
+            }
+            case node::kind::N48:
+            {
+                auto n48 = static_cast<trie_node48<T>*>(n);
+                for (uint32_t key = 0; key < 256; key++)
+                    if (n48->index[key])
+                        func(uint8_t(key), n48->children[n48->index[key] - 1]);
+                break;
+            }
+            case node::kind::N256:
+            {
+                auto n256 = static_cast<trie_node256<T>*>(n);
+                for (uint32_t key = 0; key < 256; key++)
+                    if (n256->children[key])
+                        func(uint8_t(key), n256->children[key]);
+                break;
+            }
+        }
+    }
+
+    // moves header and children of 'from' to a node of another layout
+    template <typename To>
+    static To* relayout(node* from)
+    {
+        auto to = new To;
+        to->prefix = std::move(from->prefix);
+        to->data = std::move(from->data);
+        for_each_child(from, [to](uint8_t key, node* child) { put_child(to, key, child); });
+        free_node(from);
+        return to;
+    }
+
+    // 'n' must have room for the child
+    template <typename Node>
+    static void put_child(Node* n, uint8_t key, node* child)
+    {
+        if constexpr (std::is_same_v<Node, trie_node48<T>>)
+        {
+            n->index[key] = uint8_t(n->nChildren + 1);
+            n->children[n->nChildren] = child;
+        }
+        else if constexpr (std::is_same_v<Node, trie_node256<T>>)
+            n->children[key] = child;
         else
         {
-            char next_letter = key[index++];
-            auto it = node.children.find(next_letter);
-            if (it != node.children.end())
-                if (recursive_erase(*node.children[next_letter], key, index))
+            n->keys[n->nChildren] = key;
+            n->children[n->nChildren] = child;
+        }
+        n->nChildren++;
+    }
+
+    static void add_child(node** ref, uint8_t key, node* child)
+    {
+        node* n = *ref;
+        switch (n->type)
+        {
+            case node::kind::N4:
+                if (n->nChildren < trie_node4<T>::CAPACITY)
+                    return put_child(static_cast<trie_node4<T>*>(n), key, child);
+                n = *ref = relayout<trie_node16<T>>(n);
+                return put_child(static_cast<trie_node16<T>*>(n), key, child);
+            case node::kind::N16:
+                if (n->nChildren < trie_node16<T>::CAPACITY)
+                    return put_child(static_cast<trie_node16<T>*>(n), key, child);
+                n = *ref = relayout<trie_node48<T>>(n);
+                return put_child(static_cast<trie_node48<T>*>(n), key, child);
+            case node::kind::N48:
+                if (n->nChildren < trie_node48<T>::CAPACITY)
+                    return put_child(static_cast<trie_node48<T>*>(n), key, child);
+                n = *ref = relayout<trie_node256<T>>(n);
+                return put_child(static_cast<trie_node256<T>*>(n), key, child);
+            case node::kind::N256:
+                return put_child(static_cast<trie_node256<T>*>(n), key, child);
+        }
+    }
+
+    // child itself is not destroyed
+    static void remove_child(node** ref, uint8_t key)
+    {
+        node* n = *ref;
+        switch (n->type)
+        {
+            case node::kind::N4:
+            case node::kind::N16:
+            {
+                // unsorted keys, last one takes the place of the removed one
+                uint8_t* keys = n->type == node::kind::N4 ? static_cast<trie_node4<T>*>(n)->keys
+                                                          : static_cast<trie_node16<T>*>(n)->keys;
+                node** children = n->type == node::kind::N4 ? static_cast<trie_node4<T>*>(n)->children
+                                                            : static_cast<trie_node16<T>*>(n)->children;
+                uint16_t i = 0;
+                while (keys[i] != key)
+                    i++;
+                n->nChildren--;
+                keys[i] = keys[n->nChildren];
+                children[i] = children[n->nChildren];
+
+                if (n->type == node::kind::N16 && n->nChildren <= 3)
+                    *ref = relayout<trie_node4<T>>(n);
+                break;
+            }
+            case node::kind::N48:
+            {
+                auto n48 = static_cast<trie_node48<T>*>(n);
+                uint8_t slot = uint8_t(n48->index[key] - 1);
+                n48->index[key] = 0;
+                n48->nChildren--;
+                // last child takes the freed slot
+                if (slot != n48->nChildren)
                 {
-                    node.children.erase(next_letter);
-                    if (!node.children.size() && !node.data)
-                        return true;
+                    n48->children[slot] = n48->children[n48->nChildren];
+                    for (uint32_t k = 0; k < 256; k++)
+                        if (n48->index[k] == n48->nChildren + 1)
+                        {
+                            n48->index[k] = uint8_t(slot + 1);
+                            break;
+                        }
                 }
+
+                if (n48->nChildren <= 12)
+                    *ref = relayout<trie_node16<T>>(n);
+                break;
+            }
+            case node::kind::N256:
+            {
+                auto n256 = static_cast<trie_node256<T>*>(n);
+                n256->children[key] = nullptr;
+                n256->nChildren--;
+
+                if (n256->nChildren <= 40)
+                    *ref = relayout<trie_node48<T>>(n);
+                break;
+            }
+        }
+    }
+
+    // node and all of it's children
+    static void destroy(node* n)
+    {
+        for_each_child(n, [](uint8_t, node* child) { destroy(child); });
+        free_node(n);
+    }
+
+    // only the node, it's children are owned by someone else now
+    static void free_node(node* n)
+    {
+        switch (n->type)
+        {
+            case node::kind::N4:   delete static_cast<trie_node4<T>*>(n);   break;
+            case node::kind::N16:  delete static_cast<trie_node16<T>*>(n);  break;
+            case node::kind::N48:  delete static_cast<trie_node48<T>*>(n);  break;
+            case node::kind::N256: delete static_cast<trie_node256<T>*>(n); break;
         }
-        return false;
     }
 
-    void recursive_apply_func(trie_node<T> *node, std::function<void(trie_node<T> *)> func)
+    void recursive_apply_func(node* n, const std::function<void(const cursor&)>& func)
     {
-        if (node->data)
-            func(node);
+        if (n->data)
+            func(cursor{n, uint32_t(n->prefix.size())});
 
-        for (auto& child: node->children)
-            recursive_apply_func(child.second.get(), func);
+        for_each_child(n, [this, &func](uint8_t, node* child) { recursive_apply_func(child, func); });
     }
 
-    void recursive_apply_func_key(trie_node<T> *node, char key, std::function<void(trie_node<T> *)> func)
+    void recursive_apply_func_key(const cursor& pos, char key, const std::function<void(const cursor&)>& func)
     {
-        for (auto& child: node->children)
+        // occurence in the rest of the prefix
+        auto found = pos.node->prefix.find(key, pos.offset);
+        if (found != std::string::npos)
         {
-            if (child.first != key)
-                recursive_apply_func_key(child.second.get(), key, func);
-            else
-                func(child.second.get());
+            func(cursor{pos.node, uint32_t(found + 1)});
+            return;
         }
+
+        for_each_child(pos.node, [this, key, &func](uint8_t edge, node* child)
+        {
+            if (edge != uint8_t(key))
+                recursive_apply_func_key(cursor{child, 0}, key, func);
+            else
+                func(cursor{child, 0});
+        });
     }
 
-    void recursive_apply_data_until(trie_node<T> *node, char until, std::function<void(trie_node<T> *)> func)
+    void recursive_apply_data_until(const cursor& pos, char until, const std::function<void(const cursor&)>& func)
     {
-        if (node->data)
-            func(node);
+        if (pos.node->prefix.find(until, pos.offset) != std::string::npos)
+            return;
 
-        for (auto& child: node->children)
-            if (child.first != until)
-                recursive_apply_data_until(child.second.get(), until, func);
+        if (pos.node->data)
+            func(cursor{pos.node, uint32_t(pos.node->prefix.size())});
+
+        for_each_child(pos.node, [this, until, &func](uint8_t edge, node* child)
+        {
+            if (edge != uint8_t(until))
+                recursive_apply_data_until(cursor{child, 0}, until, func);
+        });
     }
+
+    static void recursive_stats(node* n, stats& st)
+    {
+        st.nodes[size_t(n->type)]++;
+        switch (n->type)
+        {
+            case node::kind::N4:   st.bytes += sizeof(trie_node4<T>);   break;
+            case node::kind::N16:  st.bytes += sizeof(trie_node16<T>);  break;
+            case node::kind::N48:  st.bytes += sizeof(trie_node48<T>);  break;
+            case node::kind::N256: st.bytes += sizeof(trie_node256<T>); break;
+        }
+        if (n->prefix.capacity() > std::string().capacity())
+            st.bytes += n->prefix.capacity() + 1;
+
+        for_each_child(n, [&st](uint8_t, node* child) { recursive_stats(child, st); });
+    }
+
+    node* m_root;
 };
 
 #endif // TRIE_H
@@ -0,0 +1,41 @@
+#ifndef UTF8_H
+#define UTF8_H
+
+#include <cstddef>
+#include <cstdint>
+#include <string_view>
+
+// validation of MQTT UTF-8 encoded strings [MQTT-1.5.3]
+// strings are scanned with AVX2 or SSSE3 when the cpu has them, both validate multi-byte characters
+// in vectors with the lookup tables of Keiser and Lemire. SSE2 only checks ASCII in vectors and
+// scans blocks with multi-byte characters byte by byte, the scalar scan is the fallback and the
+// reference. Most of the strings are plain ASCII, so every scan has a fast path for such blocks
+namespace utf8
+{
+    // what was found in a string, combination of the flags. Scans may stop at the first malformed
+    // character, so with MALFORMED set the other flags are only what was found so far
+    enum scan_result: uint8_t
+    {
+        CLEAN     = 0,
+        MALFORMED = 1 << 0,   // ill-formed UTF-8, surrogates, code points above U+10FFFF [MQTT-1.5.3-1]
+        NUL       = 1 << 1,   // U+0000 [MQTT-1.5.3-2]
+        WILDCARD  = 1 << 2    // '+' or '#'
+    };
+
+    uint8_t scan_scalar(const uint8_t* p, size_t len);
+    uint8_t scan_sse2  (const uint8_t* p, size_t len);
+    uint8_t scan_ssse3 (const uint8_t* p, size_t len);
+    uint8_t scan_avx2  (const uint8_t* p, size_t len);
+    // best implementation supported by the cpu, chosen once
+    uint8_t scan(const uint8_t* p, size_t len);
+
+    inline uint8_t scan(std::string_view str)
+    {
+        return scan(reinterpret_cast<const uint8_t*>(str.data()), str.size());
+    }
+
+    // '#' may only be the last level, '+' must occupy a whole level [MQTT-4.7.1-2], [MQTT-4.7.1-3]
+    bool has_valid_wildcards(std::string_view filter);
+}
+
+#endif // UTF8_H
@@ -1,11 +1,79 @@
 #include "server.h"
 
+// MQTT_LOG_LEVEL=trace|debug|info|warn|error|off
+// MQTT_TRACE_CLIENTS=id1,id2 - trace packets of these clients only
+void configure_log()
+{
+    auto& log = tps::net::logger::instance();
+
+    if (const char* level = std::getenv("MQTT_LOG_LEVEL"))
+    {
+        const std::vector<std::string> names = {"trace", "debug", "info", "warn", "error", "off"};
+        auto it = std::find(names.begin(), names.end(), std::string(level));
+        if (it != names.end())
+            log.set_level(tps::net::log_level(it - names.begin()));
+    }
+
+    if (const char* clients = std::getenv("MQTT_TRACE_CLIENTS"))
+    {
+        std::vector<std::string> ids;
+        boost::split(ids, clients, boost::is_any_of(","));
+        for (auto& id: ids)
+            if (id.size())
+                log.trace_client(id);
+    }
+}
+
+// size in bytes with an optional k, m or g suffix
+size_t parse_size(const char* str)
+{
+    char* end = nullptr;
+    size_t size = std::strtoull(str, &end, 10);
+    switch (std::tolower(*end))
+    {
+        case 'g': size <<= 10; [[fallthrough]];
+        case 'm': size <<= 10; [[fallthrough]];
+        case 'k': size <<= 10;
+    }
+    return size;
+}
+
+// MQTT_OFFLINE_SESSION_BYTES=n - msgs saved in one session, in memory and spilled, unlimited by default
+// MQTT_OFFLINE_MEMORY_BYTES=n - memory taken by the msgs saved in all sessions, 1g by default
+// MQTT_OFFLINE_POLICY=oldest|newest - msgs dropped when a limit is hit
+// MQTT_OFFLINE_SPILL_BYTES=n - msgs of a session above it are spilled to disk, never by default
+// MQTT_OFFLINE_SPILL_DIR=path - directory of spill files, system temp directory by default
+void configure_offline_queues()
+{
+    auto lim = offline_queue::get_limits();
+
+    if (const char* bytes = std::getenv("MQTT_OFFLINE_SESSION_BYTES"))
+        lim.maxSessionBytes = parse_size(bytes);
+    if (const char* bytes = std::getenv("MQTT_OFFLINE_MEMORY_BYTES"))
+        lim.maxMemoryBytes = parse_size(bytes);
+    if (const char* policy = std::getenv("MQTT_OFFLINE_POLICY"))
+        lim.policy = std::string(policy) == "newest" ? offline_queue::drop_policy::DROP_NEWEST :
+                                                       offline_queue::drop_policy::DROP_OLDEST;
+    if (const char* bytes = std::getenv("MQTT_OFFLINE_SPILL_BYTES"))
+        lim.spillThreshold = parse_size(bytes);
+    if (const char* dir = std::getenv("MQTT_OFFLINE_SPILL_DIR"))
+        lim.spillDir = dir;
+
+    offline_queue::set_limits(lim);
+}
+
 int main()
 {
-    server broker(1883);
+    configure_log();
+    configure_offline_queues();
+
+    server broker(1883, std::thread::hardware_concurrency());
+    // MQTT_MAX_INFLIGHT=n - unacknowledged QoS 1 and 2 msgs per client, 64 by default
+    if (const char* maxInflight = std::getenv("MQTT_MAX_INFLIGHT"))
+        broker.set_max_inflight(uint16_t(std::clamp(std::atoi(maxInflight), 1, 65535)));
     broker.start();
     broker.update();
 
-    std::cout << "END\n";
+    LOG_INFO("END");
     return 0;
 }
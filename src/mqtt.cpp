@@ -1,5 +1,6 @@
 #include "mqtt.h"
 #include "NetCommon/net_message.h"
+#include "utf8.h"
 
 uint8_t mqtt_encode_length(tps::net::message<mqtt_header>& msg, size_t len)
 {
@@ -46,10 +47,10 @@ std::ostream& operator<<(std::ostream& os, const mqtt_header& pkt)
 {
     os << "\t=================HEADER=================\n";
     if (pkt.bits.type == uint8_t(packet_type::PUBLISH))
-        printf("\tQOS:\t%d\t|\n\tRETAIN:\t%d\t|\tDUP:\t%d\t|\n",
-               pkt.bits.qos, pkt.bits.retain, pkt.bits.dup);
+        os << "\tQOS:\t" << int(pkt.bits.qos) << "\t|\n\tRETAIN:\t" << int(pkt.bits.retain)
+           << "\t|\tDUP:\t" << int(pkt.bits.dup) << "\t|\n";
     else
-        printf("\tDUP:\t%d\t|\n", pkt.bits.dup);
+        os << "\tDUP:\t" << int(pkt.bits.dup) << "\t|\n";
     os << "\t==================BODY==================\n\n";
     return os;
 }
@@ -64,19 +65,19 @@ std::ostream& operator<<(std::ostream& os, const mqtt_packet& pkt)
 std::ostream& operator<<(std::ostream& os, const mqtt_connect& pkt)
 {
     os << pkt.header;
-    os << "\tCLIENT ID: \"" << pkt.payload.clientID << "\"" << std::endl;
-    os << "\tCLEAN SESSION: " << std::to_string(pkt.vhdr.bits.cleanSession) << std::endl;
-    os << "\tKEEPALIVE: " << pkt.payload.keepalive << std::endl;
+    os << "\tCLIENT ID: \"" << pkt.payload.clientID << "\"" << "\n";
+    os << "\tCLEAN SESSION: " << std::to_string(pkt.vhdr.bits.cleanSession) << "\n";
+    os << "\tKEEPALIVE: " << pkt.payload.keepalive << "\n";
     if (pkt.vhdr.bits.will)
     {
-        os << "\tWILL TOPIC:" << "\"" << pkt.payload.willTopic << "\"" << std::endl;
-        os << "\tWILL MSG:" << "\"" << pkt.payload.willMessage << "\"" << std::endl;
-        os << "\tWILL RETAIN:" << std::to_string(pkt.vhdr.bits.willRetain) << std::endl;
+        os << "\tWILL TOPIC:" << "\"" << pkt.payload.willTopic << "\"" << "\n";
+        os << "\tWILL MSG:" << "\"" << pkt.payload.willMessage << "\"" << "\n";
+        os << "\tWILL RETAIN:" << std::to_string(pkt.vhdr.bits.willRetain) << "\n";
     }
     if (pkt.vhdr.bits.username)
-        os << "\tUSERNAME:" << "\"" << pkt.payload.username << "\"" << std::endl;
+        os << "\tUSERNAME:" << "\"" << pkt.payload.username << "\"" << "\n";
     if (pkt.vhdr.bits.password)
-        os << "\tPASSWORD:" << "\"" << pkt.payload.password << "\"" << std::endl;
+        os << "\tPASSWORD:" << "\"" << pkt.payload.password << "\"" << "\n";
     os << "\t================END BODY================\n\n";
     return os;
 }
@@ -84,7 +85,7 @@ std::ostream& operator<<(std::ostream& os, const mqtt_connect& pkt)
 std::ostream& operator<<(std::ostream& os, const mqtt_connack& pkt)
 {
     os << pkt.header;
-    printf("\tSP:\t%d\t|\tRC:\t%d\t|\n", pkt.sp.bits.sessionPresent, pkt.rc);
+    os << "\tSP:\t" << int(pkt.sp.bits.sessionPresent) << "\t|\tRC:\t" << int(pkt.rc) << "\t|\n";
     os << "\t================END BODY================\n\n";
 
     return os;
@@ -93,9 +94,9 @@ std::ostream& operator<<(std::ostream& os, const mqtt_connack& pkt)
 std::ostream& operator<<(std::ostream& os, const mqtt_publish& pkt)
 {
     os << pkt.header;
-    os << "\tPKT ID: " << pkt.pktID << std::endl;
-    os << "\tTOPIC[" << pkt.topiclen << "]: " << "\"" << pkt.topic << "\"" << std::endl;
-    os << "\tPAYLOAD[" << pkt.payload.size() << "]: " << "\"" << pkt.payload << "\"" << std::endl;
+    os << "\tPKT ID: " << pkt.pktID << "\n";
+    os << "\tTOPIC[" << pkt.topic.size() << "]: " << "\"" << pkt.topic << "\"" << "\n";
+    os << "\tPAYLOAD[" << pkt.payload.size() << "]: " << "\"" << pkt.payload << "\"" << "\n";
     os << "\t================END BODY================\n\n";
 
     return os;
@@ -104,10 +105,10 @@ std::ostream& operator<<(std::ostream& os, const mqtt_publish& pkt)
 std::ostream& operator<<(std::ostream& os, const mqtt_subscribe& pkt)
 {
     os << pkt.header;
-    os << "\tPKT ID: " << pkt.pktID << std::endl;
-    for (auto& [topiclen, topic, qos]: pkt.tuples)
-        os << "\tTOPIC[" << topiclen << "]: "
-           << "\"" << topic << "\": " << std::to_string(qos) << std::endl;
+    os << "\tPKT ID: " << pkt.pktID << "\n";
+    for (auto& [topic, qos]: pkt.tuples)
+        os << "\tTOPIC[" << topic.size() << "]: "
+           << "\"" << topic << "\": " << std::to_string(qos) << "\n";
     os << "\t================END BODY================\n\n";
 
     return os;
@@ -116,10 +117,10 @@ std::ostream& operator<<(std::ostream& os, const mqtt_subscribe& pkt)
 std::ostream& operator<<(std::ostream& os, const mqtt_unsubscribe& pkt)
 {
     os << pkt.header;
-    os << "\tPKT ID: " << pkt.pktID << std::endl;
-    for (auto& [topiclen, topic]: pkt.tuples)
-        os << "\tTOPIC[" << topiclen << "]: "
-           << "\"" << topic << "\"" << std::endl;
+    os << "\tPKT ID: " << pkt.pktID << "\n";
+    for (auto& topic: pkt.topics)
+        os << "\tTOPIC[" << topic.size() << "]: "
+           << "\"" << topic << "\"" << "\n";
     os << "\t================END BODY================\n\n";
 
     return os;
@@ -128,11 +129,11 @@ std::ostream& operator<<(std::ostream& os, const mqtt_unsubscribe& pkt)
 std::ostream& operator<<(std::ostream& os, const mqtt_suback& pkt)
 {
     os << pkt.header;
-    os << "\tPKT ID: " << pkt.pktID << std::endl;
+    os << "\tPKT ID: " << pkt.pktID << "\n";
     os << "\tRCS: ";
     for (auto rc: pkt.rcs)
         os << std::to_string(rc) << " ";
-    os << std::endl;
+    os << "\n";
     os << "\t================END BODY================\n\n";
 
     return os;
@@ -141,308 +142,553 @@ std::ostream& operator<<(std::ostream& os, const mqtt_suback& pkt)
 std::ostream& operator<<(std::ostream& os, const mqtt_ack& pkt)
 {
     os << pkt.header;
-    os << "\tPKT ID: " << pkt.pktID << std::endl;
+    os << "\tPKT ID: " << pkt.pktID << "\n";
     os << "\t================END BODY================\n\n";
 
     return os;
 }
 
-std::unique_ptr<mqtt_packet> mqtt_packet::create(tps::net::message<mqtt_header>& msg)
+const char* to_string(parse_error err)
 {
-    std::unique_ptr<mqtt_packet> ret;
-    uint8_t byte = msg.hdr.byte.byte;
+    switch (err)
+    {
+        case parse_error::NONE:          return "none";
+        case parse_error::TRUNCATED:     return "packet is truncated";
+        case parse_error::TRAILING_DATA: return "unexpected data after the last field";
+        case parse_error::INVALID_FLAGS: return "invalid fixed header flags";
+        case parse_error::PROTOCOL_NAME: return "invalid protocol name";
+        case parse_error::RESERVED_BIT:  return "reserved bit must be zero";
+        case parse_error::CLIENT_ID_LEN: return "client ID len must be less than 24 bytes";
+        case parse_error::WILL_FLAGS:    return "if the will flag == 0, then the will qos and retain must be == 0";
+        case parse_error::INVALID_QOS:   return "the value of qos must not be == 3";
+        case parse_error::PASSWORD_FLAG: return "if the username flag == 0, the password flag must be == 0";
+        case parse_error::NO_TOPICS:     return "packet must contain at least one topic filter";
+        case parse_error::EMPTY_TOPIC:   return "all topic names and filters must be at least one character long";
+        case parse_error::MALFORMED_UTF8:    return "string is not well-formed UTF-8";
+        case parse_error::NULL_CHARACTER:    return "string must not contain U+0000";
+        case parse_error::WILDCARD_IN_TOPIC: return "topic name must not contain wildcards";
+        case parse_error::INVALID_WILDCARD:  return "wildcard must occupy an entire level, '#' must be the last one";
+        case parse_error::RESERVED_TYPE:     return "packet type is reserved";
+    }
+    return "unknown";
+}
+
+// bounds checked reader over the body of a received packet
+// strings are returned as views into the body, nothing is copied
+struct mqtt_reader
+{
+    mqtt_reader(const tps::net::message<mqtt_header>& msg):
+        p(msg.body.data()), end(msg.body.data() + msg.body.size()) {}
 
-    switch (packet_type(byte >> 4))
+    bool read(uint8_t& val)
     {
-        case packet_type::CONNECT:
-            ret = create<mqtt_connect>(byte);
-            break;
-        case packet_type::CONNACK:
-            ret = create<mqtt_connack>(byte);
-            break;
-        case packet_type::SUBSCRIBE:
-            ret = create<mqtt_subscribe>(byte);
-            break;
-        case packet_type::UNSUBSCRIBE:
-            ret = create<mqtt_unsubscribe>(byte);
-            break;
-        case packet_type::SUBACK:
-            ret = create<mqtt_suback>(byte);
-            break;
-        case packet_type::PUBLISH:
-            ret = create<mqtt_publish>(byte);
-            break;
-        case packet_type::PUBACK:
-        case packet_type::PUBREC:
-        case packet_type::PUBREL:
-        case packet_type::PUBCOMP:
-            ret = create<mqtt_ack>(byte);
-            break;
-        case packet_type::PINGREQ:
-        case packet_type::PINGRESP:
-        case packet_type::DISCONNECT:
-        default:
-            ret = create<mqtt_packet>(byte);
-            break;
+        if (left() < sizeof(val))
+            return false;
+        val = *p++;
+        return true;
     }
 
-    try {
-        ret->unpack(msg);
-    } catch (...) {
-        ret = nullptr;
+    // big endian
+    bool read(uint16_t& val)
+    {
+        if (left() < sizeof(val))
+            return false;
+        val = uint16_t(p[0] << 8 | p[1]);
+        p += sizeof(val);
+        return true;
     }
 
-    // there should't be anything left after unpacking
-    if (msg.is_data_left())
-        ret = nullptr;
+    // string prefixed with it's 2 byte len
+    bool read(std::string_view& str)
+    {
+        uint16_t len;
+        return read(len) && read(str, len);
+    }
 
-    return ret;
+    bool read(std::string_view& str, size_t len)
+    {
+        if (left() < len)
+            return false;
+        str = std::string_view(reinterpret_cast<const char*>(p), len);
+        p += len;
+        return true;
+    }
+
+    size_t left() const
+    {
+        return size_t(end - p);
+    }
+
+    const uint8_t* p;
+    const uint8_t* end;
+};
+
+// UTF-8 string fields [MQTT-1.5.3], every string is scanned once
+static parse_error string_error(uint8_t scanResult)
+{
+    if (scanResult & utf8::MALFORMED)
+        return parse_error::MALFORMED_UTF8;
+    if (scanResult & utf8::NUL)
+        return parse_error::NULL_CHARACTER;
+    return parse_error::NONE;
 }
 
-void mqtt_packet::unpack(tps::net::message<mqtt_header>& msg)
+static parse_error check_string(std::string_view str)
+{
+    return string_error(utf8::scan(str));
+}
+
+static parse_error check_topic_name(std::string_view topic)
+{
+    if (topic.empty()) // [MQTT-4.7.3-1]
+        return parse_error::EMPTY_TOPIC;
+
+    auto res = utf8::scan(topic);
+    if (auto err = string_error(res); err != parse_error::NONE)
+        return err;
+    return (res & utf8::WILDCARD) ? parse_error::WILDCARD_IN_TOPIC : parse_error::NONE;
+}
+
+static parse_error check_topic_filter(std::string_view filter)
+{
+    if (filter.empty()) // [MQTT-4.7.3-1]
+        return parse_error::EMPTY_TOPIC;
+
+    auto res = utf8::scan(filter);
+    if (auto err = string_error(res); err != parse_error::NONE)
+        return err;
+    if ((res & utf8::WILDCARD) && !utf8::has_valid_wildcards(filter))
+        return parse_error::INVALID_WILDCARD;
+    return parse_error::NONE;
+}
+
+template <typename T>
+static parse_error parse_as(const tps::net::message<mqtt_header>& msg, mqtt_any& pkt)
+{
+    return pkt.emplace<T>(msg.hdr.byte.byte).unpack(msg);
+}
+
+static parse_error parse_reserved(const tps::net::message<mqtt_header>&, mqtt_any&)
+{
+    return parse_error::RESERVED_TYPE;
+}
+
+using parse_func = parse_error (*)(const tps::net::message<mqtt_header>&, mqtt_any&);
+
+// indexed by the type nibble of the fixed header
+static constexpr parse_func parsers[16] =
+{
+    parse_reserved,             // 0 - reserved
+    parse_as<mqtt_connect>,     // CONNECT
+    parse_as<mqtt_connack>,     // CONNACK
+    parse_as<mqtt_publish>,     // PUBLISH
+    parse_as<mqtt_ack>,         // PUBACK
+    parse_as<mqtt_ack>,         // PUBREC
+    parse_as<mqtt_ack>,         // PUBREL
+    parse_as<mqtt_ack>,         // PUBCOMP
+    parse_as<mqtt_subscribe>,   // SUBSCRIBE
+    parse_as<mqtt_suback>,      // SUBACK
+    parse_as<mqtt_unsubscribe>, // UNSUBSCRIBE
+    parse_as<mqtt_ack>,         // UNSUBACK
+    parse_as<mqtt_packet>,      // PINGREQ
+    parse_as<mqtt_packet>,      // PINGRESP
+    parse_as<mqtt_packet>,      // DISCONNECT
+    parse_reserved              // 15 - reserved
+};
+
+parse_error mqtt_parse(const tps::net::message<mqtt_header>& msg, mqtt_any& pkt)
+{
+    return parsers[msg.hdr.byte.bits.type](msg, pkt);
+}
+
+parse_error mqtt_packet::unpack(const tps::net::message<mqtt_header>& msg)
 {
     if (msg.hdr.byte.bits.type == uint8_t(packet_type::DISCONNECT) &&
        (msg.hdr.byte.byte & 0xf) != 0) // [MQTT-3.14.1-1]
-        throw std::runtime_error("First 4 bits of the DISCONNECT header must be == 0");
+        return parse_error::INVALID_FLAGS;
+
+    // there should't be anything left after unpacking
+    if (msg.body.size())
+        return parse_error::TRAILING_DATA;
+
+    return parse_error::NONE;
 }
 
-void mqtt_connect::unpack(tps::net::message<mqtt_header>& msg)
+parse_error mqtt_connect::unpack(const tps::net::message<mqtt_header>& msg)
 {
-    uint16_t protocolLen = 0;
-    msg >> protocolLen;
-    protocolLen = byteswap16(protocolLen);
+    mqtt_reader in(msg);
 
-    std::string protocolName;
-    protocolName.resize(protocolLen);
-    msg >> protocolName;
+    std::string_view protocolName;
+    if (!in.read(protocolName))
+        return parse_error::TRUNCATED;
     if (protocolName != "MQTT")  // [MQTT-3.1.2-1]
-        throw std::runtime_error("Invalid protocol name");
+        return parse_error::PROTOCOL_NAME;
 
-    msg >> payload.protocolLevel;
-
-    msg >> vhdr.byte;
+    if (!in.read(payload.protocolLevel) || !in.read(vhdr.byte))
+        return parse_error::TRUNCATED;
     if (vhdr.bits.reserved) // [MQTT-3.1.2-3]
-        throw std::runtime_error("Reserved bit must be zero");
-
-    msg >> payload.keepalive;
-    payload.keepalive = byteswap16(payload.keepalive);
+        return parse_error::RESERVED_BIT;
 
-    uint16_t clientIDLength = 0;
-    msg >> clientIDLength;
-    clientIDLength = byteswap16(clientIDLength);
-    if (clientIDLength > MAX_CLIENT_ID_LEN)  // [MQTT-3.1.3-5]
-        throw std::runtime_error("Client ID len must be less than 24 bytes");
-
-    payload.clientID.resize(clientIDLength);
-    msg >> payload.clientID;
+    if (!in.read(payload.keepalive) || !in.read(payload.clientID))
+        return parse_error::TRUNCATED;
+    if (payload.clientID.size() > MAX_CLIENT_ID_LEN)  // [MQTT-3.1.3-5]
+        return parse_error::CLIENT_ID_LEN;
+    if (auto err = check_string(payload.clientID); err != parse_error::NONE) // [MQTT-3.1.3-4]
+        return err;
 
     if (vhdr.bits.will)
     {
-        uint16_t willTopicLen = 0;
-        msg >> willTopicLen;
-        willTopicLen = byteswap16(willTopicLen);
-        payload.willTopic.resize(willTopicLen);
-        msg >> payload.willTopic;
-
-        uint16_t willMsgLen = 0;
-        msg >> willMsgLen;
-        willMsgLen = byteswap16(willMsgLen);
-        payload.willMessage.resize(willMsgLen);
-        msg >> payload.willMessage;
+        if (!in.read(payload.willTopic) || !in.read(payload.willMessage))
+            return parse_error::TRUNCATED;
+        if (auto err = check_topic_name(payload.willTopic); err != parse_error::NONE) // [MQTT-3.1.3-10]
+            return err;
     }
     else if (vhdr.bits.willQoS || vhdr.bits.willRetain) // [MQTT-3.1.2-13], [MQTT-3.1.2-15]
-        throw std::runtime_error("If the will flag == 0, then the will qos and retain must be == 0");
+        return parse_error::WILL_FLAGS;
 
     if (vhdr.bits.willQoS > EXACTLY_ONCE)
-        throw std::runtime_error("the value of qos must not be == 3");
+        return parse_error::INVALID_QOS;
 
     if (vhdr.bits.username)
     {
-        uint16_t usernameLen = 0;
-        msg >> usernameLen;
-        usernameLen = byteswap16(usernameLen);
-        payload.username.resize(usernameLen);
-        msg >> payload.username;
+        if (!in.read(payload.username))
+            return parse_error::TRUNCATED;
+        if (auto err = check_string(payload.username); err != parse_error::NONE) // [MQTT-3.1.3-11]
+            return err;
     }
 
     if (vhdr.bits.password)
     {
         if (!vhdr.bits.username) // [MQTT-3.1.2-22]
-            throw std::runtime_error("if the username flag == 0, the password flag must be == 0");
-
-        uint16_t passwordLen = 0;
-        msg >> passwordLen;
-        passwordLen = byteswap16(passwordLen);
-        payload.username.resize(passwordLen);
-        msg >> payload.username;
+            return parse_error::PASSWORD_FLAG;
+        if (!in.read(payload.password))
+            return parse_error::TRUNCATED;
     }
+
+    return in.left() ? parse_error::TRAILING_DATA : parse_error::NONE;
 }
 
-void mqtt_subscribe::unpack(tps::net::message<mqtt_header>& msg)
+parse_error mqtt_subscribe::unpack(const tps::net::message<mqtt_header>& msg)
 {
     if ((msg.hdr.byte.byte & 0xf) != 2) // [MQTT-3.8.1-1]
-         throw std::runtime_error("First 4 bits of the SUBSCRIBE header must be == 2");
+        return parse_error::INVALID_FLAGS;
 
-    msg >> pktID;
-    pktID = byteswap16(pktID);
+    mqtt_reader in(msg);
+    if (!in.read(pktID))
+        return parse_error::TRUNCATED;
 
-    uint32_t remainingBytes = msg.hdr.size - sizeof(pktID);
-    if (!remainingBytes) // [MQTT-3.8.3-3]
-        throw std::runtime_error("The payload of a SUBSCRIBE packet must "
-                                 "contain at least one topic filter / QoS pair");
+    if (!in.left()) // [MQTT-3.8.3-3]
+        return parse_error::NO_TOPICS;
 
-    uint16_t count = 0;
-    while (remainingBytes > 0)
+    while (in.left())
     {
-        tuples.resize(count+1);
-        auto& [topiclen, topic, qos] = tuples[count];
-
-        msg >> topiclen;
-        topiclen = byteswap16(topiclen);
-        if (!topiclen) // [MQTT-4.7.3-1]
-            throw std::runtime_error("All topic filters must be at least one character long");
-        remainingBytes -= sizeof(topiclen);
-
-        topic.resize(topiclen);
-        msg >> topic;
-        msg >> qos;
-        if (qos > EXACTLY_ONCE) // [MQTT-3-8.3-4]
-            throw std::runtime_error("QoS can't be more than 2");
+        auto& [topic, qos] = tuples.emplace_back();
 
-        remainingBytes -= topiclen + sizeof(qos);
-        count++;
+        if (!in.read(topic) || !in.read(qos))
+            return parse_error::TRUNCATED;
+        if (auto err = check_topic_filter(topic); err != parse_error::NONE)
+            return err;
+        if (qos > EXACTLY_ONCE) // [MQTT-3-8.3-4]
+            return parse_error::INVALID_QOS;
     }
+
+    return parse_error::NONE;
 }
 
-void mqtt_unsubscribe::unpack(tps::net::message<mqtt_header>& msg)
+parse_error mqtt_unsubscribe::unpack(const tps::net::message<mqtt_header>& msg)
 {
     if ((msg.hdr.byte.byte & 0xf) != 2) // [MQTT-3.10.1-1]
-        throw std::runtime_error("First 4 bits of the UNSUBSCRIBE header must be == 2");
+        return parse_error::INVALID_FLAGS;
 
-    msg >> pktID;
-    pktID = byteswap16(pktID);
+    mqtt_reader in(msg);
+    if (!in.read(pktID))
+        return parse_error::TRUNCATED;
 
-    uint32_t remainingBytes = msg.hdr.size - sizeof(pktID);
-    if (!remainingBytes) // [MQTT-3.10.3-2]
-        throw std::runtime_error("The payload of an UNSUBSCRIBE packet must "
-                                 "contain at least one topic filter / QoS pair");
+    if (!in.left()) // [MQTT-3.10.3-2]
+        return parse_error::NO_TOPICS;
 
-    uint16_t count = 0;
-    while (remainingBytes > 0)
+    while (in.left())
     {
-        tuples.resize(count+1);
-        auto& [topiclen, topic] = tuples[count];
-
-        msg >> topiclen;
-        topiclen = byteswap16(topiclen);
-        if (!topiclen) // [MQTT-4.7.3-1]
-            throw std::runtime_error("All topic filters must be at least one character long");
-        remainingBytes -= sizeof(topiclen);
-
-        topic.resize(topiclen);
-        msg >> topic;
-        remainingBytes -= topiclen;
-        count++;
+        auto& topic = topics.emplace_back();
+
+        if (!in.read(topic))
+            return parse_error::TRUNCATED;
+        if (auto err = check_topic_filter(topic); err != parse_error::NONE)
+            return err;
     }
+
+    return parse_error::NONE;
 }
 
-void mqtt_publish::unpack(tps::net::message<mqtt_header>& msg)
+parse_error mqtt_publish::unpack(const tps::net::message<mqtt_header>& msg)
 {
-    msg >> topiclen;
-    topiclen = byteswap16(topiclen);
-
-    topic.resize(topiclen);
-    msg >> topic;
-
-    // the len of msg contained in publish packet =
-    // packet len - (len of topic size + topic itself) + len of pkt id when qos level > 0
-    uint32_t payloadlen = msg.hdr.size - (sizeof(topiclen) + topiclen);
+    mqtt_reader in(msg);
+    if (!in.read(topic))
+        return parse_error::TRUNCATED;
+    if (auto err = check_topic_name(topic); err != parse_error::NONE)
+        return err;
 
     // pkt id is a variable field
     if (header.bits.qos > AT_MOST_ONCE)
     {
         if (header.bits.qos == 3) // [MQTT-3.3.1-4]
-            throw std::runtime_error("Publish QoS == 3");
+            return parse_error::INVALID_QOS;
 
-        msg >> pktID;
-        pktID = byteswap16(pktID);
-        payloadlen -= sizeof(pktID);
+        if (!in.read(pktID))
+            return parse_error::TRUNCATED;
     }
 
-    payload.resize(payloadlen);
-    msg >> payload;
+    // the rest of the packet is payload
+    in.read(payload, in.left());
+
+    return parse_error::NONE;
 }
 
-void mqtt_suback::unpack(tps::net::message<mqtt_header>& msg)
+parse_error mqtt_suback::unpack(const tps::net::message<mqtt_header>& msg)
 {
-    msg >> pktID;
-    pktID = byteswap16(pktID);
+    mqtt_reader in(msg);
+    if (!in.read(pktID))
+        return parse_error::TRUNCATED;
+
+    rcs.assign(in.p, in.end);
 
-    uint16_t rcsBytes = msg.hdr.size - sizeof(pktID);
-    rcs.resize(rcsBytes);
-    msg >> rcs;
+    return parse_error::NONE;
 }
 
-void mqtt_ack::unpack(tps::net::message<mqtt_header>& msg)
+parse_error mqtt_ack::unpack(const tps::net::message<mqtt_header>& msg)
 {
     if (msg.hdr.byte.bits.type == uint8_t(packet_type::PUBREL) &&
        (msg.hdr.byte.byte & 0xf) != 2) // [MQTT-3.6.1-1]
-        throw std::runtime_error("First 4 bits of the PUBREL header must be == 2");
+        return parse_error::INVALID_FLAGS;
+
+    mqtt_reader in(msg);
+    if (!in.read(pktID))
+        return parse_error::TRUNCATED;
+
+    return in.left() ? parse_error::TRAILING_DATA : parse_error::NONE;
+}
+
+// writes fields of a packet into a buffer that is known to be big enough
+struct mqtt_writer
+{
+    void put(uint8_t val)
+    {
+        *p++ = val;
+    }
+
+    // big endian
+    void put(uint16_t val)
+    {
+        *p++ = uint8_t(val >> 8);
+        *p++ = uint8_t(val);
+    }
 
-    msg >> pktID;
-    pktID = byteswap16(pktID);
+    void put(std::string_view str)
+    {
+        std::memcpy(p, str.data(), str.size());
+        p += str.size();
+    }
+
+    // string prefixed with it's 2 byte len
+    void put_string(std::string_view str)
+    {
+        put(uint16_t(str.size()));
+        put(str);
+    }
+
+    void put_length(uint32_t len)
+    {
+        do
+        {
+            uint8_t d = len % 128;
+            len /= 128;
+            if (len > 0)
+                d |= 128;
+            *p++ = d;
+        } while (len > 0);
+    }
+
+    uint8_t* p;
+};
+
+// number of bytes taken by the remaining length field
+static size_t length_size(uint32_t len)
+{
+    return len < 128 ? 1 : len < 16384 ? 2 : len < 2097152 ? 3 : 4;
+}
+
+// every packet provides remaining_length() and pack_body(mqtt_writer&),
+// the frame is: fixed header byte, remaining length, packet's variable header and payload
+template <typename Packet>
+static size_t packed_size(const Packet& pkt)
+{
+    uint32_t len = pkt.remaining_length();
+    return sizeof(pkt.header) + length_size(len) + len;
+}
+
+template <typename Packet>
+static uint8_t* pack_frame(const Packet& pkt, uint8_t* out)
+{
+    mqtt_writer w{out};
+    w.put(pkt.header.byte);
+    w.put_length(pkt.remaining_length());
+    pkt.pack_body(w);
+    return w.p;
 }
 
-void mqtt_packet::pack(tps::net::message<mqtt_header>& msg) const
+// whole frame goes into msg body, which is allocated once with the exact size
+template <typename Packet>
+static void pack_frame(const Packet& pkt, tps::net::message<mqtt_header>& msg)
 {
-    msg.hdr.byte = header.byte;
-    msg.writeHdrSize += mqtt_encode_length(msg, 0);
+    msg.hdr.byte = pkt.header.byte;
+    msg.writeHdrSize = 0;
+    msg.body.resize(packed_size(pkt));
+    pack_frame(pkt, msg.body.data());
 }
 
-void mqtt_publish::pack(tps::net::message<mqtt_header>& msg) const
+uint32_t mqtt_packet::remaining_length() const
 {
-    msg.hdr.byte = header.byte;
-    uint32_t remainingLen = sizeof(topiclen) +
-                            topiclen + payload.size();
+    return 0;
+}
+
+void mqtt_packet::pack_body(mqtt_writer&) const
+{
+}
+
+uint32_t mqtt_connack::remaining_length() const
+{
+    return sizeof(sp) + sizeof(rc);
+}
+
+void mqtt_connack::pack_body(mqtt_writer& w) const
+{
+    w.put(sp.byte);
+    w.put(rc);
+}
+
+uint32_t mqtt_suback::remaining_length() const
+{
+    return uint32_t(sizeof(pktID) + rcs.size());
+}
+
+void mqtt_suback::pack_body(mqtt_writer& w) const
+{
+    w.put(pktID);
+    w.put(std::string_view(reinterpret_cast<const char*>(rcs.data()), rcs.size()));
+}
+
+uint32_t mqtt_publish::remaining_length() const
+{
+    uint32_t len = uint32_t(sizeof(uint16_t) + topic.size() + payload.size());
     if (header.bits.qos > AT_MOST_ONCE)
-        remainingLen += sizeof(pktID);
-    msg.writeHdrSize += mqtt_encode_length(msg, remainingLen);
+        len += sizeof(pktID);
+    return len;
+}
 
-    uint16_t topiclenbe = byteswap16(topiclen);
-    msg << topiclenbe;
-    msg << topic;
+void mqtt_publish::pack_body(mqtt_writer& w) const
+{
+    w.put_string(topic);
     if (header.bits.qos > AT_MOST_ONCE)
-    {
-        uint16_t pktIDbe = byteswap16(pktID);
-        msg << pktIDbe;
-    }
-    msg << payload;
+        w.put(pktID);
+    w.put(payload);
+}
+
+uint32_t mqtt_ack::remaining_length() const
+{
+    return sizeof(pktID);
+}
+
+void mqtt_ack::pack_body(mqtt_writer& w) const
+{
+    w.put(pktID);
+}
+
+#define DEFINE_PACK(Packet)                                                 \
+    size_t Packet::packed_size() const { return ::packed_size(*this); }     \
+    uint8_t* Packet::pack(uint8_t* out) const { return pack_frame(*this, out); } \
+    void Packet::pack(tps::net::message<mqtt_header>& msg) const { pack_frame(*this, msg); }
+
+DEFINE_PACK(mqtt_packet)
+DEFINE_PACK(mqtt_connack)
+DEFINE_PACK(mqtt_suback)
+DEFINE_PACK(mqtt_publish)
+DEFINE_PACK(mqtt_ack)
+#undef DEFINE_PACK
+
+void mqtt_publish::make_owned()
+{
+    if (storage)
+        return;
+
+    storage = pack_shared();
+    auto p = reinterpret_cast<const char*>(storage->data()) + sizeof(uint16_t);
+    topic = std::string_view(p, topic.size());
+    payload = std::string_view(p + topic.size(), payload.size());
 }
 
-void mqtt_connack::pack(tps::net::message<mqtt_header>& msg) const
+void mqtt_publish::adopt(tps::net::buffer&& body)
 {
-    msg.hdr.byte = header.byte;
-    msg.writeHdrSize += mqtt_encode_length(msg, sizeof(sp) + sizeof(rc));
+    if (storage || header.bits.qos != AT_MOST_ONCE)
+        return;
 
-    msg << sp.byte;
-    msg << rc;
+    // moving the vector doesn't move it's data, so topic and payload views stay valid
+    storage = tps::net::make_shared_buffer(std::move(body));
 }
 
-void mqtt_suback::pack(tps::net::message<mqtt_header>& msg) const
+std::shared_ptr<const tps::net::buffer> mqtt_publish::pack_shared() const
 {
-    msg.hdr.byte = header.byte;
-    msg.writeHdrSize += mqtt_encode_length(msg, sizeof(pktID) + rcs.size());
+    if (storage)
+        return storage;
+
+    auto shared = tps::net::make_shared_buffer(sizeof(uint16_t) + topic.size() + payload.size());
 
-    uint16_t pktIDbe = byteswap16(pktID);
-    msg << pktIDbe;
-    msg << rcs;
+    mqtt_writer w{shared->data()};
+    w.put_string(topic);
+    w.put(payload);
+
+    return shared;
+}
+
+void mqtt_publish::pack(tps::net::message<mqtt_header>& msg,
+                        const std::shared_ptr<const tps::net::buffer>& shared) const
+{
+    // fixed header and remaining length go to msg hdr
+    mqtt_writer hdr{reinterpret_cast<uint8_t*>(&msg.hdr)};
+    hdr.put(header.byte);
+    hdr.put_length(remaining_length());
+    msg.writeHdrSize = uint8_t(hdr.p - reinterpret_cast<uint8_t*>(&msg.hdr));
+
+    // pkt ID goes between topic and payload
+    msg.shared = shared;
+    msg.sharedHead = msg.sharedTail = uint32_t(sizeof(uint16_t) + topic.size());
+    if (header.bits.qos > AT_MOST_ONCE)
+    {
+        msg.body.resize(sizeof(pktID));
+        mqtt_writer w{msg.body.data()};
+        w.put(pktID);
+    }
 }
 
-void mqtt_ack::pack(tps::net::message<mqtt_header>& msg) const
+void mqtt_publish::pack_head(tps::net::message<mqtt_header>& msg, const std::shared_ptr<const tps::net::buffer>& part,
+                             uint32_t payloadOffset, uint32_t payloadLen) const
 {
-    msg.hdr.byte = header.byte;
-    msg.writeHdrSize += mqtt_encode_length(msg, sizeof(pktID));
+    uint32_t len = uint32_t(sizeof(uint16_t) + topic.size()) + payloadLen;
+    if (header.bits.qos > AT_MOST_ONCE)
+        len += sizeof(pktID);
 
-    uint16_t pktIDbe = byteswap16(pktID);
-    msg << pktIDbe;
+    mqtt_writer hdr{reinterpret_cast<uint8_t*>(&msg.hdr)};
+    hdr.put(header.byte);
+    hdr.put_length(len);
+    msg.writeHdrSize = uint8_t(hdr.p - reinterpret_cast<uint8_t*>(&msg.hdr));
+
+    // publisher's pkt ID (if any) is skipped, receiver's one is put in it's place
+    msg.shared = part;
+    msg.sharedHead = uint32_t(sizeof(uint16_t) + topic.size());
+    msg.sharedTail = payloadOffset;
+    if (header.bits.qos > AT_MOST_ONCE)
+    {
+        msg.body.resize(sizeof(pktID));
+        mqtt_writer w{msg.body.data()};
+        w.put(pktID);
+    }
 }
@@ -0,0 +1,400 @@
+#include "offline_queue.h"
+#include "NetCommon/net_log.h"
+#include <cerrno>
+#include <cstring>
+#include <fcntl.h>
+#include <filesystem>
+#include <unistd.h>
+#include <unordered_map>
+
+namespace
+{
+    // append-only spill files shared by all queues, msgs are written to the current file, which is
+    // replaced by a new one when it grows over SEGMENT_SIZE. A file is closed once no queue refers to it's
+    // msgs. Files are unlinked right after they are created, so they are gone when closed, even on a crash
+    struct spill_log
+    {
+        static constexpr uint32_t SEGMENT_SIZE = 64 << 20;
+
+        struct segment
+        {
+            int fd = -1;
+            uint32_t size = 0;
+            // spilled msgs that are still queued
+            uint32_t refs = 0;
+        };
+        std::unordered_map<uint32_t, segment> segments;
+        uint32_t current = 0; // 0 - none
+        uint32_t nextID = 1;
+        size_t diskBytes = 0;
+
+        // storage written last, msg that is spilled for many sessions is written once and they all refer
+        // to the same record. weak_ptr keeps the control block, so new storage can't be taken for it
+        std::weak_ptr<const tps::net::buffer> lastStorage;
+        uint32_t lastSegment = 0;
+        uint32_t lastOffset = 0;
+
+        ~spill_log()
+        {
+            for (auto& [id, seg]: segments)
+                ::close(seg.fd);
+        }
+
+        bool write(const std::shared_ptr<const tps::net::buffer>& storage, const std::string& dir,
+                   uint32_t& segmentID, uint32_t& offset)
+        {
+            if (!lastStorage.owner_before(storage) && !storage.owner_before(lastStorage))
+            {
+                segments[lastSegment].refs++;
+                segmentID = lastSegment;
+                offset = lastOffset;
+                return true;
+            }
+
+            if (!current || (segments[current].size && segments[current].size + storage->size() > SEGMENT_SIZE))
+                if (!open_segment(dir))
+                    return false;
+
+            auto& seg = segments[current];
+            size_t written = 0;
+            while (written < storage->size())
+            {
+                auto n = ::pwrite(seg.fd, storage->data() + written, storage->size() - written, off_t(seg.size + written));
+                if (n < 0 && errno == EINTR)
+                    continue;
+                if (n <= 0)
+                {
+                    LOG_ERROR("Spill file write failed: " << std::strerror(errno));
+                    return false;
+                }
+                written += size_t(n);
+            }
+
+            segmentID = current;
+            offset = seg.size;
+            seg.size += uint32_t(written);
+            seg.refs++;
+            diskBytes += written;
+
+            lastStorage = storage;
+            lastSegment = segmentID;
+            lastOffset = offset;
+            return true;
+        }
+
+        bool read(uint32_t segmentID, uint32_t offset, uint32_t len, tps::net::buffer& out)
+        {
+            out.resize(len);
+            int fd = segments[segmentID].fd;
+            size_t done = 0;
+            while (done < len)
+            {
+                auto n = ::pread(fd, out.data() + done, len - done, off_t(offset + done));
+                if (n < 0 && errno == EINTR)
+                    continue;
+                if (n <= 0)
+                    return false;
+                done += size_t(n);
+            }
+            return true;
+        }
+
+        void release(uint32_t segmentID)
+        {
+            auto it = segments.find(segmentID);
+            if (--it->second.refs)
+                return;
+
+            if (segmentID == lastSegment)
+                lastStorage.reset();
+            diskBytes -= it->second.size;
+
+            // current file is reused from the start
+            if (segmentID == current && ::ftruncate(it->second.fd, 0) == 0)
+            {
+                it->second.size = 0;
+                return;
+            }
+            if (segmentID == current)
+                current = 0;
+            ::close(it->second.fd);
+            segments.erase(it);
+        }
+
+    private:
+        bool open_segment(const std::string& dir)
+        {
+            std::error_code ec;
+            std::filesystem::path path = dir.size() ? std::filesystem::path(dir) : std::filesystem::temp_directory_path(ec);
+            path /= "mqtt-spill-" + std::to_string(::getpid()) + "-" + std::to_string(nextID);
+
+            int fd = ::open(path.c_str(), O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC, 0600);
+            if (fd < 0)
+            {
+                LOG_ERROR("Can't create spill file " << path.string() << ": " << std::strerror(errno));
+                return false;
+            }
+            ::unlink(path.c_str());
+
+            // previous file stays until it's msgs are read
+            if (current && !segments[current].refs)
+            {
+                ::close(segments[current].fd);
+                segments.erase(current);
+            }
+
+            current = nextID++;
+            segments[current].fd = fd;
+            return true;
+        }
+    };
+}
+
+struct offline_queue::state
+{
+    limits lim;
+
+    size_t msgs = 0;
+    size_t memoryBytes = 0;
+    size_t spilledMsgs = 0;
+    size_t spilledBytes = 0;
+    uint64_t dropped = 0;
+
+    // storage of the msgs in memory with the number of msgs that refer to it, so that it's counted once
+    std::unordered_map<const tps::net::buffer*, uint32_t> storageRefs;
+    // publish is saved in many sessions one after another, so the last storage is looked up once
+    const tps::net::buffer* lastStorage = nullptr;
+    uint32_t* lastRefs = nullptr;
+
+    spill_log log;
+
+    uint32_t* find_refs(const tps::net::buffer* storage)
+    {
+        if (storage == lastStorage)
+            return lastRefs;
+
+        auto it = storageRefs.find(storage);
+        if (it == storageRefs.end())
+            return nullptr;
+        lastStorage = storage;
+        lastRefs = &it->second;
+        return lastRefs;
+    }
+
+    void add_ref(const std::shared_ptr<const tps::net::buffer>& storage)
+    {
+        if (auto refs = find_refs(storage.get()))
+        {
+            ++*refs;
+            return;
+        }
+        memoryBytes += storage->size();
+        lastStorage = storage.get();
+        lastRefs = &storageRefs.emplace(lastStorage, 1).first->second;
+    }
+
+    void release_ref(const std::shared_ptr<const tps::net::buffer>& storage)
+    {
+        if (--*find_refs(storage.get()))
+            return;
+        memoryBytes -= storage->size();
+        storageRefs.erase(storage.get());
+        lastStorage = nullptr;
+    }
+};
+
+offline_queue::state& offline_queue::get_state()
+{
+    static state s;
+    return s;
+}
+
+void offline_queue::set_limits(const limits& lim)
+{
+    get_state().lim = lim;
+}
+
+const offline_queue::limits& offline_queue::get_limits()
+{
+    return get_state().lim;
+}
+
+offline_queue::stats offline_queue::get_stats()
+{
+    auto& s = get_state();
+    return {s.msgs, s.memoryBytes, s.spilledMsgs, s.spilledBytes, s.log.diskBytes, s.dropped};
+}
+
+bool offline_queue::push(const mqtt_publish& pkt, uint8_t qos)
+{
+    auto& s = get_state();
+    auto& lim = s.lim;
+    size_t len = msg_bytes(pkt);
+
+    if (lim.maxSessionBytes && len > lim.maxSessionBytes)
+        return drop_new();
+    while (lim.maxSessionBytes && bytes() + len > lim.maxSessionBytes)
+    {
+        if (lim.policy == drop_policy::DROP_NEWEST)
+            return drop_new();
+        drop_oldest();
+    }
+
+    // storage that other msgs in memory refer to takes no more memory, vector grows twice when it's full
+    auto memory_cost = [this, &s](const mqtt_publish& pkt)
+    {
+        size_t cost = s.find_refs(pkt.storage.get()) ? 0 : pkt.storage->size();
+        if (m_msgs.full())
+            cost += std::max<size_t>(m_msgs.items.capacity(), 1) * sizeof(saved_msg);
+        return cost;
+    };
+
+    bool bSpill = lim.spillThreshold && (!m_spilled.empty() || m_nMemoryBytes + len > lim.spillThreshold);
+    while (!bSpill && lim.maxMemoryBytes && s.memoryBytes + memory_cost(pkt) > lim.maxMemoryBytes)
+    {
+        // storage of the oldest msg is usually shared with other sessions and stays, so dropping
+        // msgs until the new one fits would empty the session
+        if (lim.spillThreshold)
+            bSpill = true;
+        else if (lim.policy == drop_policy::DROP_NEWEST || m_msgs.empty())
+            return drop_new();
+        else
+        {
+            drop_oldest();
+            break;
+        }
+    }
+
+    if (bSpill)
+        return spill(pkt, qos) || drop_new();
+
+    s.add_ref(pkt.storage);
+    s.msgs++;
+    m_nMemoryBytes += len;
+
+    mqtt_header header = pkt.header;
+    header.bits.qos = qos;
+    m_msgs.push_back({pkt.storage, header.byte});
+    update_capacity();
+    return true;
+}
+
+std::optional<mqtt_publish> offline_queue::pop_front()
+{
+    if (!m_msgs.empty())
+    {
+        auto msg = pop_memory();
+        return unpack(msg.header, std::move(msg.storage));
+    }
+
+    auto& s = get_state();
+    while (!m_spilled.empty())
+    {
+        auto msg = m_spilled.front();
+        tps::net::buffer body;
+        bool bRead = s.log.read(msg.segment, msg.offset, msg.len, body);
+        pop_spilled();
+
+        if (auto pkt = bRead ? unpack(msg.header, tps::net::make_shared_buffer(std::move(body))) : std::nullopt)
+            return pkt;
+
+        LOG_ERROR("Spilled msg can't be read, it's dropped");
+        s.dropped++;
+    }
+    return std::nullopt;
+}
+
+std::optional<mqtt_publish> offline_queue::unpack(uint8_t header, std::shared_ptr<const tps::net::buffer> storage)
+{
+    auto& b = *storage;
+    if (b.size() < sizeof(uint16_t) || sizeof(uint16_t) + (b[0] << 8 | b[1]) > b.size())
+        return std::nullopt;
+    size_t topicLen = size_t(b[0] << 8 | b[1]);
+
+    mqtt_publish pkt(header);
+    auto p = reinterpret_cast<const char*>(b.data()) + sizeof(uint16_t);
+    pkt.topic = std::string_view(p, topicLen);
+    pkt.payload = std::string_view(p + topicLen, b.size() - sizeof(uint16_t) - topicLen);
+    pkt.storage = std::move(storage);
+    return pkt;
+}
+
+void offline_queue::clear()
+{
+    while (!m_msgs.empty())
+        pop_memory();
+    while (!m_spilled.empty())
+        pop_spilled();
+}
+
+bool offline_queue::drop_new()
+{
+    get_state().dropped++;
+    return false;
+}
+
+void offline_queue::drop_oldest()
+{
+    if (!m_msgs.empty())
+        pop_memory();
+    else
+        pop_spilled();
+    get_state().dropped++;
+}
+
+bool offline_queue::spill(const mqtt_publish& pkt, uint8_t qos)
+{
+    auto& s = get_state();
+    spilled_msg msg{0, 0, uint32_t(pkt.storage->size()), 0};
+    if (!s.log.write(pkt.storage, s.lim.spillDir, msg.segment, msg.offset))
+        return false;
+
+    mqtt_header header = pkt.header;
+    header.bits.qos = qos;
+    msg.header = header.byte;
+    m_spilled.push_back(msg);
+    update_capacity();
+
+    size_t len = msg_bytes(pkt);
+    s.msgs++;
+    s.spilledMsgs++;
+    s.spilledBytes += len;
+    m_nSpilledBytes += len;
+    return true;
+}
+
+offline_queue::saved_msg offline_queue::pop_memory()
+{
+    auto& s = get_state();
+    auto msg = std::move(m_msgs.front());
+    m_msgs.pop_front();
+    update_capacity();
+
+    s.release_ref(msg.storage);
+    s.msgs--;
+    m_nMemoryBytes -= msg.storage->size() - sizeof(uint16_t);
+    return msg;
+}
+
+void offline_queue::pop_spilled()
+{
+    auto& s = get_state();
+    auto& msg = m_spilled.front();
+    size_t len = msg.len - sizeof(uint16_t);
+
+    s.log.release(msg.segment);
+    s.msgs--;
+    s.spilledMsgs--;
+    s.spilledBytes -= len;
+    m_nSpilledBytes -= len;
+    m_spilled.pop_front();
+    update_capacity();
+}
+
+void offline_queue::update_capacity()
+{
+    size_t bytes = m_msgs.items.capacity() * sizeof(saved_msg) + m_spilled.items.capacity() * sizeof(spilled_msg);
+    auto& s = get_state();
+    s.memoryBytes = s.memoryBytes - m_nCapacityBytes + bytes;
+    m_nCapacityBytes = bytes;
+}
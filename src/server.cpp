@@ -8,9 +8,18 @@ bool server::on_client_connect(pConnection)
 void server::on_client_disconnect(pConnection client)
 {
     tps::net::message<mqtt_header> msg;
-    msg.hdr.byte.bits.type = uint8_t(packet_type::ERROR);
+    msg.event = tps::net::msg_event::CLOSED;
 
-    m_qMessagesIn.push_back(tps::net::owned_message<mqtt_header>({std::move(client), std::move(msg)}));
+    push_incoming(tps::net::owned_message<mqtt_header>({std::move(client), std::move(msg)}));
+}
+
+void server::on_client_drained(pConnection client)
+{
+    // saved msgs are sent by the dispatcher, which handles every packet before delivery
+    tps::net::message<mqtt_header> msg;
+    msg.event = tps::net::msg_event::DRAINED;
+
+    push_incoming(tps::net::owned_message<mqtt_header>({std::move(client), std::move(msg)}));
 }
 
 bool server::on_first_message(pConnection netClient, tps::net::message<mqtt_header>& msg)
@@ -32,17 +41,45 @@ bool server::on_first_message(pConnection netClient, tps::net::message<mqtt_head
     return false;
 }
 
+bool server::can_stream(const tps::net::message_header<mqtt_header>& hdr)
+{
+    return packet_type(hdr.byte.bits.type) == packet_type::PUBLISH;
+}
+
 void server::on_message(pConnection netClient, tps::net::message<mqtt_header>& msg)
 {
-    auto newPkt = mqtt_packet::create(msg);
-    if (!newPkt)
+    if (msg.part != tps::net::stream_part::NONE)
+    {
+        if (auto res = m_core.find_client(netClient))
+            handle_publish_part(res.value().get(), msg);
+        return;
+    }
+
+    if (msg.event != tps::net::msg_event::NONE)
+    {
+        if (auto res = m_core.find_client(netClient))
+            handle_event(res.value().get(), msg.event);
+        return;
+    }
+
+    mqtt_any pkt;
+    if (auto err = mqtt_parse(msg, pkt); err != parse_error::NONE)
+    {
+        // malformed packet closes the connection [MQTT-1.5.3-1], [MQTT-4.8.0-1]
+        LOG_DEBUG("[" << netClient->get_ID() << "] Malformed packet: " << to_string(err));
+        if (auto res = m_core.find_client(netClient))
+            disconnect(res.value().get(), DISCONNECT | PUBLISH_WILL);
+        else
+            netClient->disconnect();
         return;
+    }
 
-    auto type = packet_type(newPkt->header.bits.type);
+    auto type = packet_type(msg.hdr.byte.bits.type);
     if (type == packet_type::CONNECT)
     {
-        std::cout << "\n\t{CONNECT}\n" << dynamic_cast<mqtt_connect&>(*newPkt);
-        handle_connect(netClient, dynamic_cast<mqtt_connect&>(*newPkt));
+        auto& connect = std::get<mqtt_connect>(pkt);
+        LOG_CLIENT_TRACE(connect.payload.clientID, "\n\t{CONNECT}\n" << connect);
+        handle_connect(netClient, connect);
         return;
     }
 
@@ -50,56 +87,95 @@ void server::on_message(pConnection netClient, tps::net::message<mqtt_header>& m
     if (!res)
         return;
     auto& client = res.value().get();
-    std::cout << client->clientID << ":";
+
+    // deliver msgs stored while client was congested
+    if (!client->session.savedMsgs.empty() && type != packet_type::DISCONNECT && !netClient->is_congested())
+        send_saved_msgs(*client);
 
     switch (type)
     {
         case packet_type::SUBSCRIBE:
-            std::cout << "\n\t{SUBSCRIBE}\n" << dynamic_cast<mqtt_subscribe&>(*newPkt);
-            handle_subscribe(client, dynamic_cast<mqtt_subscribe&>(*newPkt));
+        {
+            auto& subscribe = std::get<mqtt_subscribe>(pkt);
+            LOG_CLIENT_TRACE(client->clientID, client->clientID << ":\n\t{SUBSCRIBE}\n" << subscribe);
+            handle_subscribe(client, subscribe);
             break;
+        }
         case packet_type::UNSUBSCRIBE:
-            std::cout << "\n\t{UNSUB}\n" << dynamic_cast<mqtt_unsubscribe&>(*newPkt);
-            handle_unsubscribe(client,  dynamic_cast<mqtt_unsubscribe&>(*newPkt));
+        {
+            auto& unsubscribe = std::get<mqtt_unsubscribe>(pkt);
+            LOG_CLIENT_TRACE(client->clientID, client->clientID << ":\n\t{UNSUB}\n" << unsubscribe);
+            handle_unsubscribe(client, unsubscribe);
             break;
+        }
         case packet_type::PUBLISH:
-            std::cout << "\n\t{PUBLISH}\n" << dynamic_cast<mqtt_publish&>(*newPkt);
-            handle_publish(client,  dynamic_cast<mqtt_publish&>(*newPkt));
+        {
+            auto& publish = std::get<mqtt_publish>(pkt);
+            LOG_CLIENT_TRACE(client->clientID, client->clientID << ":\n\t{PUBLISH}\n" << publish);
+            // QoS 0 msg is forwarded to subscribers as it was received, only fixed header is rebuilt
+            publish.adopt(std::move(msg.body));
+            handle_publish(client, publish);
             break;
+        }
         case packet_type::PUBACK:
-            std::cout << "\n\t{PUBACK}\n" << dynamic_cast<mqtt_puback&>(*newPkt);
-            handle_puback(client,  dynamic_cast<mqtt_puback&>(*newPkt));
+        {
+            auto& puback = std::get<mqtt_puback>(pkt);
+            LOG_CLIENT_TRACE(client->clientID, client->clientID << ":\n\t{PUBACK}\n" << puback);
+            handle_puback(client, puback);
             break;
+        }
         case packet_type::PUBREC:
-            std::cout << "\n\t{PUBREC}\n" << dynamic_cast<mqtt_pubrec&>(*newPkt);
-            handle_pubrec(client,  dynamic_cast<mqtt_pubrec&>(*newPkt));
+        {
+            auto& pubrec = std::get<mqtt_pubrec>(pkt);
+            LOG_CLIENT_TRACE(client->clientID, client->clientID << ":\n\t{PUBREC}\n" << pubrec);
+            handle_pubrec(client, pubrec);
             break;
+        }
         case packet_type::PUBREL:
-            std::cout << "\n\t{PUBREL}\n" << dynamic_cast<mqtt_pubrel&>(*newPkt);
-            handle_pubrel(client,  dynamic_cast<mqtt_pubrel&>(*newPkt));
+        {
+            auto& pubrel = std::get<mqtt_pubrel>(pkt);
+            LOG_CLIENT_TRACE(client->clientID, client->clientID << ":\n\t{PUBREL}\n" << pubrel);
+            handle_pubrel(client, pubrel);
             break;
+        }
         case packet_type::PUBCOMP:
-            std::cout << "\n\t{PUBCOMP}\n" << dynamic_cast<mqtt_pubcomp&>(*newPkt);
-            handle_pubcomp(client,  dynamic_cast<mqtt_pubcomp&>(*newPkt));
+        {
+            auto& pubcomp = std::get<mqtt_pubcomp>(pkt);
+            LOG_CLIENT_TRACE(client->clientID, client->clientID << ":\n\t{PUBCOMP}\n" << pubcomp);
+            handle_pubcomp(client, pubcomp);
             break;
+        }
         case packet_type::PINGREQ:
-            std::cout << "\n\t{PINGREQ}\n" << dynamic_cast<mqtt_pingreq&>(*newPkt);
+            LOG_CLIENT_TRACE(client->clientID, client->clientID << ":\n\t{PINGREQ}\n" << std::get<mqtt_pingreq>(pkt));
             handle_pingreq(client);
             break;
         case packet_type::DISCONNECT:
-            std::cout << "\n\t{DISCONNECT}\n" << dynamic_cast<mqtt_disconnect&>(*newPkt);
+            LOG_CLIENT_TRACE(client->clientID, client->clientID << ":\n\t{DISCONNECT}\n" << std::get<mqtt_disconnect>(pkt));
             disconnect(client, DISCONNECT);
             break;
-        case packet_type::ERROR:
-            std::cout << "\n\t{ERROR}\n" << dynamic_cast<mqtt_disconnect&>(*newPkt);
-            disconnect(client, PUBLISH_WILL);
-            break;
         case packet_type::CONNACK:
         case packet_type::SUBACK:
         case packet_type::UNSUBACK:
         case packet_type::PINGRESP:
         default:
-            std::cout << "\n\t{UNEXPECTED TYPE}: "<< uint8_t(type) << "\n";
+            LOG_WARN(client->clientID << ": unexpected packet type: " << int(type));
+            break;
+    }
+}
+
+void server::handle_event(pClient& client, tps::net::msg_event event)
+{
+    switch (event)
+    {
+        case tps::net::msg_event::CLOSED:
+            LOG_CLIENT_TRACE(client->clientID, client->clientID << ":\n\t{CONNECTION CLOSED}\n");
+            disconnect(client, PUBLISH_WILL);
+            break;
+        case tps::net::msg_event::DRAINED:
+            if (!client->session.savedMsgs.empty() && !client->netClient->is_congested())
+                send_saved_msgs(*client);
+            break;
+        case tps::net::msg_event::NONE:
             break;
     }
 }
@@ -109,6 +185,7 @@ void server::handle_connect(pConnection& netClient, mqtt_connect& pkt)
     // points either to an already existing record with same client ID or
     // to a newly created client
     pClient client;
+    std::string clientID(pkt.payload.clientID);
 
     mqtt_connack connack;
     connack.sp.byte = 0;
@@ -119,20 +196,20 @@ void server::handle_connect(pConnection& netClient, mqtt_connect& pkt)
         connack.rc = 1; // [MQTT-3.1.2-2]
         goto reply;
     }
-    if (!pkt.vhdr.bits.cleanSession && !pkt.payload.clientID.size())
+    if (!pkt.vhdr.bits.cleanSession && !clientID.size())
     {
         connack.rc = 2; // [MQTT-3.1.3-8]
         goto reply;
     }
 
     // check if client with same client ID already exists
-    if (auto res = m_core.find_client(pkt.payload.clientID))
+    if (auto res = m_core.find_client(clientID))
     {
         auto& existingClient = res.value().get();
 
         // deletion of the client
         // second CONNECT packet came from the same client(address) - violation [MQTT-3.1.0-2]
-        if (existingClient->netClient.get() == netClient)
+        if (existingClient->netClient == netClient)
         {
             disconnect(existingClient, DISCONNECT | PUBLISH_WILL);
             return; // no CONNACK reply [MQTT-3.1.4-1]
@@ -154,8 +231,9 @@ void server::handle_connect(pConnection& netClient, mqtt_connect& pkt)
         {
             // restore session
 
-            std::cout <<"==========RESTORE=============\n";
             client = m_core.restore_client(existingClient, netClient);
+            LOG_DEBUG("[" << clientID << "] Session restored, " << client->session.savedMsgs.size() << " msgs saved, "
+                      << client->session.savedMsgs.spilled_bytes() << " bytes of them spilled");
             connack.sp.byte = 1;
         }
         else
@@ -163,11 +241,11 @@ void server::handle_connect(pConnection& netClient, mqtt_connect& pkt)
             // delete stored session
             disconnect(existingClient, NONE, core_t::FULL_DELETION);
 
-            client = m_core.add_new_client(std::move(pkt.payload.clientID), netClient);
+            client = m_core.add_new_client(std::move(clientID), netClient);
         }
     }
     else
-        client = m_core.add_new_client(std::move(pkt.payload.clientID), netClient);
+        client = m_core.add_new_client(std::move(clientID), netClient);
 
     client->active = true;
 
@@ -178,15 +256,15 @@ void server::handle_connect(pConnection& netClient, mqtt_connect& pkt)
         mqtt_publish willMsg;
         willMsg.header.bits.qos = pkt.vhdr.bits.willQoS;
         willMsg.header.bits.retain = pkt.vhdr.bits.willRetain;
-        willMsg.topic = std::move(pkt.payload.willTopic);
-        willMsg.topiclen = uint16_t(willMsg.topic.size());
-        willMsg.payload = std::move(pkt.payload.willMessage);
+        willMsg.topic = pkt.payload.willTopic;
+        willMsg.payload = pkt.payload.willMessage;
+        willMsg.make_owned();
         client->will = std::move(willMsg);
     }
     if (pkt.vhdr.bits.username)
-        client->username = std::move(pkt.payload.username);
+        client->username = std::string(pkt.payload.username);
     if (pkt.vhdr.bits.password)
-        client->password = std::move(pkt.payload.password);
+        client->password = std::string(pkt.payload.password);
     client->keepalive = pkt.payload.keepalive;
 
 reply:
@@ -202,57 +280,136 @@ reply:
         return;
     }
 
-    // if client restores session send all saved msgs
+    // if client restores session resend unacknowledged msgs, then send all saved msgs
     if (connack.sp.byte)
     {
-        for (auto& pkt : client->session.savedMsgs)
-        {
-            auto expectedAckType = (pkt.header.bits.qos == AT_LEAST_ONCE) ?
-                                    packet_type::PUBACK : packet_type::PUBREC;
-            pkt.pktID = client->session.pool.generate_key(expectedAckType);
+        resend_inflight(*client);
+        send_saved_msgs(*client);
+    }
+}
+
+bool server::has_window(const client_t& client) const
+{
+    // pool is shared with IDs of inbound QoS 2 msgs, so it can run out before the window does
+    return client.session.inflight.size() < m_nMaxInflight && !client.session.pool.full();
+}
 
-            tps::net::message<mqtt_header> msg;
-            pkt.pack(msg);
-            client->netClient.get()->send(std::move(msg));
+void server::send_saved_msgs(client_t& client)
+{
+    auto& savedMsgs = client.session.savedMsgs;
+    // rest of the msgs wait until acks free the window
+    while (!savedMsgs.empty() && has_window(client))
+    {
+        auto pkt = savedMsgs.pop_front();
+        if (!pkt)
+            break;
+        send_publish(client, *pkt);
+    }
+}
+
+void server::send_publish(client_t& client, mqtt_publish& pkt)
+{
+    auto qos = pkt.header.bits.qos;
+    if (qos > AT_MOST_ONCE)
+    {
+        auto expectedAckType = (qos == AT_LEAST_ONCE) ? packet_type::PUBACK : packet_type::PUBREC;
+        pkt.pktID = client.session.pool.generate_key(expectedAckType);
+    }
+
+    tps::net::message<mqtt_header> msg;
+    pkt.pack(msg, pkt.storage);
+    msg.bDroppable = (qos == AT_MOST_ONCE);
+    client.netClient->send(std::move(msg));
+
+    // kept until it's acknowledged, shares the storage
+    if (qos > AT_MOST_ONCE)
+        client.session.inflight.push_back(pkt);
+}
+
+void server::save_msg(client_t& client, const mqtt_publish& pkt, uint8_t qos)
+{
+    if (!client.session.savedMsgs.push(pkt, qos))
+        LOG_DEBUG("[" << client.clientID << "] Offline queue is full, msg on " << pkt.topic << " dropped");
+}
+
+void server::resend_inflight(client_t& client)
+{
+    auto& inflight = client.session.inflight;
+    for (auto it = inflight.begin(); it != inflight.end();)
+    {
+        auto& pkt = *it;
+        tps::net::message<mqtt_header> msg;
+        if (client.session.pool.find(pkt.pktID) == packet_type::PUBCOMP)
+        {
+            // PUBREC was received, only PUBREL is resent
+            mqtt_pubrel pubrel(PUBREL_BYTE);
+            pubrel.pktID = pkt.pktID;
+            pubrel.pack(msg);
+        }
+        else if (pkt.storage)
+        {
+            pkt.header.bits.dup = 1; // [MQTT-3.3.1-1]
+            pkt.pack(msg, pkt.storage);
+        }
+        else
+        {
+            // streamed msg that is still being received, it's sent once it's complete
+            ++it;
+            continue;
         }
-        client->session.savedMsgs.clear();
+
+        client.netClient->send(std::move(msg));
+        ++it;
     }
 }
 
+std::deque<mqtt_publish>::iterator server::find_inflight(client_t& client, uint16_t pktID)
+{
+    // acks mostly come in the order msgs were sent
+    auto& inflight = client.session.inflight;
+    return std::find_if(inflight.begin(), inflight.end(),
+                        [pktID](const mqtt_publish& pkt) { return pkt.pktID == pktID; });
+}
+
+void server::release_inflight(client_t& client, uint16_t pktID)
+{
+    client.session.pool.unregister_key(pktID);
+
+    auto it = find_inflight(client, pktID);
+    if (it != client.session.inflight.end())
+        client.session.inflight.erase(it);
+
+    // msgs could be waiting for the window
+    if (!client.session.savedMsgs.empty() && !client.netClient->is_congested())
+        send_saved_msgs(client);
+}
+
 void server::handle_subscribe(pClient& client, mqtt_subscribe& pkt)
 {
     mqtt_suback suback;
 
-    std::vector<tps::net::message<mqtt_header>> retainedMsgs;
+    std::vector<mqtt_publish> retainedMsgs;
     auto save_retained_msg = [&retainedMsgs](topic_t& topic, uint8_t qos)
     {
-        tps::net::message<mqtt_header> pubmsg;
-        topic.retain->header.bits.qos = std::min(qos, topic.retain->header.bits.qos);
-        topic.retain->pack(pubmsg);
-        retainedMsgs.emplace_back(std::move(pubmsg));
+        mqtt_publish& retain = retainedMsgs.emplace_back(*topic.retain);
+        retain.header.bits.qos = std::min(qos, retain.header.bits.qos);
     };
 
-    for (auto& [topiclen, topicfilter, qos]: pkt.tuples)
+    for (auto& [topicfilter, qos]: pkt.tuples)
     {
+        m_core.subscribe(*client, topicfilter, qos);
+
         // if topic filter cotains wildcards
-        if (topicfilter[0] == '+' || topicfilter[topiclen-1] == '#'
-                || topicfilter.find("/+") != std::string::npos)
+        if (topicfilter.find_first_of("+#") != std::string_view::npos)
         {
             auto matches = m_core.get_matching_topics(topicfilter);
             for (auto& topic: matches)
-            {
-                m_core.subscribe(*client, *topic, qos);
                 if (topic->retain)
                     save_retained_msg(*topic, qos);
-            }
-        }
-        else
-        {
-            auto topic = m_core.find_topic(topicfilter, true);
-            m_core.subscribe(*client, topic->get(), qos);
-            if (topic->get().retain)
-                save_retained_msg(topic->get(), qos);
         }
+        else if (auto topic = m_core.find_topic(topicfilter); topic && topic->get().retain)
+            save_retained_msg(topic->get(), qos);
+
         suback.rcs.push_back(qos);
     }
 
@@ -260,45 +417,40 @@ void server::handle_subscribe(pClient& client, mqtt_subscribe& pkt)
     tps::net::message<mqtt_header> reply;
     suback.pktID = pkt.pktID;
     suback.pack(reply);
-    client->netClient.get()->send(std::move(reply));
+    client->netClient->send(std::move(reply));
 
-    // send retained msgs [MQTT-3.3.1-6]
-    for (auto& msg: retainedMsgs)
-        client->netClient.get()->send(std::move(msg));
+    // send retained msgs [MQTT-3.3.1-6], QoS 1 and 2 ones get a pkt ID of this client
+    // and take the in-flight window like any other msg
+    bool bOnline = !client->netClient->is_congested();
+    for (auto& retain: retainedMsgs)
+    {
+        auto qos = retain.header.bits.qos;
+        if (bOnline && (qos == AT_MOST_ONCE || (client->session.savedMsgs.empty() && has_window(*client))))
+            send_publish(*client, retain);
+        else if (qos > AT_MOST_ONCE)
+            save_msg(*client, retain, qos);
+    }
 }
 
 void server::handle_unsubscribe(pClient& client, mqtt_unsubscribe& pkt)
 {
-    for (auto& [topiclen, topicfilter]: pkt.tuples)
-    {
-        // if topic filter cotains wildcards
-        if (topicfilter[0] == '+' || topicfilter[topiclen-1] == '#'
-                || topicfilter.find("/+") != std::string::npos)
-        {
-            auto matches = m_core.get_matching_topics(topicfilter);
-            for (auto& topic: matches)
-                m_core.unsubscribe(*client, *topic);
-        }
-        else
-        {
-            if (auto topic = m_core.find_topic(topicfilter))
-                m_core.unsubscribe(*client, topic->get());
-        }
-    }
+    // filters are compared character by character, without wildcard matching [MQTT-3.10.4-1]
+    for (auto& topicfilter: pkt.topics)
+        m_core.unsubscribe(*client, topicfilter);
 
     // send UNSUBACK response
     mqtt_unsuback unsuback(UNSUBACK_BYTE);
     tps::net::message<mqtt_header> reply;
     unsuback.pktID = pkt.pktID;
     unsuback.pack(reply);
-    client->netClient.get()->send(std::move(reply));
+    client->netClient->send(std::move(reply));
 }
 
 void server::publish_msg(mqtt_publish& pkt)
 {
-    auto topic = m_core.find_topic(pkt.topic);
-    if (!topic)
-        return;
+    // topic and payload are encoded once and shared by all subscribers, retained msg and
+    // msgs saved for inactive subscribers, only fixed header and pkt ID are packed per subscriber
+    pkt.make_owned();
 
     // if retain flag set
     if (pkt.header.bits.retain)
@@ -309,11 +461,11 @@ void server::publish_msg(mqtt_publish& pkt)
             mqtt_publish retain = pkt;
             retain.header.bits.dup = 0;
 
-            topic->get().retain = std::move(retain);
+            m_core.find_topic(pkt.topic, true)->get().retain = std::move(retain);
         }
         else
-            // if payload.size() == 0 delete existing retained msg
-            topic->get().retain.reset();
+            // if payload.size() == 0 delete existing retained msg, topic isn't needed anymore
+            m_core.delete_topic(pkt.topic);
 
         pkt.header.bits.retain = 0; // [MQTT-3.3.1-9]
     }
@@ -323,90 +475,288 @@ void server::publish_msg(mqtt_publish& pkt)
     auto originalPktID = pkt.pktID;
     auto originalQoS = pkt.header.bits.qos;
 
-    // prepare version with qos == 0 beforehand, since it doesn't need pkt ID
-    tps::net::message<mqtt_header> pubmsgQoS0;
-    pkt.header.bits.qos = AT_MOST_ONCE;
-    pkt.pack(pubmsgQoS0);
-
-    pkt.header.bits.qos = originalQoS;
-
     // send published msg to subscribers
-    for (auto& sub: topic->get().subscribers)
+    for (auto [handle, maxQoS]: m_core.get_subscribers(pkt.topic))
     {
-        auto& subClient = sub.second.first;
+        auto& subClient = *m_core.get_client(handle);
 
         // determine QoS level based on published msg QoS and client's
         // max QoS level specified in SUBSCRIBE packet [MQTT-3.8.4-6]
-        auto qos = std::min(sub.second.second, pkt.header.bits.qos);
+        auto qos = std::min(maxQoS, originalQoS);
 
-        if (subClient.active)
-        {
-            tps::net::message<mqtt_header> temp;
-            if (qos == AT_MOST_ONCE)
-                temp = pubmsgQoS0;
-            else
-            {
-                auto expectedAckType = (qos == AT_LEAST_ONCE) ?
-                                        packet_type::PUBACK : packet_type::PUBREC;
-                // assign pkt ID
-                pkt.pktID = subClient.session.pool.generate_key(expectedAckType);
+        // congested client is treated as an inactive one until it's outbound queue drains
+        bool bOnline = subClient.active && !subClient.netClient->is_congested();
+        // msgs that were stored while client was congested go first
+        if (bOnline && !subClient.session.savedMsgs.empty())
+            send_saved_msgs(subClient);
 
-                pkt.pack(temp);
-
-                temp.hdr.byte.bits.qos = qos;
-            }
-            subClient.netClient.get()->send(std::move(temp));
+        // QoS 1 and 2 msgs above the in-flight window wait in the session until acks free it
+        if (bOnline && (qos == AT_MOST_ONCE || (subClient.session.savedMsgs.empty() && has_window(subClient))))
+        {
+            pkt.header.bits.qos = qos;
+            send_publish(subClient, pkt);
         }
         else
         {
             // save msgs until session is restored
             if (qos > AT_MOST_ONCE)
-            {
-                subClient.session.savedMsgs.push_back(pkt);
-                subClient.session.savedMsgs.back().header.bits.qos = qos;
-            }
+                save_msg(subClient, pkt, qos);
         }
     }
+    pkt.header.bits.qos = originalQoS;
     pkt.pktID = originalPktID;
 }
 
 void server::handle_publish(pClient& client, mqtt_publish& pkt)
 {
-    mqtt_ack ack(PUBACK_BYTE);
+    if (!register_qos2(client, pkt))
+        publish_msg(pkt);
+
+    send_publish_ack(client, pkt);
+}
+
+bool server::register_qos2(pClient& client, const mqtt_publish& pkt)
+{
+    if (pkt.header.bits.qos != EXACTLY_ONCE)
+        return false;
 
     // if it's an attempt to resend qos2 msg that has already been
     // received (publisher didn't get pubrec reply for some reason) [MQTT-4.3.3-2]
-    bool bQoS2Resend = false;
-    if (pkt.header.bits.qos == EXACTLY_ONCE)
+    auto pubrel = client->session.pool.find(pkt.pktID);
+    bool bQoS2Resend = pubrel == packet_type::PUBREL;
+
+    // QOS == 2 send PUBREC, recv PUBREL, send PUBCOMP
+    client->session.pool.register_key(pkt.pktID, packet_type::PUBREL);
+    return bQoS2Resend;
+}
+
+void server::send_publish_ack(pClient& client, const mqtt_publish& pkt)
+{
+    if (pkt.header.bits.qos == AT_MOST_ONCE)
+        return;
+
+    // send reply to publisher if QOS == 1 or 2
+    mqtt_ack ack(pkt.header.bits.qos == AT_LEAST_ONCE ? PUBACK_BYTE : PUBREC_BYTE);
+    tps::net::message<mqtt_header> reply;
+    ack.pktID = pkt.pktID;
+    ack.pack(reply);
+    client->netClient->send(std::move(reply));
+}
+
+void server::handle_publish_part(pClient& client, tps::net::message<mqtt_header>& msg)
+{
+    if (msg.part == tps::net::stream_part::FIRST)
+    {
+        start_stream(client, msg);
+        return;
+    }
+
+    // stream was rejected
+    if (!client->stream || client->stream->id == 0)
+        return;
+    auto& stream = *client->stream;
+
+    if (!stream.bDiscard)
+    {
+        // part is sent as it is, right after the previous one
+        auto part = hold_part(client->netClient, std::move(msg.body));
+        for (auto& receiver: stream.receivers)
+        {
+            tps::net::message<mqtt_header> temp;
+            temp.writeHdrSize = 0;
+            temp.shared = part;
+            temp.part = msg.part;
+            temp.streamID = stream.id;
+            receiver->send(std::move(temp));
+        }
+
+        if (stream.collected)
+            stream.collected->insert(stream.collected->end(), part->begin(), part->end());
+    }
+
+    if (msg.part == tps::net::stream_part::LAST)
+        finish_stream(client);
+}
+
+void server::start_stream(pClient& client, tps::net::message<mqtt_header>& msg)
+{
+    // previous stream of a client can't be left unfinished, since parts come over one connection
+    client->stream.emplace();
+    auto& stream = *client->stream;
+
+    mqtt_publish pkt(msg.hdr.byte.byte);
+    if (auto err = pkt.unpack(msg); err != parse_error::NONE)
+    {
+        LOG_DEBUG("[" << client->clientID << "] Malformed packet: " << to_string(err));
+        stream.id = 0;
+        return;
+    }
+    LOG_CLIENT_TRACE(client->clientID, client->clientID << ":\n\t{PUBLISH STREAM " << msg.hdr.size << " bytes}");
+
+    // topic and pkt ID stay valid since moving the body doesn't move it's data
+    uint32_t payloadOffset = uint32_t(msg.body.size() - pkt.payload.size());
+    stream.id = ++m_nStreamIDCounter;
+    stream.payloadLen = msg.hdr.size - payloadOffset;
+    stream.head = hold_part(client->netClient, std::move(msg.body));
+    stream.pkt = pkt;
+    stream.bDiscard = register_qos2(client, pkt);
+    if (stream.bDiscard)
+        return;
+
+    pkt.header.bits.retain = 0; // [MQTT-3.3.1-9]
+    pkt.header.bits.dup = 0;    // [MQTT-3.3.1-3]
+    auto originalQoS = pkt.header.bits.qos;
+
+    for (auto [handle, maxQoS]: m_core.get_subscribers(pkt.topic))
+    {
+        auto& subClient = *m_core.get_client(handle);
+        auto qos = std::min(maxQoS, originalQoS);
+
+        bool bOnline = subClient.active && !subClient.netClient->is_congested();
+        if (bOnline && !subClient.session.savedMsgs.empty())
+            send_saved_msgs(subClient);
+
+        if (bOnline && (qos == AT_MOST_ONCE || (subClient.session.savedMsgs.empty() && has_window(subClient))))
+        {
+            pkt.header.bits.qos = qos;
+            if (qos > AT_MOST_ONCE)
+            {
+                auto expectedAckType = (qos == AT_LEAST_ONCE) ?
+                                        packet_type::PUBACK : packet_type::PUBREC;
+                pkt.pktID = subClient.session.pool.generate_key(expectedAckType);
+            }
+
+            tps::net::message<mqtt_header> temp;
+            pkt.pack_head(temp, stream.head, payloadOffset, stream.payloadLen);
+            temp.bDroppable = (qos == AT_MOST_ONCE);
+            temp.part = tps::net::stream_part::FIRST;
+            temp.streamID = stream.id;
+            subClient.netClient->send(std::move(temp));
+            stream.receivers.push_back(subClient.netClient);
+
+            // msg takes it's place in the window now, it's added whole once it's collected
+            if (qos > AT_MOST_ONCE)
+            {
+                mqtt_publish part(pkt.header.byte);
+                part.pktID = pkt.pktID;
+                subClient.session.inflight.push_back(std::move(part));
+                stream.inflight.push_back({handle, pkt.pktID, subClient.netClient});
+            }
+        }
+        else if (qos > AT_MOST_ONCE)
+            stream.offline.emplace_back(handle, qos);
+    }
+
+    // retained msg and msgs saved in sessions need the whole packet, it's collected in the storage layout
+    if (stream.pkt.header.bits.retain || stream.inflight.size() || stream.offline.size())
     {
-        auto pubrel = client->session.pool.find(pkt.pktID);
-        if (pubrel && pubrel.value().get() == packet_type::PUBREL)
+        stream.collected.emplace();
+        stream.collected->reserve(sizeof(uint16_t) + pkt.topic.size() + stream.payloadLen);
+        stream.collected->insert(stream.collected->end(), stream.head->begin(),
+                                 stream.head->begin() + sizeof(uint16_t) + pkt.topic.size());
+        stream.collected->insert(stream.collected->end(), stream.head->begin() + payloadOffset, stream.head->end());
+    }
+}
+
+std::shared_ptr<const tps::net::buffer> server::hold_part(const pConnection& publisher, tps::net::buffer&& body)
+{
+    // publisher gets the credit back only when all receivers have written the part, so the stream goes
+    // at the pace of the slowest receiver and no more than maxStreamPartsPending parts are kept in memory.
+    // Receivers can't wait for each other: parts come from the single dispatcher thread, so every receiver
+    // gets first parts of the streams in the same order and opens them in that order
+    struct held_part
+    {
+        held_part(tps::net::buffer&& part, const pConnection& conn): body(std::move(part)), publisher(conn)
         {
-            // send pubrec again
-            ack.header.byte = PUBREC_BYTE;
-            ack.header.bits.dup = 1;
+            publisher->acquire_inbound_credit();
+        }
+        ~held_part() { publisher->release_inbound_credit(); }
 
-            bQoS2Resend = true;
+        tps::net::buffer body;
+        pConnection publisher;
+    };
+
+    // part, publisher and the control block are kept in a single block from the buffer pool
+    auto held = std::allocate_shared<held_part>(tps::net::pool_allocator<held_part>(), std::move(body), publisher);
+    return std::shared_ptr<const tps::net::buffer>(held, &held->body);
+}
+
+void server::finish_stream(pClient& client)
+{
+    auto stream = std::move(*client->stream);
+    client->stream.reset();
+
+    if (stream.collected)
+    {
+        mqtt_publish pkt(stream.pkt.header.byte);
+        pkt.header.bits.dup = 0;
+        pkt.storage = tps::net::make_shared_buffer(std::move(*stream.collected));
+        auto p = reinterpret_cast<const char*>(pkt.storage->data()) + sizeof(uint16_t);
+        pkt.topic = std::string_view(p, stream.pkt.topic.size());
+        pkt.payload = std::string_view(p + pkt.topic.size(), stream.payloadLen);
+
+        if (pkt.header.bits.retain)
+        {
+            m_core.find_topic(pkt.topic, true)->get().retain = pkt;
+            pkt.header.bits.retain = 0;
         }
 
-        // QOS == 2 send PUBREC, recv PUBREL, send PUBCOMP
-        ack.header.byte = PUBREC_BYTE;
-        client->session.pool.register_key(pkt.pktID, packet_type::PUBREL);
+        // subscribers could have left while the msg was being received
+        for (auto& receiver: stream.inflight)
+            if (auto subClient = m_core.get_client(receiver.handle))
+                complete_inflight(*subClient, receiver, pkt);
+        for (auto [handle, qos]: stream.offline)
+            if (auto subClient = m_core.get_client(handle))
+                save_msg(*subClient, pkt, qos);
     }
 
-    if (!bQoS2Resend)
+    send_publish_ack(client, stream.pkt);
+}
+
+void server::complete_inflight(client_t& client, const publish_stream::inflight_receiver& receiver, const mqtt_publish& pkt)
+{
+    auto it = find_inflight(client, receiver.pktID);
+    if (it == client.session.inflight.end() || it->storage)
+        return;
+
+    // header keeps the QoS of this receiver
+    auto header = it->header;
+    *it = pkt;
+    it->header = header;
+    it->pktID = receiver.pktID;
+
+    // session was resumed while the msg was being received, it couldn't be resent then
+    if (client.active && client.netClient != receiver.netClient)
     {
-        publish_msg(pkt);
+        it->header.bits.dup = 1; // [MQTT-3.3.1-1]
+        tps::net::message<mqtt_header> msg;
+        it->pack(msg, it->storage);
+        client.netClient->send(std::move(msg));
+    }
+}
+
+void server::abort_stream(client_t& client)
+{
+    if (!client.stream)
+        return;
 
-        if (pkt.header.bits.qos == AT_MOST_ONCE)
-            return;
+    for (auto& receiver: client.stream->receivers)
+    {
+        tps::net::message<mqtt_header> temp;
+        temp.part = tps::net::stream_part::ABORT;
+        temp.streamID = client.stream->id;
+        receiver->send(std::move(temp));
     }
 
-    // send reply to publisher if QOS == 1 or 2
-    tps::net::message<mqtt_header> reply;
-    ack.pktID = pkt.pktID;
-    ack.pack(reply);
-    client->netClient.get()->send(std::move(reply));
+    // msg was never complete, publisher didn't get an ack and sends it again
+    for (auto& receiver: client.stream->inflight)
+        if (auto subClient = m_core.get_client(receiver.handle))
+        {
+            auto it = find_inflight(*subClient, receiver.pktID);
+            if (it != subClient->session.inflight.end() && !it->storage)
+                release_inflight(*subClient, receiver.pktID);
+        }
+    client.stream.reset();
 }
 
 void server::disconnect(pClient& client, uint8_t flags, uint8_t manualControl)
@@ -415,11 +765,13 @@ void server::disconnect(pClient& client, uint8_t flags, uint8_t manualControl)
     bool bPubWill = (flags & PUBLISH_WILL) && client->will;
 
     if (flags & DISCONNECT)
-        client->netClient.get()->disconnect();
+        client->netClient->disconnect();
 
     if (bPubWill)
         will = std::move(*client->will);
 
+    abort_stream(*client);
+
     m_core.delete_client(client, manualControl);
 
     if (bPubWill)
@@ -429,8 +781,8 @@ void server::disconnect(pClient& client, uint8_t flags, uint8_t manualControl)
 void server::handle_puback(pClient& client, mqtt_puback& pkt)
 {
     auto val = client->session.pool.find(pkt.pktID);
-    if (val && val.value().get() == packet_type::PUBACK)
-        client->session.pool.unregister_key(pkt.pktID);
+    if (val && *val == packet_type::PUBACK)
+        release_inflight(*client, pkt.pktID);
 }
 
 void server::handle_pubrec(pClient& client, mqtt_pubrec& pkt)
@@ -440,11 +792,19 @@ void server::handle_pubrec(pClient& client, mqtt_pubrec& pkt)
         mqtt_pubrel pubrel(PUBREL_BYTE);
         pubrel.pktID = pkt.pktID;
 
-        auto expectedAckType = val.value().get();
+        auto expectedAckType = *val;
         if (expectedAckType == packet_type::PUBREC)
         {
             client->session.pool.unregister_key(pkt.pktID);
             client->session.pool.register_key(pkt.pktID, packet_type::PUBCOMP);
+
+            // msg has been received, only PUBREL can be resent, slot of the window is kept until PUBCOMP
+            auto it = find_inflight(*client, pkt.pktID);
+            if (it != client->session.inflight.end())
+            {
+                it->storage.reset();
+                it->topic = it->payload = {};
+            }
         }
         else if (expectedAckType == packet_type::PUBCOMP)
             // PUBREL was sent earlier but didn't get to the receiver - resend PUBREL
@@ -452,14 +812,14 @@ void server::handle_pubrec(pClient& client, mqtt_pubrec& pkt)
 
         tps::net::message<mqtt_header> msg;
         pubrel.pack(msg);
-        client->netClient.get()->send(std::move(msg));
+        client->netClient->send(std::move(msg));
     }
 }
 
 void server::handle_pubrel(pClient& client, mqtt_pubrel& pkt)
 {
     auto val = client->session.pool.find(pkt.pktID);
-    if (val && val.value().get() == packet_type::PUBREL)
+    if (val && *val == packet_type::PUBREL)
     {
         // [MQTT-4.3.3-2]
         client->session.pool.unregister_key(pkt.pktID);
@@ -468,15 +828,15 @@ void server::handle_pubrel(pClient& client, mqtt_pubrel& pkt)
         mqtt_pubcomp pubcomp(PUBCOMP_BYTE);
         pubcomp.pktID = pkt.pktID;
         pubcomp.pack(msg);
-        client->netClient.get()->send(std::move(msg));
+        client->netClient->send(std::move(msg));
     }
 }
 
 void server::handle_pubcomp(pClient& client, mqtt_pubcomp& pkt)
 {
     auto val = client->session.pool.find(pkt.pktID);
-    if (val && val.value().get() == packet_type::PUBCOMP)
-        client->session.pool.unregister_key(pkt.pktID);
+    if (val && *val == packet_type::PUBCOMP)
+        release_inflight(*client, pkt.pktID);
 }
 
 void server::handle_pingreq(pClient& client)
@@ -485,6 +845,6 @@ void server::handle_pingreq(pClient& client)
     tps::net::message<mqtt_header> reply;
 
     pingresp.pack(reply);
-    client->netClient.get()->send(std::move(reply));
+    client->netClient->send(std::move(reply));
 }
 
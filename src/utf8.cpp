@@ -0,0 +1,420 @@
+#include "utf8.h"
+#include <cstring>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define UTF8_X86
+#endif
+
+namespace utf8
+{
+
+static inline uint8_t ascii_flags(uint8_t c)
+{
+    if (c == 0)
+        return NUL;
+    if (c == '+' || c == '#')
+        return WILDCARD;
+    return CLEAN;
+}
+
+// byte by byte from 'p', which must be at the start of a character, until 'stop' or the end of the character
+// that crosses it. Returns where the scan stopped, nullptr if a character is malformed
+static const uint8_t* scan_chars(const uint8_t* p, const uint8_t* stop, const uint8_t* end, uint8_t& res)
+{
+    while (p < stop)
+    {
+        uint8_t c = *p;
+        if (c < 0x80)
+        {
+            res |= ascii_flags(c);
+            p++;
+            continue;
+        }
+
+        uint32_t n, cp, min;
+        if ((c & 0xe0) == 0xc0)
+            n = 1, cp = c & 0x1f, min = 0x80;
+        else if ((c & 0xf0) == 0xe0)
+            n = 2, cp = c & 0x0f, min = 0x800;
+        else if ((c & 0xf8) == 0xf0)
+            n = 3, cp = c & 0x07, min = 0x10000;
+        else
+            return nullptr;
+
+        if (size_t(end - p) <= n)
+            return nullptr;
+        for (uint32_t i = 1; i <= n; i++)
+        {
+            if ((p[i] & 0xc0) != 0x80)
+                return nullptr;
+            cp = cp << 6 | (p[i] & 0x3f);
+        }
+
+        // overlong encoding, surrogate or beyond unicode
+        if (cp < min || cp > 0x10ffff || (cp >= 0xd800 && cp <= 0xdfff))
+            return nullptr;
+        p += n+1;
+    }
+    return p;
+}
+
+static uint8_t scan_tail(const uint8_t* p, const uint8_t* end, uint8_t res)
+{
+    return scan_chars(p, end, end, res) ? res : res | MALFORMED;
+}
+
+uint8_t scan_scalar(const uint8_t* p, size_t len)
+{
+    return scan_tail(p, p + len, CLEAN);
+}
+
+bool has_valid_wildcards(std::string_view filter)
+{
+    for (size_t i = 0; i < filter.size(); i++)
+    {
+        bool bLevelStart = (i == 0 || filter[i-1] == '/');
+        if (filter[i] == '+' && (!bLevelStart || (i+1 < filter.size() && filter[i+1] != '/')))
+            return false;
+        if (filter[i] == '#' && (!bLevelStart || i+1 != filter.size()))
+            return false;
+    }
+    return true;
+}
+
+#ifdef UTF8_X86
+
+// 16 bytes at a time, block with multi-byte characters is scanned byte by byte up to the end of the
+// character that crosses it's end, then the vector loop goes on from there. For cpus without SSSE3
+uint8_t scan_sse2(const uint8_t* p, size_t len)
+{
+    const uint8_t* end = p + len;
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i plus = _mm_set1_epi8('+');
+    const __m128i hash = _mm_set1_epi8('#');
+
+    uint8_t res = CLEAN;
+    while (end - p >= 16)
+    {
+        __m128i in = _mm_loadu_si128(reinterpret_cast<const __m128i*>(p));
+        if (_mm_movemask_epi8(in))
+        {
+            p = scan_chars(p, p + 16, end, res);
+            if (!p)
+                return res | MALFORMED;
+            continue;
+        }
+
+        if (_mm_movemask_epi8(_mm_cmpeq_epi8(in, zero)))
+            res |= NUL;
+        if (_mm_movemask_epi8(_mm_or_si128(_mm_cmpeq_epi8(in, plus), _mm_cmpeq_epi8(in, hash))))
+            res |= WILDCARD;
+        p += 16;
+    }
+    return scan_tail(p, end, res);
+}
+
+// SSSE3 and AVX2 scans validate multi-byte characters with vector table lookups as well: every byte
+// is classified by it's high nibble, the low nibble of the previous byte and the high nibble of the
+// previous byte, an error is an AND of the three classes being non-zero (J. Keiser, D. Lemire,
+// "Validating UTF-8 in less than one instruction per byte"). Both use the same 16 byte tables,
+// AVX2 repeats them in each 128-bit lane
+namespace
+{
+    const uint8_t TOO_SHORT  = 1 << 0;  // lead byte or ASCII followed by a lead byte or ASCII
+    const uint8_t TOO_LONG   = 1 << 1;  // ASCII followed by a continuation
+    const uint8_t OVERLONG_3 = 1 << 2;
+    const uint8_t TOO_LARGE  = 1 << 3;
+    const uint8_t SURROGATE  = 1 << 4;
+    const uint8_t OVERLONG_2 = 1 << 5;
+    const uint8_t TOO_LARGE_1000 = 1 << 6;
+    const uint8_t OVERLONG_4 = 1 << 6;
+    const uint8_t TWO_CONTS  = 1 << 7;  // two continuations in a row
+    const uint8_t CARRY = TOO_SHORT | TOO_LONG | TWO_CONTS;
+
+    alignas(16) const uint8_t BYTE1_HIGH[16] =
+    {
+        TOO_LONG, TOO_LONG, TOO_LONG, TOO_LONG, TOO_LONG, TOO_LONG, TOO_LONG, TOO_LONG,
+        TWO_CONTS, TWO_CONTS, TWO_CONTS, TWO_CONTS,
+        TOO_SHORT | OVERLONG_2,
+        TOO_SHORT,
+        TOO_SHORT | OVERLONG_3 | SURROGATE,
+        TOO_SHORT | TOO_LARGE | TOO_LARGE_1000 | OVERLONG_4
+    };
+    alignas(16) const uint8_t BYTE1_LOW[16] =
+    {
+        CARRY | OVERLONG_3 | OVERLONG_2 | OVERLONG_4,
+        CARRY | OVERLONG_2,
+        CARRY,
+        CARRY,
+        CARRY | TOO_LARGE,
+        CARRY | TOO_LARGE | TOO_LARGE_1000,
+        CARRY | TOO_LARGE | TOO_LARGE_1000,
+        CARRY | TOO_LARGE | TOO_LARGE_1000,
+        CARRY | TOO_LARGE | TOO_LARGE_1000,
+        CARRY | TOO_LARGE | TOO_LARGE_1000,
+        CARRY | TOO_LARGE | TOO_LARGE_1000,
+        CARRY | TOO_LARGE | TOO_LARGE_1000,
+        CARRY | TOO_LARGE | TOO_LARGE_1000,
+        CARRY | TOO_LARGE | TOO_LARGE_1000 | SURROGATE,
+        CARRY | TOO_LARGE | TOO_LARGE_1000,
+        CARRY | TOO_LARGE | TOO_LARGE_1000
+    };
+    alignas(16) const uint8_t BYTE2_HIGH[16] =
+    {
+        TOO_SHORT, TOO_SHORT, TOO_SHORT, TOO_SHORT, TOO_SHORT, TOO_SHORT, TOO_SHORT, TOO_SHORT,
+        TOO_LONG | OVERLONG_2 | TWO_CONTS | OVERLONG_3 | TOO_LARGE_1000 | OVERLONG_4,
+        TOO_LONG | OVERLONG_2 | TWO_CONTS | OVERLONG_3 | TOO_LARGE,
+        TOO_LONG | OVERLONG_2 | TWO_CONTS | SURROGATE  | TOO_LARGE,
+        TOO_LONG | OVERLONG_2 | TWO_CONTS | SURROGATE  | TOO_LARGE,
+        TOO_SHORT, TOO_SHORT, TOO_SHORT, TOO_SHORT
+    };
+    // bytes above these in the last three positions of a block start a character the block doesn't
+    // finish, the 16 byte scan uses the second half
+    alignas(32) const uint8_t INCOMPLETE_MAX[32] =
+    {
+        0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+        0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+        0xf0 - 1, 0xe0 - 1, 0xc0 - 1
+    };
+
+    // 16 bytes at a time
+
+    __attribute__((target("ssse3")))
+    inline __m128i load16(const uint8_t* table)
+    {
+        return _mm_load_si128(reinterpret_cast<const __m128i*>(table));
+    }
+
+    __attribute__((target("ssse3")))
+    inline __m128i lookup(__m128i table, __m128i nibbles)
+    {
+        return _mm_shuffle_epi8(table, nibbles);
+    }
+
+    __attribute__((target("ssse3")))
+    inline __m128i high_nibbles(__m128i v)
+    {
+        return _mm_and_si128(_mm_srli_epi16(v, 4), _mm_set1_epi8(0x0f));
+    }
+
+    // bytes of 'in' shifted by N, with the last bytes of 'prev' shifted in
+    template <int N>
+    __attribute__((target("ssse3")))
+    inline __m128i prev(__m128i in, __m128i prev)
+    {
+        return _mm_alignr_epi8(in, prev, 16 - N);
+    }
+
+    __attribute__((target("ssse3")))
+    inline __m128i check_block(__m128i in, __m128i prevIn)
+    {
+        __m128i prev1 = prev<1>(in, prevIn);
+        __m128i special = _mm_and_si128(
+            _mm_and_si128(lookup(load16(BYTE1_HIGH), high_nibbles(prev1)),
+                          lookup(load16(BYTE1_LOW), _mm_and_si128(prev1, _mm_set1_epi8(0x0f)))),
+            lookup(load16(BYTE2_HIGH), high_nibbles(in)));
+
+        // third and fourth bytes of 3 and 4 byte characters must be continuations
+        __m128i isThird  = _mm_subs_epu8(prev<2>(in, prevIn), _mm_set1_epi8(char(0xe0 - 0x80)));
+        __m128i isFourth = _mm_subs_epu8(prev<3>(in, prevIn), _mm_set1_epi8(char(0xf0 - 0x80)));
+        __m128i must23 = _mm_and_si128(_mm_or_si128(isThird, isFourth), _mm_set1_epi8(char(0x80)));
+        return _mm_xor_si128(must23, special);
+    }
+
+    // non-zero if the block ends in the middle of a character
+    __attribute__((target("ssse3")))
+    inline __m128i incomplete(__m128i in)
+    {
+        return _mm_subs_epu8(in, load16(INCOMPLETE_MAX + 16));
+    }
+
+    struct ssse3_state
+    {
+        __m128i error, prevIn, prevIncomplete, nul, wildcard;
+    };
+
+    __attribute__((target("ssse3")))
+    inline void scan_block(ssse3_state& st, __m128i in)
+    {
+        const __m128i zero = _mm_setzero_si128();
+        st.nul = _mm_or_si128(st.nul, _mm_cmpeq_epi8(in, zero));
+        st.wildcard = _mm_or_si128(st.wildcard, _mm_or_si128(_mm_cmpeq_epi8(in, _mm_set1_epi8('+')),
+                                                             _mm_cmpeq_epi8(in, _mm_set1_epi8('#'))));
+
+        // ASCII block is valid unless the previous one ended in the middle of a character
+        if (!_mm_movemask_epi8(in))
+            st.error = _mm_or_si128(st.error, st.prevIncomplete);
+        else
+        {
+            st.error = _mm_or_si128(st.error, check_block(in, st.prevIn));
+            st.prevIncomplete = incomplete(in);
+        }
+        st.prevIn = in;
+    }
+
+    // 32 bytes at a time
+
+    __attribute__((target("avx2")))
+    inline __m256i load32(const uint8_t* table)
+    {
+        return _mm256_broadcastsi128_si256(_mm_load_si128(reinterpret_cast<const __m128i*>(table)));
+    }
+
+    __attribute__((target("avx2")))
+    inline __m256i lookup(__m256i table, __m256i nibbles)
+    {
+        return _mm256_shuffle_epi8(table, nibbles);
+    }
+
+    __attribute__((target("avx2")))
+    inline __m256i high_nibbles(__m256i v)
+    {
+        return _mm256_and_si256(_mm256_srli_epi16(v, 4), _mm256_set1_epi8(0x0f));
+    }
+
+    // bytes of 'in' shifted by N, with the last bytes of 'prev' shifted in
+    template <int N>
+    __attribute__((target("avx2")))
+    inline __m256i prev(__m256i in, __m256i prev)
+    {
+        return _mm256_alignr_epi8(in, _mm256_permute2x128_si256(prev, in, 0x21), 16 - N);
+    }
+
+    __attribute__((target("avx2")))
+    inline __m256i check_block(__m256i in, __m256i prevIn)
+    {
+        __m256i prev1 = prev<1>(in, prevIn);
+        __m256i special = _mm256_and_si256(
+            _mm256_and_si256(lookup(load32(BYTE1_HIGH), high_nibbles(prev1)),
+                             lookup(load32(BYTE1_LOW), _mm256_and_si256(prev1, _mm256_set1_epi8(0x0f)))),
+            lookup(load32(BYTE2_HIGH), high_nibbles(in)));
+
+        // third and fourth bytes of 3 and 4 byte characters must be continuations
+        __m256i isThird  = _mm256_subs_epu8(prev<2>(in, prevIn), _mm256_set1_epi8(char(0xe0 - 0x80)));
+        __m256i isFourth = _mm256_subs_epu8(prev<3>(in, prevIn), _mm256_set1_epi8(char(0xf0 - 0x80)));
+        __m256i must23 = _mm256_and_si256(_mm256_or_si256(isThird, isFourth), _mm256_set1_epi8(char(0x80)));
+        return _mm256_xor_si256(must23, special);
+    }
+
+    // non-zero if the block ends in the middle of a character
+    __attribute__((target("avx2")))
+    inline __m256i incomplete(__m256i in)
+    {
+        return _mm256_subs_epu8(in, _mm256_load_si256(reinterpret_cast<const __m256i*>(INCOMPLETE_MAX)));
+    }
+
+    struct avx2_state
+    {
+        __m256i error, prevIn, prevIncomplete, nul, wildcard;
+    };
+
+    __attribute__((target("avx2")))
+    inline void scan_block(avx2_state& st, __m256i in)
+    {
+        const __m256i zero = _mm256_setzero_si256();
+        st.nul = _mm256_or_si256(st.nul, _mm256_cmpeq_epi8(in, zero));
+        st.wildcard = _mm256_or_si256(st.wildcard, _mm256_or_si256(_mm256_cmpeq_epi8(in, _mm256_set1_epi8('+')),
+                                                                    _mm256_cmpeq_epi8(in, _mm256_set1_epi8('#'))));
+
+        // ASCII block is valid unless the previous one ended in the middle of a character
+        if (!_mm256_movemask_epi8(in))
+            st.error = _mm256_or_si256(st.error, st.prevIncomplete);
+        else
+        {
+            st.error = _mm256_or_si256(st.error, check_block(in, st.prevIn));
+            st.prevIncomplete = incomplete(in);
+        }
+        st.prevIn = in;
+    }
+}
+
+__attribute__((target("ssse3")))
+uint8_t scan_ssse3(const uint8_t* p, size_t len)
+{
+    const uint8_t* end = p + len;
+    const __m128i zero = _mm_setzero_si128();
+    ssse3_state st{zero, zero, zero, zero, zero};
+
+    for (; end - p >= 16; p += 16)
+        scan_block(st, _mm_loadu_si128(reinterpret_cast<const __m128i*>(p)));
+
+    // last block is padded with spaces, they are neither NUL nor wildcards
+    if (p < end)
+    {
+        alignas(16) uint8_t last[16];
+        std::memset(last, ' ', sizeof(last));
+        std::memcpy(last, p, size_t(end - p));
+        scan_block(st, _mm_load_si128(reinterpret_cast<const __m128i*>(last)));
+    }
+    __m128i error = _mm_or_si128(st.error, st.prevIncomplete);
+
+    uint8_t res = CLEAN;
+    if (_mm_movemask_epi8(_mm_cmpeq_epi8(error, zero)) != 0xffff)
+        res |= MALFORMED;
+    if (_mm_movemask_epi8(st.nul))
+        res |= NUL;
+    if (_mm_movemask_epi8(st.wildcard))
+        res |= WILDCARD;
+    return res;
+}
+
+__attribute__((target("avx2")))
+uint8_t scan_avx2(const uint8_t* p, size_t len)
+{
+    const uint8_t* end = p + len;
+    const __m256i zero = _mm256_setzero_si256();
+    avx2_state st{zero, zero, zero, zero, zero};
+
+    for (; end - p >= 32; p += 32)
+        scan_block(st, _mm256_loadu_si256(reinterpret_cast<const __m256i*>(p)));
+
+    // last block is padded with spaces, they are neither NUL nor wildcards
+    if (p < end)
+    {
+        alignas(32) uint8_t last[32];
+        std::memset(last, ' ', sizeof(last));
+        std::memcpy(last, p, size_t(end - p));
+        scan_block(st, _mm256_load_si256(reinterpret_cast<const __m256i*>(last)));
+    }
+    __m256i error = _mm256_or_si256(st.error, st.prevIncomplete);
+
+    uint8_t res = CLEAN;
+    if (!_mm256_testz_si256(error, error))
+        res |= MALFORMED;
+    if (_mm256_movemask_epi8(st.nul))
+        res |= NUL;
+    if (_mm256_movemask_epi8(st.wildcard))
+        res |= WILDCARD;
+    return res;
+}
+
+uint8_t scan(const uint8_t* p, size_t len)
+{
+    // the padded ssse3 block beats the scalar loop even on short strings, the sse2 one only checks
+    // ascii in vectors and avx2 pays for it's wider padding below 32 B
+    static const bool bAVX2 = __builtin_cpu_supports("avx2");
+    static const bool bSSSE3 = __builtin_cpu_supports("ssse3");
+    if (bAVX2 && len >= 32)
+        return scan_avx2(p, len);
+    if (bSSSE3)
+        return scan_ssse3(p, len);
+    if (len < 16)
+        return scan_scalar(p, len);
+    return scan_sse2(p, len);
+}
+
+#else
+
+uint8_t scan_sse2 (const uint8_t* p, size_t len) { return scan_scalar(p, len); }
+uint8_t scan_ssse3(const uint8_t* p, size_t len) { return scan_scalar(p, len); }
+uint8_t scan_avx2 (const uint8_t* p, size_t len) { return scan_scalar(p, len); }
+
+uint8_t scan(const uint8_t* p, size_t len)
+{
+    return scan_scalar(p, len);
+}
+
+#endif
+
+}
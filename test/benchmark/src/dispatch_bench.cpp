@@ -0,0 +1,117 @@
+#include "mqtt.h"
+#include "net_message.h"
+
+// per-packet cost of getting from a received msg to it's handler:
+// old path - heap allocated packet, virtual unpack, dynamic_cast in the handler switch
+// new path - mqtt_parse into a std::variant on the stack, std::get in the handler switch
+
+using msg_t = tps::net::message<mqtt_header>;
+
+const size_t PKTS_PER_RUN = 20'000'000;
+
+// replica of the removed polymorphic packets
+struct legacy_packet
+{
+    virtual ~legacy_packet() = default;
+    virtual parse_error unpack(const msg_t& msg) = 0;
+};
+
+template <typename T>
+struct legacy: legacy_packet, T
+{
+    legacy(uint8_t byte): T(byte) {}
+    parse_error unpack(const msg_t& msg) override { return T::unpack(msg); }
+};
+
+std::unique_ptr<legacy_packet> legacy_create(const msg_t& msg)
+{
+    std::unique_ptr<legacy_packet> ret;
+    uint8_t byte = msg.hdr.byte.byte;
+    switch (packet_type(byte >> 4))
+    {
+        case packet_type::PUBACK:
+            ret = std::make_unique<legacy<mqtt_ack>>(byte);
+            break;
+        default:
+            ret = std::make_unique<legacy<mqtt_packet>>(byte);
+            break;
+    }
+
+    if (ret->unpack(msg) != parse_error::NONE)
+        ret = nullptr;
+    return ret;
+}
+
+// handlers only accumulate something, so that the work can't be optimized away
+uint64_t legacy_dispatch(const msg_t& msg)
+{
+    auto pkt = legacy_create(msg);
+    if (!pkt)
+        return 0;
+
+    switch (packet_type(msg.hdr.byte.bits.type))
+    {
+        case packet_type::PUBACK:
+            return dynamic_cast<legacy<mqtt_ack>&>(*pkt).pktID;
+        case packet_type::PINGREQ:
+            return dynamic_cast<legacy<mqtt_packet>&>(*pkt).header.byte;
+        default:
+            return 0;
+    }
+}
+
+uint64_t static_dispatch(const msg_t& msg)
+{
+    mqtt_any pkt;
+    if (mqtt_parse(msg, pkt) != parse_error::NONE)
+        return 0;
+
+    switch (packet_type(msg.hdr.byte.bits.type))
+    {
+        case packet_type::PUBACK:
+            return std::get<mqtt_puback>(pkt).pktID;
+        case packet_type::PINGREQ:
+            return std::get<mqtt_pingreq>(pkt).header.byte;
+        default:
+            return 0;
+    }
+}
+
+volatile uint64_t sink;
+
+template <typename Dispatch>
+double run(const msg_t& msg, Dispatch dispatch)
+{
+    uint64_t sum = 0;
+    auto start = std::chrono::steady_clock::now();
+
+    for (size_t i = 0; i < PKTS_PER_RUN; i++)
+        sum += dispatch(msg);
+
+    std::chrono::duration<double, std::nano> elapsed = std::chrono::steady_clock::now() - start;
+    sink = sum;
+    return elapsed.count() / PKTS_PER_RUN;
+}
+
+int main()
+{
+    msg_t puback;
+    puback.hdr.byte.byte = PUBACK_BYTE;
+    puback.body = {0x12, 0x34};
+
+    msg_t pingreq;
+    pingreq.hdr.byte.byte = 0xC0;
+
+    for (auto& [name, msg]: {std::pair<const char*, msg_t*>{"PUBACK", &puback}, {"PINGREQ", &pingreq}})
+    {
+        double legacyNs = run(*msg, legacy_dispatch);
+        double staticNs = run(*msg, static_dispatch);
+
+        std::cout << name
+                  << "\tvirtual + dynamic_cast: " << legacyNs << " ns/pkt"
+                  << "\tvariant: " << staticNs << " ns/pkt"
+                  << "\tx" << legacyNs / staticNs << "\n";
+    }
+
+    return 0;
+}
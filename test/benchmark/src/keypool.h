@@ -6,6 +6,8 @@
 #include <set>
 #include <deque>
 
+// pool of pkt IDs the broker used before packet_id_pool, kept for packet_id_bench
+//
 // key pool consists of chunks
 // each chunk is an interval containing 1 or more unique keys (uids)
 // chunks are sorted by the key that represents the start of the interval
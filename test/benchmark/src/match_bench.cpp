@@ -0,0 +1,299 @@
+#include "core.h"
+#include "net_connection.h"
+#include <chrono>
+#include <random>
+
+// wildcard filter expansion over 100k topics (used for retained msgs on SUBSCRIBE):
+// old path - filter split into string prefixes, char by char trie walk with std::function callbacks
+// new path - filter split into segment IDs once, tree of topic levels walked with an explicit stack
+//
+// subscribers lookup on publish: cached delivery list against the walk of the subscription tree
+//
+// fan-out to 10k subscribers of one topic: (handle, qos) array resolved through the slot table against
+// the replica of the removed per-topic map keyed by client ID, and the search of the client by it's
+// connection: handle carried by the connection against unordered_map<pConnection, pClient>
+
+const size_t TOPICS = 100'000;
+const size_t RUNS = 20;
+const size_t HOT_TOPICS = 1000;
+const size_t PUBLISHES = 2'000'000;
+const size_t FANOUT_CLIENTS = 10'000;
+const size_t FANOUTS = 2'000;
+
+using connection_t = tps::net::connection<mqtt_header>;
+
+volatile uint64_t sink;
+
+// replica of the removed implementation
+std::vector<std::shared_ptr<topic_t>> legacy_matching_topics(trie<topic_t>& topics, const std::string& topicFilter)
+{
+    std::vector<std::shared_ptr<topic_t>> matches;
+    std::vector<trie_cursor<topic_t>> matchesSoFar;
+    matchesSoFar.emplace_back(); // first search is from root
+    std::string prefix = "";
+    bool singleIsLast = false; // true when last symbol is '+'
+
+    bool multilvl = false;
+    // if there is a '#'(multi-lvl) wildcard, can mean one of two things:
+    // 1) topicFilter == "#" or
+    // 2) '#' is the last symbol of topicFilter
+    if (topicFilter.find("#") != std::string::npos)
+    {
+        // if topicFilter == "#"
+        if (topicFilter.length() == 1)
+        {
+            // every topic is a match
+            topics.apply_func(prefix, {}, [&prefix, &matches](const trie_cursor<topic_t>& t)
+            {
+                if (t.data()->name.str() == prefix)
+                    return;
+
+                matches.push_back(t.data());
+            });
+            return matches;
+        }
+        else // we need to evaluate the expr before '#' first
+        {
+            multilvl = true;
+            prefix = topicFilter;
+        }
+    }
+
+    // if there is a one or more '+'(single lvl) wildcards
+    if (topicFilter.find("+") != std::string::npos)
+    {
+        std::vector<boost::iterator_range<std::string::const_iterator>> singlelvl;
+        boost::find_all(singlelvl, topicFilter, "/+");
+        if (topicFilter[0] == '+')
+            singlelvl.emplace(singlelvl.cbegin(),
+                              boost::iterator_range<std::string::const_iterator>(topicFilter.cbegin(), topicFilter.cbegin()+1));
+
+        auto start = topicFilter.cbegin();
+        auto end = singlelvl[0].begin()+1;
+        if (topicFilter[0] == '+')
+            start++;
+        if (topicFilter[topicFilter.size()-1] == '+')
+            singleIsLast = true;
+
+        size_t i = 0;
+        std::vector<trie_cursor<topic_t>> temp;
+        do
+        {
+            // prefix = everything that comes before "/+", including '/'
+            prefix = std::string(start, end);
+
+            if (singleIsLast && i == singlelvl.size()-1)
+                break;
+
+            for (size_t j = 0; j < matchesSoFar.size(); j++)
+                // +/a   - from matchesSoFar[j](if nullptr - from root) go to "" (prefix) then find all topicnames until '/'
+                // /+/a/ - from matchesSoFar[j](if nullptr - from root) go to / (prefix) then find all topicnames until '/'
+                // /a/+/ - from matchesSoFar[j](if nullptr - from root) go to /a/ (prefix) then find all topicnames until '/'
+                topics.apply_func_key(prefix, matchesSoFar[j], '/',
+                                      [&temp](const trie_cursor<topic_t>& n) { temp.push_back(n); });
+
+            matchesSoFar = std::move(temp);
+
+            start = singlelvl[i].end()+1;
+            if (i+1 < singlelvl.size())
+                end = singlelvl[i+1].begin()+1;
+            i++;
+        }while (i < singlelvl.size());
+
+        start = singlelvl[singlelvl.size()-1].end()+1;
+        end = topicFilter.cend();
+        if (!singleIsLast)
+            prefix = std::string(start, end);
+    }
+
+    if (multilvl)
+    {
+        prefix.pop_back();
+        for (size_t i = 0; i < matchesSoFar.size(); i++)
+            topics.apply_func(prefix, matchesSoFar[i],
+                              [&matches](const trie_cursor<topic_t>& n) { matches.push_back(n.data()); });
+    }
+    else
+    {
+        if (singleIsLast)
+        {
+            for (size_t i = 0; i < matchesSoFar.size(); i++)
+                topics.find_all_data_until(prefix, matchesSoFar[i], '/',
+                                           [&matches](const trie_cursor<topic_t>& n) { matches.push_back(n.data()); });
+        }
+        else
+        {
+            for (size_t i = 0; i < matchesSoFar.size(); i++)
+            {
+                auto n = topics.find(prefix, matchesSoFar[i]);
+                if (n && n->data())
+                    matches.push_back(n->data());
+            }
+        }
+    }
+
+    return matches;
+}
+
+template <typename Func>
+double run(Func func)
+{
+    size_t found = 0;
+    auto start = std::chrono::steady_clock::now();
+    for (size_t i = 0; i < RUNS; i++)
+        found += func().size();
+    std::chrono::duration<double, std::micro> elapsed = std::chrono::steady_clock::now() - start;
+    return elapsed.count() / RUNS;
+}
+
+int main()
+{
+    static const char* metrics[] = {"temperature", "pressure", "vibration", "humidity"};
+    core_t core;
+    trie<topic_t> legacyTopics;
+
+    char buf[128];
+    for (size_t i = 0; i < TOPICS; i++)
+    {
+        snprintf(buf, sizeof(buf), "plant-%02zu/line-%02zu/machine-%03zu/%s",
+                 i / 5000, i / 250 % 20, i / 4 % 63, metrics[i % 4]);
+        auto& topic = core.find_topic(buf, true)->get();
+        legacyTopics.insert(topic.name.str(), std::make_shared<topic_t>(topic.name.str()));
+    }
+
+    for (const char* filter: {"#", "plant-07/#", "+/+/+/temperature", "plant-03/+/machine-042/+",
+                              "+/line-05/#", "+/missing/#"})
+    {
+        size_t nNew = core.get_matching_topics(filter).size();
+        size_t nOld = legacy_matching_topics(legacyTopics, filter).size();
+        double newUs = run([&](){ return core.get_matching_topics(filter); });
+        double oldUs = run([&](){ return legacy_matching_topics(legacyTopics, filter); });
+
+        std::cout << filter << "\t" << nNew << " matches";
+        if (nNew != nOld)
+            std::cout << " (old path: " << nOld << ")";
+        std::cout << "\told: " << oldUs << " us\tnew: " << newUs << " us\tx" << oldUs / newUs << "\n";
+    }
+
+    // connections are never opened, they only carry handles
+    asio::io_context context;
+    tps::net::connection_options options;
+    options.rxBufferSize = 64;
+    auto new_client = [&](std::string clientID) -> client_t*
+    {
+        auto netClient = std::make_shared<connection_t>(connection_t::owner::server, nullptr, context,
+                                                        asio::ip::tcp::socket(context), nullptr, options);
+        return core.add_new_client(std::move(clientID), netClient).get();
+    };
+
+    // every hot topic has an own subscriber, some clients subscribe to whole plants
+    std::vector<client_t*> clients;
+    std::vector<std::string> hotTopics;
+    for (size_t i = 0; i < HOT_TOPICS; i++)
+    {
+        snprintf(buf, sizeof(buf), "plant-%02zu/line-%02zu/machine-%03zu/temperature", i % 20, i / 20 % 20, i / 400);
+        hotTopics.emplace_back(buf);
+        clients.push_back(new_client("client" + std::to_string(i)));
+        core.subscribe(*clients.back(), hotTopics.back(), 1);
+        if (i < 40)
+            core.subscribe(*clients.back(), i % 2 ? "plant-" + std::to_string(10 + i / 2) + "/#"
+                                                  : "+/line-" + std::to_string(10 + i / 2) + "/+/temperature", 0);
+    }
+
+    auto publish = [&](bool bInvalidate)
+    {
+        size_t delivered = 0;
+        auto start = std::chrono::steady_clock::now();
+        for (size_t i = 0; i < PUBLISHES; i++)
+        {
+            // wildcard subscription change makes all lists stale
+            if (bInvalidate && i % HOT_TOPICS == 0)
+            {
+                core.subscribe(*clients[0], "+/none", 0);
+                core.unsubscribe(*clients[0], "+/none");
+            }
+            delivered += core.get_subscribers(hotTopics[i % HOT_TOPICS]).size();
+        }
+        std::chrono::duration<double, std::nano> elapsed = std::chrono::steady_clock::now() - start;
+        return std::make_pair(elapsed.count() / PUBLISHES, delivered);
+    };
+
+    auto [walkNs, walkDelivered] = publish(true);
+    auto [cachedNs, cachedDelivered] = publish(false);
+    auto st = core.get_match_cache_stats();
+    std::cout << "subscribers of a published topic\twalk: " << walkNs << " ns\tcached: " << cachedNs
+              << " ns\tx" << walkNs / cachedNs << "\t(" << double(cachedDelivered) / PUBLISHES << " receivers; hits "
+              << st.hits << ", misses " << st.misses << ", invalidations " << st.invalidations << ")\n";
+    if (walkDelivered != cachedDelivered)
+        std::cout << "cached lists differ\n";
+
+    // replica of the removed layout: subscribers of a topic by client ID, clients by connection
+    std::unordered_map<std::string, std::pair<client_t&, uint8_t>> legacySubscribers;
+    std::unordered_map<pConnection, pClient> legacyClients;
+    std::vector<pConnection> connections;
+    for (size_t i = 0; i < FANOUT_CLIENTS; i++)
+    {
+        auto client = new_client("fanout-client-" + std::to_string(i));
+        client->active = true;
+        core.subscribe(*client, i % 4 ? "fan/out" : "fan/#", 1);
+        legacySubscribers.emplace(client->clientID, std::pair<client_t&, uint8_t>(*client, 1));
+        connections.push_back(client->netClient);
+        legacyClients.emplace(client->netClient, core.find_client(client->netClient)->get());
+    }
+
+    // what publish does with every receiver before packing: client's state and qos
+    auto fanout = [&](auto func)
+    {
+        size_t delivered = 0;
+        auto start = std::chrono::steady_clock::now();
+        for (size_t i = 0; i < FANOUTS; i++)
+            delivered += func();
+        std::chrono::duration<double, std::nano> elapsed = std::chrono::steady_clock::now() - start;
+        return std::make_pair(elapsed.count() / (FANOUTS * FANOUT_CLIENTS), delivered);
+    };
+    auto [handleNs, handleDelivered] = fanout([&]()
+    {
+        size_t n = 0;
+        for (auto [handle, qos]: core.get_subscribers("fan/out"))
+            n += core.get_client(handle)->active && qos;
+        return n;
+    });
+    auto [legacyNs, legacyDelivered] = fanout([&]()
+    {
+        size_t n = 0;
+        for (auto& [clientID, sub]: legacySubscribers)
+            n += sub.first.active && sub.second;
+        return n;
+    });
+    std::cout << "fan-out to " << FANOUT_CLIENTS << " subscribers\tby client ID: " << legacyNs
+              << " ns/receiver\tby handle: " << handleNs << " ns/receiver\tx" << legacyNs / handleNs << "\n";
+    if (handleDelivered != legacyDelivered)
+        std::cout << "fan-out lists differ\n";
+
+    std::mt19937 rng(7);
+    std::vector<pConnection> order;
+    for (size_t i = 0; i < PUBLISHES; i++)
+        order.push_back(connections[rng() % connections.size()]);
+    // connection of an incoming msg has just been used by the receive path, it's ID stands for that
+    auto search = [&](auto func)
+    {
+        size_t found = 0;
+        uint64_t ids = 0;
+        auto start = std::chrono::steady_clock::now();
+        for (auto& netClient: order)
+        {
+            ids += netClient->get_ID();
+            found += func(netClient);
+        }
+        std::chrono::duration<double, std::nano> elapsed = std::chrono::steady_clock::now() - start;
+        if (found != order.size())
+            std::cout << "clients not found: " << order.size() - found << "\n";
+        sink = ids;
+        return elapsed.count() / order.size();
+    };
+    double mapNs = search([&](const pConnection& netClient) { return legacyClients.count(netClient); });
+    double slotNs = search([&](const pConnection& netClient) { return size_t(core.find_client(netClient).has_value()); });
+    std::cout << "client by connection\tmap: " << mapNs << " ns\thandle: " << slotNs << " ns\tx" << mapNs / slotNs << "\n";
+
+    return 0;
+}
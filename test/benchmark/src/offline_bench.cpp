@@ -0,0 +1,193 @@
+#include <chrono>
+#include <iostream>
+#include <malloc.h>
+#include <string>
+#include <vector>
+#include "offline_queue.h"
+
+// fleet of persistent sessions gone offline while a busy topic keeps publishing: every publish is saved
+// in every session. Unbounded vectors of msgs (as sessions kept them before) against offline queues
+// bounded in memory, with the oldest msgs dropped or the overflow spilled to disk
+// Before that, limits and spilling are checked on a single session
+
+const size_t SESSIONS = 100'000;
+const size_t PUBLISHES = 40;
+const size_t PAYLOAD = 1024;
+
+size_t heap_used()
+{
+    return mallinfo2().uordblks;
+}
+
+mqtt_publish make_msg(size_t i)
+{
+    static std::string payload(PAYLOAD, 'x');
+    std::string topic = "plant/line-" + std::to_string(i % 8) + "/telemetry";
+
+    mqtt_publish pkt;
+    pkt.header.bits.qos = AT_LEAST_ONCE;
+    pkt.topic = topic;
+    pkt.payload = payload;
+    pkt.make_owned();
+    return pkt;
+}
+
+// msg 'i' of a check, the payload keeps it's number to verify the order
+mqtt_publish make_numbered(size_t i, size_t payloadLen)
+{
+    std::string payload = std::to_string(i);
+    payload.resize(payloadLen, 'x');
+
+    mqtt_publish pkt;
+    pkt.header.bits.qos = AT_LEAST_ONCE;
+    pkt.topic = "a/b";
+    pkt.payload = payload;
+    pkt.make_owned();
+    return pkt;
+}
+
+// pushes 'count' msgs and pops them all, false if the msgs read back aren't [first, first + expected)
+bool check_queue(const char* name, const offline_queue::limits& lim, size_t count, size_t payloadLen,
+                 size_t first, size_t expected)
+{
+    offline_queue::set_limits(lim);
+    auto before = offline_queue::get_stats();
+    bool bSpilled = false;
+    {
+        offline_queue q;
+        for (size_t i = 0; i < count; i++)
+            q.push(make_numbered(i, payloadLen), AT_LEAST_ONCE);
+        bSpilled = q.spilled_bytes() > 0;
+
+        size_t n = 0;
+        while (auto pkt = q.pop_front())
+        {
+            auto number = std::to_string(first + n);
+            if (n == expected || pkt->payload.substr(0, number.size()) != number || pkt->topic != "a/b"
+                || pkt->header.bits.qos != AT_LEAST_ONCE)
+            {
+                std::cout << name << ": msg " << n << " is wrong, " << pkt->payload.substr(0, 8) << "\n";
+                return false;
+            }
+            n++;
+        }
+        if (n != expected)
+        {
+            std::cout << name << ": " << n << " msgs read back, " << expected << " expected\n";
+            return false;
+        }
+    }
+
+    auto st = offline_queue::get_stats();
+    if (st.msgs || st.spilledMsgs || st.spilledBytes || st.diskBytes || st.dropped - before.dropped != count - expected
+        || (lim.spillThreshold != 0) != bSpilled)
+    {
+        std::cout << name << ": stats are off, " << st.msgs << " msgs, " << st.diskBytes << " bytes on disk, "
+                  << st.dropped - before.dropped << " dropped\n";
+        return false;
+    }
+    std::cout << name << ": " << expected << " of " << count << " msgs in order\n";
+    return true;
+}
+
+// false if a check fails
+bool check()
+{
+    // 3 bytes topic and 106 bytes payload, 93 msgs fit in 10 KB
+    const size_t MSGS = 300;
+    const size_t LEN = 106;
+    const size_t FIT = 10240 / (3 + LEN);
+
+    offline_queue::limits lim;
+    lim.maxSessionBytes = 10240;
+    lim.policy = offline_queue::drop_policy::DROP_OLDEST;
+    if (!check_queue("10 KB session, oldest dropped", lim, MSGS, LEN, MSGS - FIT, FIT))
+        return false;
+
+    lim.policy = offline_queue::drop_policy::DROP_NEWEST;
+    if (!check_queue("10 KB session, newest dropped", lim, MSGS, LEN, 0, FIT))
+        return false;
+
+    // all but the first 8 KB go to disk and come back in order
+    lim = offline_queue::limits();
+    lim.spillThreshold = 8 << 10;
+    return check_queue("spill > 8 KB", lim, 3000, LEN, 0, 3000);
+}
+
+template <typename Queue, typename Push, typename Pop>
+void bench(const char* name, Push push, Pop pop)
+{
+    size_t before = heap_used();
+    uint64_t droppedBefore = offline_queue::get_stats().dropped;
+    std::vector<Queue> sessions(SESSIONS);
+
+    auto start = std::chrono::steady_clock::now();
+    for (size_t i = 0; i < PUBLISHES; i++)
+    {
+        auto pkt = make_msg(i);
+        for (auto& q: sessions)
+            push(q, pkt);
+    }
+    std::chrono::duration<double, std::nano> saving = std::chrono::steady_clock::now() - start;
+    size_t bytes = heap_used() - before;
+
+    auto st = offline_queue::get_stats();
+    std::cout << name << double(bytes) / (1 << 20) << " MB of heap, " << saving.count() / (SESSIONS * PUBLISHES)
+              << " ns/msg to save";
+    if (st.msgs)
+        std::cout << ", " << st.msgs << " msgs queued (" << st.spilledMsgs << " spilled, "
+                  << double(st.spilledBytes) / (1 << 20) << " MB, " << double(st.diskBytes) / (1 << 20)
+                  << " MB on disk), " << st.dropped - droppedBefore << " dropped";
+
+    // sessions come back one by one
+    size_t nRead = 0;
+    start = std::chrono::steady_clock::now();
+    for (auto& q: sessions)
+        nRead += pop(q);
+    std::chrono::duration<double, std::nano> draining = std::chrono::steady_clock::now() - start;
+    std::cout << ", " << draining.count() / std::max<size_t>(nRead, 1) << " ns/msg to drain\n";
+}
+
+void run_queue(const char* name, const offline_queue::limits& lim)
+{
+    offline_queue::set_limits(lim);
+    bench<offline_queue>(name,
+        [](offline_queue& q, const mqtt_publish& pkt) { q.push(pkt, AT_LEAST_ONCE); },
+        [](offline_queue& q)
+        {
+            size_t n = 0;
+            while (q.pop_front())
+                n++;
+            return n;
+        });
+}
+
+int main()
+{
+    if (!check())
+        return 1;
+
+    std::cout << SESSIONS << " offline sessions, " << PUBLISHES << " publishes of " << PAYLOAD << " bytes saved in each\n";
+
+    bench<std::vector<mqtt_publish>>("vector:            ",
+        [](std::vector<mqtt_publish>& q, const mqtt_publish& pkt) { q.push_back(pkt); },
+        [](std::vector<mqtt_publish>& q)
+        {
+            size_t n = q.size();
+            std::vector<mqtt_publish>().swap(q);
+            return n;
+        });
+
+    offline_queue::limits lim;
+    lim.maxMemoryBytes = 0;
+    run_queue("queue, unbounded:  ", lim);
+
+    lim.maxMemoryBytes = 64 << 20;
+    run_queue("queue, 64 MB:      ", lim);
+
+    // most of the msgs of every session go to disk, each of them is written once for all sessions
+    lim.spillThreshold = 8 * PAYLOAD;
+    run_queue("queue, spill > 8 KB:", lim);
+
+    return 0;
+}
@@ -0,0 +1,114 @@
+#include <chrono>
+#include <iostream>
+#include <limits>
+#include <malloc.h>
+#include <optional>
+#include <random>
+#include <stdexcept>
+#include "keypool.h"
+#include "packet_id_pool.h"
+
+// packet ID allocation under churn: every publish takes an ID, finds it when the ack comes and releases it,
+// while a number of msgs stays in flight. Acks come in order (one slow consumer) or in random order
+// (acks of QoS 1 and 2 msgs interleave). packet_id_pool against KeyPool, which it replaced
+// KeyPool throws after 65536 publishes unless the window empties, so it gets fewer
+
+const size_t OPS = 2'000'000;
+
+size_t heap_used()
+{
+    return mallinfo2().uordblks;
+}
+
+struct keypool_adapter
+{
+    KeyPool<uint16_t, packet_type> pool;
+
+    uint16_t generate_key(packet_type ack) { return pool.generate_key(ack); }
+    bool unregister_key(uint16_t id) { return pool.unregister_key(id); }
+    std::optional<packet_type> find(uint16_t id)
+    {
+        if (auto val = pool.find(id))
+            return val->get();
+        return std::nullopt;
+    }
+};
+
+// heap taken by the pool with 'inFlight' IDs taken, pools are kept until the end,
+// so that freed blocks of one don't count as used by the next
+template <typename Pool>
+size_t footprint(size_t inFlight)
+{
+    static std::vector<std::unique_ptr<Pool>> pools;
+    size_t before = heap_used();
+    pools.push_back(std::make_unique<Pool>());
+    for (size_t i = 0; i < inFlight; i++)
+        pools.back()->generate_key(packet_type::PUBACK);
+    return heap_used() - before;
+}
+
+// ns per publish + ack
+template <typename Pool>
+double run(size_t inFlight, bool bRandomAcks, size_t ops)
+{
+    std::mt19937 rng(7);
+    Pool pool;
+
+    // IDs in flight in the order they were taken
+    std::vector<uint16_t> taken;
+    size_t oldest = 0;
+    for (size_t i = 0; i < inFlight; i++)
+        taken.push_back(pool.generate_key(packet_type::PUBACK));
+
+    size_t acked = 0;
+    auto start = std::chrono::steady_clock::now();
+    for (size_t i = 0; i < ops; i++)
+    {
+        size_t pos = bRandomAcks ? rng() % inFlight : oldest;
+        uint16_t id = taken[pos];
+        if (auto val = pool.find(id); val && *val == packet_type::PUBACK)
+            acked += pool.unregister_key(id);
+
+        taken[pos] = pool.generate_key(packet_type::PUBACK);
+        oldest = (oldest + 1) % inFlight;
+    }
+    std::chrono::duration<double, std::nano> elapsed = std::chrono::steady_clock::now() - start;
+
+    if (acked != ops)
+        std::cout << "acks lost: " << ops - acked << "\n";
+    return elapsed.count() / ops;
+}
+
+int main()
+{
+    std::cout << "packet_id_pool footprint: " << packet_id_pool<>::footprint() << " B (65535 IDs), "
+              << packet_id_pool<1024>::footprint() << " B (1024 IDs), " << sizeof(packet_id_pool<>) << " B unused\n";
+    for (size_t inFlight: {16, 256, 4096, 16384})
+        std::cout << "heap with " << inFlight << " in flight\tKeyPool: " << footprint<keypool_adapter>(inFlight)
+                  << " B\tpacket_id_pool: " << footprint<packet_id_pool<>>(inFlight) << " B\n";
+
+    for (bool bRandomAcks: {false, true})
+        for (size_t inFlight: {16, 256, 4096, 16384})
+        {
+            // KeyPool only hands out IDs that were never taken while something is in flight (see below)
+            size_t keypoolOps = 60'000 - inFlight;
+            double oldNs = run<keypool_adapter>(inFlight, bRandomAcks, keypoolOps);
+            double newNs = run<packet_id_pool<>>(inFlight, bRandomAcks, OPS);
+
+            std::cout << (bRandomAcks ? "random acks, " : "ordered acks, ") << inFlight << " in flight"
+                      << "\tKeyPool: " << oldNs << " ns\tpacket_id_pool: " << newNs << " ns\tx" << oldNs / newNs << "\n";
+        }
+
+    // first chunk only grows at it's end, freed IDs are reused only when nothing is in flight
+    try
+    {
+        run<keypool_adapter>(2, false, 100'000);
+        std::cout << "KeyPool, ordered acks, 2 in flight: 100000 publishes\n";
+    }
+    catch (const std::runtime_error& e)
+    {
+        std::cout << "KeyPool, ordered acks, 2 in flight: " << e.what() << " before 100000 publishes\n";
+    }
+
+    return 0;
+}
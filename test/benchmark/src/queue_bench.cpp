@@ -0,0 +1,74 @@
+#include "mqtt.h"
+#include "net_message.h"
+#include "net_tsqueue.h"
+#include "net_mpsc_queue.h"
+
+// compares the old tsqueue (mutex + condvar, one pop per lock) with
+// mpsc_queue (lock-free ring, batched drain) as the server's incoming queue
+
+using item_t = tps::net::owned_message<mqtt_header>;
+
+const size_t MSGS_PER_RUN = 4'000'000;
+
+item_t make_item()
+{
+    item_t item;
+    item.msg.hdr.byte.byte = PUBLISH_BYTE;
+    item.msg.body.resize(16);
+    return item;
+}
+
+template <typename Queue, typename Consume>
+double run(Queue& queue, uint32_t nProducers, Consume consume)
+{
+    size_t perProducer = MSGS_PER_RUN / nProducers;
+    size_t total = perProducer * nProducers;
+
+    auto start = std::chrono::steady_clock::now();
+
+    std::vector<std::thread> producers;
+    for (uint32_t i = 0; i < nProducers; i++)
+        producers.emplace_back([&queue, perProducer]()
+        {
+            for (size_t j = 0; j < perProducer; j++)
+                queue.push_back(make_item());
+        });
+
+    size_t consumed = 0;
+    while (consumed < total)
+        consumed += consume(queue);
+
+    for (auto& t: producers)
+        t.join();
+
+    std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+    return double(total) / elapsed.count();
+}
+
+int main()
+{
+    for (uint32_t nProducers: {1, 4, 16})
+    {
+        tps::net::tsqueue<item_t> tsq;
+        double tsRate = run(tsq, nProducers, [](tps::net::tsqueue<item_t>& q)
+        {
+            q.wait();
+            q.pop_front();
+            return size_t(1);
+        });
+
+        tps::net::mpsc_queue<item_t> mpsc(128 * 1024);
+        double mpscRate = run(mpsc, nProducers, [](tps::net::mpsc_queue<item_t>& q)
+        {
+            q.wait();
+            return q.drain([](item_t&){}, 256);
+        });
+
+        std::cout << "producers: " << nProducers
+                  << "\ttsqueue: "  << uint64_t(tsRate)   << " msg/s"
+                  << "\tmpsc_queue: " << uint64_t(mpscRate) << " msg/s"
+                  << "\tx" << mpscRate / tsRate << "\n";
+    }
+
+    return 0;
+}
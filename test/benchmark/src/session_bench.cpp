@@ -0,0 +1,77 @@
+#include "atom.h"
+#include <chrono>
+#include <cstdio>
+#include <iostream>
+#include <malloc.h>
+#include <random>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+// memory of the subscriptions of persistent sessions: filters kept as strings in every session
+// against filters interned as atoms. Most of the filters of a fleet are the same (a device subscribes
+// to it's plant or line), a few contain the device's own ID and can't be shared
+
+const size_t SESSIONS = 1'000'000;
+const size_t SUBSCRIPTIONS = 20;
+const size_t OWN_SUBSCRIPTIONS = 2;
+const size_t SHARED_FILTERS = 10'000;
+
+size_t heap_used()
+{
+    return mallinfo2().uordblks;
+}
+
+std::string shared_filter(size_t i)
+{
+    static const char* metrics[] = {"temperature", "pressure", "vibration", "humidity", "+", "#"};
+    char buf[128];
+    snprintf(buf, sizeof(buf), "plant-%02zu/line-%02zu/machine-%03zu/%s", i % 50, i / 50 % 40, i / 2000, metrics[i % 6]);
+    return buf;
+}
+
+std::string own_filter(size_t session, size_t i)
+{
+    char buf[128];
+    snprintf(buf, sizeof(buf), "devices/device-%07zu/%s", session, i ? "config" : "cmd/+");
+    return buf;
+}
+
+template <typename Map, typename Key>
+void bench(const char* name, Key make_key)
+{
+    std::mt19937 rng(42);
+    size_t before = heap_used();
+    auto start = std::chrono::steady_clock::now();
+
+    std::vector<Map> sessions(SESSIONS);
+    for (size_t s = 0; s < SESSIONS; s++)
+    {
+        for (size_t i = 0; i < OWN_SUBSCRIPTIONS; i++)
+            sessions[s][make_key(own_filter(s, i))] = 1;
+        while (sessions[s].size() < SUBSCRIPTIONS)
+            sessions[s][make_key(shared_filter(rng() % SHARED_FILTERS))] = 1;
+    }
+
+    std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+    size_t bytes = heap_used() - before;
+    std::cout << name << double(bytes) / SESSIONS << " B/session, " << double(bytes) / (1 << 20) << " MB total, "
+              << elapsed.count() << " s to subscribe";
+    if constexpr (std::is_same_v<typename Map::key_type, atom>)
+    {
+        auto st = atom::get_stats();
+        std::cout << " (" << st.strings << " atoms, " << double(st.bytes) / (1 << 20) << " MB of characters)";
+    }
+    std::cout << "\n";
+}
+
+int main()
+{
+    std::cout << SESSIONS << " sessions x " << SUBSCRIPTIONS << " subscriptions, " << OWN_SUBSCRIPTIONS
+              << " of them with device's ID, the rest from " << SHARED_FILTERS << " shared filters\n";
+
+    bench<std::unordered_map<std::string, uint8_t>>("strings: ", [](std::string&& f) { return std::move(f); });
+    bench<std::unordered_map<atom, uint8_t>>("atoms:   ", [](std::string&& f) { return atom(f); });
+
+    return 0;
+}
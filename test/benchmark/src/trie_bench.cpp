@@ -0,0 +1,148 @@
+#include "trie.h"
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <iostream>
+#include <malloc.h>
+#include <random>
+#include <unordered_map>
+
+// memory per topic and exact lookup latency of the topic trie on realistic topic names
+// (plant/line/machine/sensor/metric), adaptive radix tree against the replica of the
+// removed per-character unordered_map trie
+
+const size_t TOPICS = 1'000'000;
+// per-character trie needs a few KB per topic, it's measured on a part of the set
+const size_t LEGACY_TOPICS = 200'000;
+const size_t LOOKUPS = 5'000'000;
+
+struct topic_t {};
+
+// replica of the removed trie
+struct legacy_node
+{
+    legacy_node() { children.reserve(96/6); }
+    std::unordered_map<char, std::unique_ptr<legacy_node>> children;
+    std::shared_ptr<topic_t> data;
+};
+
+struct legacy_trie
+{
+    legacy_node root;
+
+    void insert(const std::string& key, const std::shared_ptr<topic_t>& data)
+    {
+        legacy_node* cursor = &root;
+        for (auto c: key)
+        {
+            auto it = cursor->children.find(c);
+            if (it == cursor->children.end())
+                it = cursor->children.emplace(c, std::make_unique<legacy_node>()).first;
+            cursor = it->second.get();
+        }
+        cursor->data = data;
+    }
+
+    legacy_node* find(std::string_view key)
+    {
+        legacy_node* cursor = &root;
+        for (auto c: key)
+        {
+            auto it = cursor->children.find(c);
+            if (it == cursor->children.end())
+                return nullptr;
+            cursor = it->second.get();
+        }
+        return cursor;
+    }
+};
+
+std::vector<std::string> make_topics(size_t count)
+{
+    static const char* metrics[] = {"temperature", "pressure", "vibration", "humidity", "current", "voltage"};
+    std::vector<std::string> topics;
+    topics.reserve(count);
+
+    char buf[128];
+    for (size_t i = 0; topics.size() < count; i++)
+    {
+        size_t sensor = i % 25, machine = i / 25 % 40, line = i / 1000 % 50, plant = i / 50'000;
+        snprintf(buf, sizeof(buf), "plant-%02zu/line-%02zu/machine-%03zu/sensor-%02zu/%s",
+                 plant, line, machine, sensor, metrics[(i * 7) % 6]);
+        topics.emplace_back(buf);
+    }
+
+    std::shuffle(topics.begin(), topics.end(), std::mt19937(42));
+    return topics;
+}
+
+size_t heap_used()
+{
+    return mallinfo2().uordblks;
+}
+
+template <typename Func>
+double run(const std::vector<std::string>& keys, Func func)
+{
+    std::mt19937 rng(7);
+    std::vector<uint32_t> order(LOOKUPS);
+    for (auto& i: order)
+        i = uint32_t(rng() % keys.size());
+
+    size_t found = 0;
+    auto start = std::chrono::steady_clock::now();
+    for (auto i: order)
+        found += func(keys[i]);
+    std::chrono::duration<double, std::nano> elapsed = std::chrono::steady_clock::now() - start;
+
+    if (found != LOOKUPS)
+        std::cout << "lookups failed: " << LOOKUPS - found << "\n";
+    return elapsed.count() / LOOKUPS;
+}
+
+void bench_art(const std::vector<std::string>& topics, const std::shared_ptr<topic_t>& data)
+{
+    size_t before = heap_used();
+    trie<topic_t> art;
+    for (auto& t: topics)
+        art.insert(t, data);
+    size_t bytes = heap_used() - before;
+
+    auto st = art.get_stats();
+    double ns = run(topics, [&art](const std::string& t) { return art.find_data(t) != nullptr; });
+    std::cout << "art:    " << double(bytes) / topics.size() << " B/topic, "
+              << ns << " ns/lookup (" << topics.size() << " topics; N4 " << st.nodes[0] << ", N16 " << st.nodes[1]
+              << ", N48 " << st.nodes[2] << ", N256 " << st.nodes[3] << ")\n";
+}
+
+int main()
+{
+    auto topics = make_topics(TOPICS);
+    auto data = std::make_shared<topic_t>();
+    size_t keyBytes = 0;
+    for (auto& t: topics)
+        keyBytes += t.size();
+    std::cout << topics.size() << " topics, " << double(keyBytes) / topics.size() << " B average name\n";
+
+    bench_art(topics, data);
+
+    std::vector<std::string> part(topics.begin(), topics.begin() + LEGACY_TOPICS);
+    bench_art(part, data);
+    {
+        size_t before = heap_used();
+        auto legacy = std::make_unique<legacy_trie>();
+        for (auto& t: part)
+            legacy->insert(t, data);
+        size_t bytes = heap_used() - before;
+
+        double ns = run(part, [&legacy](const std::string& t)
+        {
+            auto n = legacy->find(t);
+            return n && n->data;
+        });
+        std::cout << "legacy: " << double(bytes) / part.size() << " B/topic, "
+                  << ns << " ns/lookup (" << part.size() << " topics)\n";
+    }
+
+    return 0;
+}
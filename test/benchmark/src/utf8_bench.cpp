@@ -0,0 +1,140 @@
+#include <random>
+#include "mqtt.h"
+#include "net_message.h"
+#include "utf8.h"
+
+// cost of topic validation: scalar, SSE2, SSSE3 and AVX2 scans of topic names of different lengths,
+// and the share of the best one in mqtt_parse() of a PUBLISH with that topic
+// Before timing, SIMD scans are checked against the scalar one on random strings
+
+using msg_t = tps::net::message<mqtt_header>;
+
+const size_t BYTES_PER_RUN = 1ull << 30;
+
+volatile uint64_t sink;
+
+template <typename Func>
+double run(size_t bytesPerCall, Func func)
+{
+    size_t calls = std::max<size_t>(BYTES_PER_RUN / bytesPerCall, 1'000'000);
+    uint64_t sum = 0;
+    auto start = std::chrono::steady_clock::now();
+
+    for (size_t i = 0; i < calls; i++)
+        sum += func();
+
+    std::chrono::duration<double, std::nano> elapsed = std::chrono::steady_clock::now() - start;
+    sink = sum;
+    return elapsed.count() / calls;
+}
+
+// levels of 'level' repeated until the topic is 'len' bytes long
+std::string make_topic(size_t len, const std::string& level)
+{
+    std::string topic;
+    while (topic.size() < len)
+        topic += level + "/";
+    topic.resize(len);
+    // don't cut a multi-byte character in half
+    size_t lead = topic.size();
+    while (lead && (uint8_t(topic[lead - 1]) & 0xc0) == 0x80)
+        lead--;
+    if (lead)
+    {
+        uint8_t c = uint8_t(topic[lead - 1]);
+        size_t charLen = c < 0x80 ? 1 : c < 0xe0 ? 2 : c < 0xf0 ? 3 : 4;
+        if (topic.size() - (lead - 1) < charLen)
+            topic.resize(lead - 1);
+    }
+    return topic;
+}
+
+// bytes around the boundaries the scans check: ASCII, wildcards, NUL, continuation bytes,
+// overlong and surrogate leads, and leads of 4 byte sequences up to and over U+10FFFF
+const uint8_t INTERESTING[] = {0x00, 'a', '/', '+', '#', 0x7f, 0x80, 0x8f, 0x90, 0x9f, 0xa0, 0xbf,
+                               0xc0, 0xc1, 0xc2, 0xdf, 0xe0, 0xed, 0xee, 0xef, 0xf0, 0xf4, 0xf5, 0xff};
+
+// false if a SIMD scan disagrees with the scalar one
+bool fuzz(size_t strings)
+{
+    std::mt19937 rng(20240601);
+    std::vector<uint8_t> buf(512);
+    bool bAVX2 = __builtin_cpu_supports("avx2");
+
+    for (size_t n = 0; n < strings; n++)
+    {
+        // mostly valid strings with a few random bytes, so that errors land in every position of a block
+        std::string str = make_topic(rng() % 300, n % 2 ? "sensors" : "датчик");
+        for (size_t i = 0, bad = rng() % 4; i < bad && str.size(); i++)
+            str[rng() % str.size()] = char(rng() % 2 ? INTERESTING[rng() % sizeof(INTERESTING)] : uint8_t(rng()));
+
+        // strings don't start on a block boundary
+        size_t offset = rng() % 32;
+        std::copy(str.begin(), str.end(), buf.begin() + ptrdiff_t(offset));
+        auto p = buf.data() + offset;
+
+        // other flags of a malformed string depend on where the scan stopped
+        auto scan = [&](uint8_t (*func)(const uint8_t*, size_t))
+        {
+            uint8_t res = func(p, str.size());
+            return (res & utf8::MALFORMED) ? uint8_t(utf8::MALFORMED) : res;
+        };
+        uint8_t expected = scan(utf8::scan_scalar);
+        uint8_t sse2 = scan(utf8::scan_sse2);
+        uint8_t ssse3 = scan(utf8::scan_ssse3);
+        uint8_t avx2 = bAVX2 ? scan(utf8::scan_avx2) : expected;
+        uint8_t best = scan(utf8::scan);
+        if (sse2 != expected || ssse3 != expected || avx2 != expected || best != expected)
+        {
+            std::cout << "scan mismatch on " << str.size() << " bytes: scalar " << int(expected) << " sse2 " << int(sse2)
+                      << " ssse3 " << int(ssse3) << " avx2 " << int(avx2) << " best " << int(best) << "\n";
+            return false;
+        }
+    }
+    return true;
+}
+
+int main()
+{
+    const size_t FUZZ_STRINGS = 1'000'000;
+    if (!fuzz(FUZZ_STRINGS))
+        return 1;
+    std::cout << FUZZ_STRINGS << " random strings, SIMD scans agree with the scalar one\n";
+
+    const std::string payload(64, 'p');
+
+    for (auto [kind, level]: {std::pair<const char*, std::string>{"ascii", "sensors"}, {"utf-8", "датчик"}})
+        for (size_t len: {8, 16, 24, 64, 256, 1024, 8192})
+        {
+            std::string topic = make_topic(len, level);
+            auto p = reinterpret_cast<const uint8_t*>(topic.data());
+
+            msg_t msg;
+            msg.hdr.byte.byte = PUBLISH_BYTE;
+            msg.body.push_back(uint8_t(topic.size() >> 8));
+            msg.body.push_back(uint8_t(topic.size()));
+            msg.body.insert(msg.body.end(), topic.begin(), topic.end());
+            msg.body.insert(msg.body.end(), payload.begin(), payload.end());
+
+            double scalarNs = run(topic.size(), [&](){ return utf8::scan_scalar(p, topic.size()); });
+            double sse2Ns   = run(topic.size(), [&](){ return utf8::scan_sse2(p, topic.size()); });
+            double ssse3Ns  = run(topic.size(), [&](){ return utf8::scan_ssse3(p, topic.size()); });
+            double avx2Ns   = run(topic.size(), [&](){ return utf8::scan_avx2(p, topic.size()); });
+            double bestNs   = run(topic.size(), [&](){ return utf8::scan(p, topic.size()); });
+            double parseNs  = run(msg.body.size(), [&]()
+            {
+                mqtt_any pkt;
+                return uint64_t(mqtt_parse(msg, pkt));
+            });
+
+            std::cout << kind << " topic " << topic.size() << " B"
+                      << "\tscalar: " << scalarNs << " ns"
+                      << "\tsse2: "   << sse2Ns   << " ns"
+                      << "\tssse3: "  << ssse3Ns  << " ns"
+                      << "\tavx2: "   << avx2Ns   << " ns"
+                      << "\tparse: "  << parseNs  << " ns (validation "
+                      << 100 * bestNs / parseNs << "%)\n";
+        }
+
+    return 0;
+}
@@ -82,8 +82,9 @@ void MQTTClient::pack_subscribe(mqtt_subscribe &sub, tps::net::message<mqtt_head
     msg << pkt_id;
     size += sizeof(sub.pktID);
 
-    for (auto& [topiclen, topic, qos]: sub.tuples)
+    for (auto& [topic, qos]: sub.tuples)
     {
+        auto topiclen = uint16_t(topic.size());
         auto topiclenbe = byteswap16(topiclen);
         msg << topiclenbe;
         msg << topic;
@@ -104,8 +105,9 @@ void MQTTClient::pack_unsubscribe(mqtt_unsubscribe &unsub, tps::net::message<mqt
     msg << pkt_id;
     size += sizeof(unsub.pktID);
 
-    for (auto& [topiclen, topic]: unsub.tuples)
+    for (auto& topic: unsub.topics)
     {
+        auto topiclen = uint16_t(topic.size());
         auto topiclenbe = byteswap16(topiclen);
         msg << topiclenbe;
         msg << topic;
@@ -174,9 +176,10 @@ uint16_t MQTTClient::publish(std::string &topic, std::string &msg, uint8_t qos,
     mqtt_publish pub(PUBLISH_BYTE);
     pub.header.bits.qos = qos;
     pub.header.bits.retain = retain;
-    pub.pktID = pktID++;
+    if (++pktID == 0) // [MQTT-2.3.1-1]
+        pktID = 1;
+    pub.pktID = pktID;
     pub.topic = topic;
-    pub.topiclen = uint16_t(pub.topic.size());
     pub.payload = msg;
 
     tps::net::message<mqtt_header>pubmsg;
@@ -195,15 +198,7 @@ uint16_t MQTTClient::subscribe(std::vector<std::pair<std::string, uint8_t>>& top
     subreq.pktID = pktID++;
 
     for (auto& p: topics)
-    {
-        std::tuple<uint16_t, std::string, uint8_t> t;
-        auto& [topiclen, topic, qos] = t;{}
-
-        topic = std::move(p.first);
-        topiclen = uint16_t(topic.size());
-        qos = p.second;
-        subreq.tuples.emplace_back(t);
-    }
+        subreq.tuples.emplace_back(p.first, p.second);
 
     tps::net::message<mqtt_header> msg;
     pack_subscribe(subreq, msg);
@@ -220,16 +215,8 @@ void MQTTClient::unsubscribe()
     static uint16_t pktID = 0;
     unsub.pktID = pktID++;
 
-    std::pair<uint16_t, std::string> t;
-    auto& [topiclen, topic] = t;{}
-
-    topic = "/foo";
-    topiclen = uint16_t(topic.size());
-    unsub.tuples.emplace_back(t);
-
-    topic = "/bar";
-    topiclen = uint16_t(topic.size());
-    unsub.tuples.emplace_back(t);
+    unsub.topics.emplace_back("/foo");
+    unsub.topics.emplace_back("/bar");
 
     tps::net::message<mqtt_header> msg;
     pack_unsubscribe(unsub, msg);
@@ -366,7 +366,7 @@ void test_publish()
     assert(pub.topic == topic);
     assert(pub.payload == msg1);
 
-    client0->send_ack(packet_type::PUBREC, ack1.pktID); // send PUBREC
+    client0->send_ack(packet_type::PUBREC, pub.pktID); // send PUBREC
 
     // recv PUBREL
     auto msg02 = get_msg(client0);
@@ -376,10 +376,267 @@ void test_publish()
     }
 }
 
+void test_inflight()
+{
+    { // 1st client subs to topic with qos 1 and doesn't ack, 2nd client publishes more msgs than the in-flight window
+        std::cout << "#1\n";
+
+    // 1st client
+    auto client0 = create_client();
+    client0->connect_server("client1");
+    get_msg(client0); // get CONNACK
+
+    // send SUB
+    std::vector<std::pair<std::string, uint8_t>> topics;
+    std::string topic = "/window";
+    topics.emplace_back(topic, AT_LEAST_ONCE);
+    client0->subscribe(topics);
+    get_msg(client0); // get SUBACK
+
+    // 2nd client
+    auto client1 = create_client();
+    client1->connect_server("client2");
+    get_msg(client1); // get CONNACK
+
+    // send PUBs, all are acked by the server
+    const size_t WINDOW = 64;
+    const size_t MORE = 3;
+    for (size_t i = 0; i < WINDOW + MORE; i++)
+    {
+        std::string msg = std::to_string(i);
+        client1->publish(topic, msg, AT_LEAST_ONCE);
+    }
+    for (size_t i = 0; i < WINDOW + MORE; i++)
+    {
+        auto msg1 = get_msg(client1);
+        assert(client1->unpack_ack(msg1).header.bits.type == uint8_t(packet_type::PUBACK));
+    }
+
+    // 1st recieves the window in order
+    std::vector<uint16_t> pktIDs;
+    for (size_t i = 0; i < WINDOW; i++)
+    {
+        auto msg01 = get_msg(client0);
+        auto pub = client0->unpack_publish(msg01);
+        assert(pub.header.bits.qos == AT_LEAST_ONCE);
+        assert(pub.payload == std::to_string(i));
+        pktIDs.push_back(pub.pktID);
+    }
+
+    // rest waits for acks, so PINGRESP comes next
+    client0->pingreq();
+    auto msg02 = get_msg(client0);
+    assert(msg02.hdr.byte.bits.type == uint8_t(packet_type::PINGRESP));
+
+    // each PUBACK lets one more msg through
+    for (size_t i = 0; i < MORE; i++)
+    {
+        client0->send_ack(packet_type::PUBACK, pktIDs[i]);
+        auto msg03 = get_msg(client0);
+        auto pub = client0->unpack_publish(msg03);
+        assert(pub.payload == std::to_string(WINDOW + i));
+    }
+    }
+
+    { // unacked msgs are resent when the session is resumed: PUBREL of the msg that got PUBREC, PUBLISH with DUP
+        std::cout << "#2\n";
+
+    // connect first time to drop client's session if it exists
+    auto client0 = create_client();
+    client0->connect_server("client3", CLEAN_SESSION_TRUE);
+    get_msg(client0); // get CONNACK
+    client0->send_disconnect();
+
+    // 1st client with persistent session
+    auto client1 = create_client();
+    client1->connect_server("client3", CLEAN_SESSION_FALSE);
+    get_msg(client1); // get CONNACK
+
+    // send SUB
+    std::vector<std::pair<std::string, uint8_t>> topics;
+    std::string topic = "/resume";
+    topics.emplace_back(topic, EXACTLY_ONCE);
+    client1->subscribe(topics);
+    get_msg(client1); // get SUBACK
+
+    // 2nd client
+    auto client2 = create_client();
+    client2->connect_server("client4");
+    get_msg(client2); // get CONNACK
+
+    // send PUB with qos 2, PUBREC, PUBREL, PUBCOMP
+    std::string msg2 = "qos2";
+    client2->publish(topic, msg2, EXACTLY_ONCE);
+    auto msg21 = get_msg(client2);
+    auto ack21 = client2->unpack_ack(msg21);
+    assert(ack21.header.bits.type == uint8_t(packet_type::PUBREC));
+    client2->send_ack(packet_type::PUBREL, ack21.pktID);
+    get_msg(client2); // get PUBCOMP
+
+    // 1st recieves PUB, sends PUBREC and doesn't complete
+    auto msg11 = get_msg(client1);
+    auto pub2 = client1->unpack_publish(msg11);
+    assert(pub2.header.bits.qos == EXACTLY_ONCE);
+    client1->send_ack(packet_type::PUBREC, pub2.pktID);
+    auto msg12 = get_msg(client1);
+    assert(client1->unpack_ack(msg12).header.bits.type == uint8_t(packet_type::PUBREL));
+
+    // send PUB with qos 1
+    std::string msg1 = "qos1";
+    client2->publish(topic, msg1, AT_LEAST_ONCE);
+    get_msg(client2); // get PUBACK
+
+    // 1st recieves PUB and doesn't ack
+    auto msg13 = get_msg(client1);
+    auto pub1 = client1->unpack_publish(msg13);
+    assert(pub1.header.bits.qos == AT_LEAST_ONCE);
+    assert(pub1.header.bits.dup == 0);
+
+    // disconnect - session should be stored with both msgs in flight
+    client1->send_disconnect();
+
+    // connect again with same id to restore session
+    auto client3 = create_client();
+    client3->connect_server("client3", CLEAN_SESSION_FALSE);
+    auto msg31 = get_msg(client3);
+    auto connack = client3->unpack_connack(msg31);
+    assert(connack.sp.byte == 1);
+
+    // PUBREL resent [MQTT-4.4.0-1]
+    auto msg32 = get_msg(client3);
+    auto ack32 = client3->unpack_ack(msg32);
+    assert(ack32.header.bits.type == uint8_t(packet_type::PUBREL));
+    assert(ack32.pktID == pub2.pktID);
+
+    // PUBLISH resent with DUP [MQTT-3.3.1-1]
+    auto msg33 = get_msg(client3);
+    auto pub = client3->unpack_publish(msg33);
+    assert(pub.header.bits.dup == 1);
+    assert(pub.header.bits.qos == AT_LEAST_ONCE);
+    assert(pub.pktID == pub1.pktID);
+    assert(pub.payload == msg1);
+
+    client3->send_ack(packet_type::PUBCOMP, pub2.pktID);
+    client3->send_ack(packet_type::PUBACK, pub.pktID);
+    client3->send_disconnect();
+    }
+
+    { // msg big enough to be streamed by the server is resent whole on session resume
+        std::cout << "#3\n";
+
+    // connect first time to drop client's session if it exists
+    auto client0 = create_client();
+    client0->connect_server("client5", CLEAN_SESSION_TRUE);
+    get_msg(client0); // get CONNACK
+    client0->send_disconnect();
+
+    // 1st client with persistent session
+    auto client1 = create_client();
+    client1->connect_server("client5", CLEAN_SESSION_FALSE);
+    get_msg(client1); // get CONNACK
+
+    // send SUB
+    std::vector<std::pair<std::string, uint8_t>> topics;
+    std::string topic = "/stream";
+    topics.emplace_back(topic, AT_LEAST_ONCE);
+    client1->subscribe(topics);
+    get_msg(client1); // get SUBACK
+
+    // 2nd client
+    auto client2 = create_client();
+    client2->connect_server("client6");
+    get_msg(client2); // get CONNACK
+
+    // send PUB over the server's stream threshold (1 MB)
+    std::string msg(2 * 1024 * 1024, 's');
+    msg.back() = 'e';
+    client2->publish(topic, msg, AT_LEAST_ONCE);
+    get_msg(client2); // get PUBACK
+
+    // 1st recieves PUB and doesn't ack
+    auto msg11 = get_msg(client1);
+    auto pub1 = client1->unpack_publish(msg11);
+    assert(pub1.header.bits.qos == AT_LEAST_ONCE);
+    assert(pub1.payload == msg);
+
+    // disconnect - session should be stored with the msg in flight
+    client1->send_disconnect();
+
+    // connect again with same id to restore session
+    auto client3 = create_client();
+    client3->connect_server("client5", CLEAN_SESSION_FALSE);
+    auto msg31 = get_msg(client3);
+    auto connack = client3->unpack_connack(msg31);
+    assert(connack.sp.byte == 1);
+
+    // PUBLISH resent whole with DUP
+    auto msg32 = get_msg(client3);
+    auto pub = client3->unpack_publish(msg32);
+    assert(pub.header.bits.dup == 1);
+    assert(pub.pktID == pub1.pktID);
+    assert(pub.payload == msg);
+
+    client3->send_ack(packet_type::PUBACK, pub.pktID);
+    client3->send_disconnect();
+    }
+}
+
+void test_packet_ids()
+{
+    { // 1st client subs to topic with qos 1, 2nd client publishes more qos 1 msgs than there are packet IDs
+        std::cout << "#1\n";
+
+    // 1st client
+    auto client0 = create_client();
+    client0->connect_server("client1");
+    get_msg(client0); // get CONNACK
+
+    // send SUB
+    std::vector<std::pair<std::string, uint8_t>> topics;
+    std::string topic = "/ids";
+    topics.emplace_back(topic, AT_LEAST_ONCE);
+    client0->subscribe(topics);
+    get_msg(client0); // get SUBACK
+
+    // 2nd client
+    auto client1 = create_client();
+    client1->connect_server("client2");
+    get_msg(client1); // get CONNACK
+
+    // send PUBs
+    const size_t MSGS = 70000;
+    for (size_t i = 0; i < MSGS; i++)
+    {
+        std::string msg = std::to_string(i);
+        client1->publish(topic, msg, AT_LEAST_ONCE);
+    }
+
+    // 1st recieves all of them in order and acks each one, IDs are reused and never 0 [MQTT-2.3.1-1]
+    for (size_t i = 0; i < MSGS; i++)
+    {
+        auto msg01 = get_msg(client0);
+        auto pub = client0->unpack_publish(msg01);
+        assert(pub.header.bits.qos == AT_LEAST_ONCE);
+        assert(pub.payload == std::to_string(i));
+        assert(pub.pktID != 0);
+        client0->send_ack(packet_type::PUBACK, pub.pktID);
+    }
+
+    // every PUB is acked
+    for (size_t i = 0; i < MSGS; i++)
+    {
+        auto msg1 = get_msg(client1);
+        assert(client1->unpack_ack(msg1).header.bits.type == uint8_t(packet_type::PUBACK));
+    }
+    }
+}
+
 int main()
 {
     test_connect();
     test_publish();
+    test_inflight();
+    test_packet_ids();
 
     std::cout << "END\n";
     return 0;